@@ -1,9 +1,11 @@
 #version 330 core
 uniform mat4 u_view_projection;
+uniform float u_point_size; // pixels at unit distance from the eye
 
 layout (location = 0) in vec3 aPos;
 
 void main()
 {
     gl_Position = u_view_projection * vec4(aPos, 1.0);
+    gl_PointSize = max(1.0, u_point_size / gl_Position.w);
 }
@@ -0,0 +1,123 @@
+#include "binary_io.h"
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+bool MappedFile::open(const string &filename) {
+  close();
+
+#ifdef _WIN32
+  FILE *f = fopen(filename.c_str(), "rb");
+  if (f == NULL) return false;
+  _fseeki64(f, 0, SEEK_END);
+  length = (size_t)_ftelli64(f);
+  _fseeki64(f, 0, SEEK_SET);
+  buffer.resize(length > 0 ? length : 1);
+  bool ok = fread(buffer.data(), 1, length, f) == length;
+  fclose(f);
+  if (!ok) {
+    close();
+    return false;
+  }
+  ptr = buffer.data();
+  return true;
+#else
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    ::close(fd);
+    return false;
+  }
+  length = (size_t)st.st_size;
+
+  void *p = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd); // the mapping keeps its own reference to the file
+  if (p == MAP_FAILED) {
+    length = 0;
+    return false;
+  }
+  ptr = (const char *)p;
+  mapped = true;
+  return true;
+#endif
+}
+
+void MappedFile::close() {
+#ifndef _WIN32
+  if (mapped) munmap((void *)ptr, length);
+#endif
+  ptr = NULL;
+  length = 0;
+  mapped = false;
+  vector<char>().swap(buffer);
+}
+
+bool BinaryWriter::open(const string &filename, const char *mode) {
+  close();
+  failed = false;
+  file = fopen(filename.c_str(), mode);
+  if (file != NULL) {
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+  }
+  return file != NULL;
+}
+
+bool BinaryWriter::close() {
+  if (file == NULL) return !failed;
+  if (fclose(file) != 0) failed = true;
+  file = NULL;
+  return !failed;
+}
+
+uint64_t BinaryWriter::tell() {
+#ifdef _WIN32
+  return (uint64_t)_ftelli64(file);
+#else
+  return (uint64_t)ftello(file);
+#endif
+}
+
+bool BinaryWriter::seek(uint64_t offset) {
+#ifdef _WIN32
+  bool ok = _fseeki64(file, (__int64)offset, SEEK_SET) == 0;
+#else
+  bool ok = fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#endif
+  if (!ok) failed = true;
+  return ok;
+}
+
+bool BinaryWriter::truncate(uint64_t size) {
+  fflush(file);
+#ifdef _WIN32
+  bool ok = _chsize_s(_fileno(file), (__int64)size) == 0;
+#else
+  bool ok = ftruncate(fileno(file), (off_t)size) == 0;
+#endif
+  if (!ok) failed = true;
+  return ok && seek(size);
+}
+
+void BinaryWriter::write_bytes(const void *data, size_t size) {
+  if (file == NULL || size == 0) return;
+  if (fwrite(data, 1, size, file) != size) failed = true;
+}
+
+void BinaryWriter::pad_to(size_t alignment) {
+  static const char zeros[BINARY_ALIGNMENT] = {0};
+  uint64_t offset = tell();
+  size_t padding = (alignment - offset % alignment) % alignment;
+  while (padding > 0) {
+    size_t n = padding < sizeof(zeros) ? padding : sizeof(zeros);
+    write_bytes(zeros, n);
+    padding -= n;
+  }
+}
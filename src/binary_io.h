@@ -0,0 +1,137 @@
+#ifndef BINARY_IO_H
+#define BINARY_IO_H
+
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// All binary files written by the simulator are little-endian, with every
+// array aligned to BINARY_ALIGNMENT bytes so a memory-mapped file can be used
+// in place on little-endian hosts.
+#define BINARY_ALIGNMENT 64
+
+// Section and chunk tags are four characters read as a little-endian uint32
+#define FOURCC(a, b, c, d) ((uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+
+inline uint64_t align_offset(uint64_t offset, uint64_t alignment = BINARY_ALIGNMENT) {
+  return (offset + alignment - 1) / alignment * alignment;
+}
+
+inline bool host_is_little_endian() {
+  const uint16_t one = 1;
+  return *(const uint8_t *)&one == 1;
+}
+
+inline void byte_swap(void *data, size_t size) {
+  uint8_t *b = (uint8_t *)data;
+  for (size_t i = 0; i < size / 2; i++) {
+    uint8_t tmp = b[i];
+    b[i] = b[size - 1 - i];
+    b[size - 1 - i] = tmp;
+  }
+}
+
+// Copies count little-endian values of type T from src to dst
+template <typename T>
+inline void read_le(T *dst, const void *src, size_t count = 1) {
+  memcpy(dst, src, count * sizeof(T));
+  if (!host_is_little_endian()) {
+    for (size_t i = 0; i < count; i++) byte_swap(&dst[i], sizeof(T));
+  }
+}
+
+// Read-only mapping of a whole file. On platforms without mmap the file is
+// read into memory instead, so callers never have to care which one they got.
+struct MappedFile {
+  MappedFile() {}
+  ~MappedFile() { close(); }
+
+  bool open(const string &filename);
+  void close();
+
+  bool is_open() const { return ptr != NULL; }
+  const char *data() const { return ptr; }
+  size_t size() const { return length; }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+private:
+  const char *ptr = NULL;
+  size_t length = 0;
+  bool mapped = false;
+  vector<char> buffer;
+};
+
+// Buffered writer that stores every value little-endian
+struct BinaryWriter {
+  BinaryWriter() {}
+  ~BinaryWriter() { close(); }
+
+  // mode is passed to fopen, e.g. "wb" to truncate or "r+b" to append in place
+  bool open(const string &filename, const char *mode = "wb");
+  bool close();
+
+  bool is_open() const { return file != NULL; }
+  bool good() const { return file != NULL && !failed; }
+
+  uint64_t tell();
+  bool seek(uint64_t offset);
+  bool truncate(uint64_t size);
+
+  void write_bytes(const void *data, size_t size);
+  void pad_to(size_t alignment = BINARY_ALIGNMENT);
+
+  template <typename T>
+  void write(const T &value) { write_array(&value, 1); }
+
+  template <typename T>
+  void write_array(const T *values, size_t count) {
+    if (host_is_little_endian()) {
+      write_bytes(values, count * sizeof(T));
+      return;
+    }
+    for (size_t i = 0; i < count; i++) {
+      T tmp = values[i];
+      byte_swap(&tmp, sizeof(T));
+      write_bytes(&tmp, sizeof(T));
+    }
+  }
+
+  BinaryWriter(const BinaryWriter &) = delete;
+  BinaryWriter &operator=(const BinaryWriter &) = delete;
+
+private:
+  FILE *file = NULL;
+  bool failed = false;
+};
+
+// Items serialized per parallel task by write_chunked
+#define WRITE_CHUNK_SIZE (1 << 16)
+
+// Serializes count items in parallel, in chunks of WRITE_CHUNK_SIZE, where
+// fill(first, last, buffer) appends items [first, last) to buffer, then writes
+// the chunks in order. The output does not depend on the number of threads.
+template <typename Fill>
+void write_chunked(BinaryWriter *out, size_t count, Fill fill) {
+  int64_t num_chunks = (count + WRITE_CHUNK_SIZE - 1) / WRITE_CHUNK_SIZE;
+  vector<vector<char>> chunks(num_chunks);
+
+  #pragma omp parallel for schedule(dynamic)
+  for (int64_t c = 0; c < num_chunks; c++) {
+    size_t first = c * WRITE_CHUNK_SIZE;
+    size_t last = min(count, first + WRITE_CHUNK_SIZE);
+    fill(first, last, &chunks[c]);
+  }
+
+  for (const vector<char> &chunk : chunks) {
+    out->write_bytes(chunk.data(), chunk.size());
+  }
+}
+
+#endif /* BINARY_IO_H */
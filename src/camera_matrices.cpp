@@ -0,0 +1,60 @@
+#include <Eigen/Geometry>
+
+#include "CGL/CGL.h"
+
+#include "camera_matrices.h"
+
+using namespace Eigen;
+
+// ----------------------------------------------------------------------------
+// CAMERA CALCULATIONS
+//
+// OpenGL 3.1 deprecated the fixed pipeline, so we lose a lot of useful OpenGL
+// functions that have to be recreated here.
+// ----------------------------------------------------------------------------
+
+Matrix4f getProjectionMatrix(const CGL::Camera &camera) {
+    Matrix4f perspective;
+    perspective.setZero();
+
+    double cam_near = camera.near_clip();
+    double cam_far = camera.far_clip();
+
+    double theta = camera.v_fov() * PI / 360;
+    double range = cam_far - cam_near;
+    double invtan = 1. / tanf(theta);
+
+    perspective(0, 0) = invtan / camera.aspect_ratio();
+    perspective(1, 1) = invtan;
+    perspective(2, 2) = -(cam_near + cam_far) / range;
+    perspective(3, 2) = -1;
+    perspective(2, 3) = -2 * cam_near * cam_far / range;
+    perspective(3, 3) = 0;
+
+    return perspective;
+}
+
+Matrix4f getViewMatrix(const CGL::Camera &camera) {
+    Matrix4f lookAt;
+    Matrix3f R;
+
+    lookAt.setZero();
+
+    CGL::Vector3D c_pos = camera.position();
+    CGL::Vector3D c_udir = camera.up_dir();
+    CGL::Vector3D c_target = camera.view_point();
+
+    Vector3f eye(c_pos.x, c_pos.y, c_pos.z);
+    Vector3f up(c_udir.x, c_udir.y, c_udir.z);
+    Vector3f target(c_target.x, c_target.y, c_target.z);
+
+    R.col(2) = (eye - target).normalized();
+    R.col(0) = up.cross(R.col(2)).normalized();
+    R.col(1) = R.col(2).cross(R.col(0));
+
+    lookAt.topLeftCorner<3, 3>() = R.transpose();
+    lookAt.topRightCorner<3, 1>() = -R.transpose() * eye;
+    lookAt(3, 3) = 1.0f;
+
+    return lookAt;
+}
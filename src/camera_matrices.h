@@ -0,0 +1,15 @@
+#ifndef CAMERA_MATRICES_H
+#define CAMERA_MATRICES_H
+
+#include <nanogui/common.h>
+
+#include "camera.h"
+
+using nanogui::Matrix4f;
+
+// OpenGL style view and projection matrices of a camera, shared by the
+// viewer's shaders and the software renderer.
+Matrix4f getProjectionMatrix(const CGL::Camera &camera);
+Matrix4f getViewMatrix(const CGL::Camera &camera);
+
+#endif /* CAMERA_MATRICES_H */
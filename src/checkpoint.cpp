@@ -0,0 +1,299 @@
+#include <iostream>
+#include <stdio.h>
+
+#include "binary_io.h"
+#include "checkpoint.h"
+
+using namespace std;
+
+#define HEADER_SIZE 64
+#define SECTION_ENTRY_SIZE 24
+
+const uint32_t SECTION_PARAMS = FOURCC('P', 'A', 'R', 'M');
+const uint32_t SECTION_INT_PARAMS = FOURCC('I', 'P', 'R', 'M');
+const uint32_t SECTION_ACCELERATIONS = FOURCC('A', 'C', 'C', 'L');
+const uint32_t SECTION_PLANES = FOURCC('P', 'L', 'A', 'N');
+const uint32_t SECTION_START_POSITIONS = FOURCC('S', 'P', 'O', 'S');
+const uint32_t SECTION_POSITIONS = FOURCC('P', 'O', 'S', 'I');
+const uint32_t SECTION_VELOCITIES = FOURCC('V', 'E', 'L', 'O');
+const uint32_t SECTION_SLEEP = FOURCC('S', 'L', 'E', 'P');
+const uint32_t SECTION_SLEEP_LAMBDAS = FOURCC('S', 'L', 'A', 'M');
+
+void CheckpointWriter::save(const string &filename, const Fluid &fluid, const RunState &run) {
+  wait();
+
+  num_steps = fluid.num_steps;
+  frame = run.frame;
+
+  double p[] = {fluid.h, fluid.epsilon, fluid.s_corr_constant, fluid.viscosity_constant,
+                fluid.rho_0, fluid.pmass, fluid.particle_radius, fluid.particle_bounce,
+                run.frames_per_sec};
+  params.assign(p, p + sizeof(p) / sizeof(p[0]));
+  int64_t ip[] = {fluid.solver_iterations, run.simulation_steps, fluid.deterministic,
+                  (int64_t)fluid.generator.seed};
+  int_params.assign(ip, ip + sizeof(ip) / sizeof(ip[0]));
+
+  accelerations.clear();
+  for (const Vector3D &a : run.external_accelerations) {
+    accelerations.push_back(a.x);
+    accelerations.push_back(a.y);
+    accelerations.push_back(a.z);
+  }
+  planes.clear();
+  for (const Plane &plane : run.collision_objects) {
+    double values[] = {plane.point.x, plane.point.y, plane.point.z,
+                       plane.normal.x, plane.normal.y, plane.normal.z, plane.friction};
+    planes.insert(planes.end(), values, values + 7);
+  }
+
+  // The buffers keep their capacity between checkpoints, so this is a plain copy
+  int64_t n = fluid.particles.size();
+  start_positions.resize(n * 3);
+  positions.resize(n * 3);
+  velocities.resize(n * 3);
+
+  #pragma omp parallel for
+  for (int64_t i = 0; i < n; i++) {
+    const Particle &pt = fluid.particles[i];
+    start_positions[i * 3] = pt.start_position.x;
+    start_positions[i * 3 + 1] = pt.start_position.y;
+    start_positions[i * 3 + 2] = pt.start_position.z;
+    positions[i * 3] = pt.position.x;
+    positions[i * 3 + 1] = pt.position.y;
+    positions[i * 3 + 2] = pt.position.z;
+    velocities[i * 3] = pt.velocity.x;
+    velocities[i * 3 + 1] = pt.velocity.y;
+    velocities[i * 3 + 2] = pt.velocity.z;
+  }
+
+  sleep.clear();
+  sleep_lambdas.clear();
+  if (fluid.use_sleeping && fluid.asleep.size() == n && fluid.still_steps.size() == n) {
+    sleep.resize(2 + 2 * n);
+    sleep_lambdas.resize(1 + n);
+    sleep[0] = CHECKPOINT_SLEEP_VERSION;
+    sleep[1] = n;
+    sleep_lambdas[0] = CHECKPOINT_SLEEP_VERSION;
+    for (int64_t i = 0; i < n; i++) {
+      sleep[2 + i] = fluid.still_steps[i];
+      sleep[2 + n + i] = fluid.asleep[i];
+      sleep_lambdas[1 + i] = fluid.asleep[i] ? fluid.particles[i].lambda : 0;
+    }
+  }
+
+  worker = thread([this, filename]() { ok = write(filename); });
+}
+
+bool CheckpointWriter::wait() {
+  if (worker.joinable()) worker.join();
+  return ok;
+}
+
+// Writes to a temporary file first so a run that is killed mid-write keeps
+// its previous checkpoint
+bool CheckpointWriter::write(const string &filename) {
+  string tmp_filename = filename + ".tmp";
+  BinaryWriter out;
+  if (!out.open(tmp_filename)) {
+    cout << "Could not open " << tmp_filename << " for writing" << endl;
+    return false;
+  }
+
+  struct Section {
+    uint32_t tag;
+    const void *data;
+    uint64_t size;
+    bool integer; // int64 rather than double values
+  };
+  Section sections[] = {
+    {SECTION_PARAMS, params.data(), params.size() * sizeof(double), false},
+    {SECTION_INT_PARAMS, int_params.data(), int_params.size() * sizeof(int64_t), true},
+    {SECTION_ACCELERATIONS, accelerations.data(), accelerations.size() * sizeof(double), false},
+    {SECTION_PLANES, planes.data(), planes.size() * sizeof(double), false},
+    {SECTION_START_POSITIONS, start_positions.data(), start_positions.size() * sizeof(double), false},
+    {SECTION_POSITIONS, positions.data(), positions.size() * sizeof(double), false},
+    {SECTION_VELOCITIES, velocities.data(), velocities.size() * sizeof(double), false},
+    {SECTION_SLEEP, sleep.data(), sleep.size() * sizeof(int64_t), true},
+    {SECTION_SLEEP_LAMBDAS, sleep_lambdas.data(), sleep_lambdas.size() * sizeof(double), false},
+  };
+  // the sleep sections go last, and are left out when there is no sleep state
+  uint32_t num_sections = sizeof(sections) / sizeof(sections[0]) - (sleep.empty() ? 2 : 0);
+
+  out.write_bytes(CHECKPOINT_MAGIC, 8);
+  out.write((uint32_t)CHECKPOINT_VERSION);
+  out.write(num_sections);
+  out.write((uint64_t)(positions.size() / 3));
+  out.write(num_steps);
+  out.write(frame);
+  out.pad_to();
+
+  uint64_t offset = align_offset(HEADER_SIZE + num_sections * SECTION_ENTRY_SIZE);
+  for (uint32_t i = 0; i < num_sections; i++) {
+    out.write(sections[i].tag);
+    out.write((uint32_t)0);
+    out.write(offset);
+    out.write(sections[i].size);
+    offset = align_offset(offset + sections[i].size);
+  }
+
+  for (uint32_t i = 0; i < num_sections; i++) {
+    out.pad_to();
+    if (sections[i].integer) {
+      out.write_array((const int64_t *)sections[i].data, sections[i].size / sizeof(int64_t));
+    } else {
+      out.write_array((const double *)sections[i].data, sections[i].size / sizeof(double));
+    }
+  }
+
+  if (!out.close()) {
+    cout << "Failed writing checkpoint " << tmp_filename << endl;
+    return false;
+  }
+
+#ifdef _WIN32
+  remove(filename.c_str());
+#endif
+  if (rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+    cout << "Could not move checkpoint to " << filename << endl;
+    return false;
+  }
+  return true;
+}
+
+// Returns the section with the given tag, or NULL if there is none
+static const char *find_section(const MappedFile &file, uint32_t tag, uint64_t *size) {
+  uint32_t num_sections;
+  read_le(&num_sections, file.data() + 12);
+  if (HEADER_SIZE + (uint64_t)num_sections * SECTION_ENTRY_SIZE > file.size()) return NULL;
+
+  for (uint32_t i = 0; i < num_sections; i++) {
+    const char *entry = file.data() + HEADER_SIZE + i * SECTION_ENTRY_SIZE;
+    uint32_t entry_tag;
+    uint64_t offset;
+    read_le(&entry_tag, entry);
+    read_le(&offset, entry + 8);
+    read_le(size, entry + 16);
+    if (entry_tag == tag && offset + *size <= file.size()) {
+      return file.data() + offset;
+    }
+  }
+  return NULL;
+}
+
+bool load_checkpoint(const string &filename, Fluid *fluid, RunState *run) {
+  MappedFile file;
+  if (!file.open(filename)) {
+    cout << "Could not open checkpoint " << filename << endl;
+    return false;
+  }
+  if (file.size() < HEADER_SIZE || memcmp(file.data(), CHECKPOINT_MAGIC, 8) != 0) {
+    cout << filename << " is not a checkpoint" << endl;
+    return false;
+  }
+
+  uint32_t version;
+  uint64_t n;
+  read_le(&version, file.data() + 8);
+  read_le(&n, file.data() + 16);
+  if (version != CHECKPOINT_VERSION) {
+    cout << filename << " has unsupported version " << version << endl;
+    return false;
+  }
+
+  uint64_t params_size, int_params_size, accelerations_size, planes_size;
+  uint64_t start_size, positions_size, velocities_size;
+  const char *params = find_section(file, SECTION_PARAMS, &params_size);
+  const char *int_params = find_section(file, SECTION_INT_PARAMS, &int_params_size);
+  const char *accelerations = find_section(file, SECTION_ACCELERATIONS, &accelerations_size);
+  const char *planes = find_section(file, SECTION_PLANES, &planes_size);
+  const char *start_positions = find_section(file, SECTION_START_POSITIONS, &start_size);
+  const char *positions = find_section(file, SECTION_POSITIONS, &positions_size);
+  const char *velocities = find_section(file, SECTION_VELOCITIES, &velocities_size);
+
+  uint64_t array_size = n * 3 * sizeof(double);
+  if (!params || params_size < 9 * sizeof(double) || !int_params ||
+      int_params_size < 4 * sizeof(int64_t) || !accelerations || !planes ||
+      !start_positions || start_size != array_size || !positions ||
+      positions_size != array_size || !velocities || velocities_size != array_size) {
+    cout << "Checkpoint " << filename << " is incomplete" << endl;
+    return false;
+  }
+
+  double p[9];
+  int64_t ip[4];
+  read_le(p, params, 9);
+  read_le(ip, int_params, 4);
+  fluid->h = p[0];
+  fluid->epsilon = p[1];
+  fluid->s_corr_constant = p[2];
+  fluid->viscosity_constant = p[3];
+  fluid->rho_0 = p[4];
+  fluid->pmass = p[5];
+  fluid->particle_radius = p[6];
+  fluid->particle_bounce = p[7];
+  run->frames_per_sec = p[8];
+  fluid->solver_iterations = (int)ip[0];
+  run->simulation_steps = (int)ip[1];
+  fluid->deterministic = ip[2] != 0;
+  fluid->generator.seed = (uint64_t)ip[3];
+
+  read_le(&fluid->num_steps, file.data() + 24);
+  read_le(&run->frame, file.data() + 32);
+
+  run->external_accelerations.clear();
+  for (uint64_t i = 0; i + 3 <= accelerations_size / sizeof(double); i += 3) {
+    double a[3];
+    read_le(a, accelerations + i * sizeof(double), 3);
+    run->external_accelerations.push_back(Vector3D(a[0], a[1], a[2]));
+  }
+  run->collision_objects.clear();
+  for (uint64_t i = 0; i + 7 <= planes_size / sizeof(double); i += 7) {
+    double v[7];
+    read_le(v, planes + i * sizeof(double), 7);
+    run->collision_objects.push_back(Plane(Vector3D(v[0], v[1], v[2]), Vector3D(v[3], v[4], v[5]), v[6]));
+  }
+
+  fluid->particles.assign(n, Particle(Vector3D(0)));
+  fluid->num_particles = n;
+
+  #pragma omp parallel for
+  for (int64_t i = 0; i < (int64_t)n; i++) {
+    double s[3], x[3], v[3];
+    read_le(s, start_positions + i * 3 * sizeof(double), 3);
+    read_le(x, positions + i * 3 * sizeof(double), 3);
+    read_le(v, velocities + i * 3 * sizeof(double), 3);
+    Particle &pt = fluid->particles[i];
+    pt = Particle(Vector3D(s[0], s[1], s[2]));
+    pt.position = pt.next_position = Vector3D(x[0], x[1], x[2]);
+    pt.velocity = Vector3D(v[0], v[1], v[2]);
+  }
+
+  // Sleep state, if the run had any. Without it every particle starts awake.
+  fluid->asleep.clear();
+  fluid->still_steps.clear();
+  fluid->num_asleep = 0;
+  uint64_t sleep_size, lambdas_size;
+  const char *sleep = find_section(file, SECTION_SLEEP, &sleep_size);
+  const char *lambdas = find_section(file, SECTION_SLEEP_LAMBDAS, &lambdas_size);
+  if (sleep && lambdas) {
+    int64_t head[2] = {0, 0};
+    double lambdas_version = 0;
+    if (sleep_size >= 2 * sizeof(int64_t)) read_le(head, sleep, 2);
+    if (lambdas_size >= sizeof(double)) read_le(&lambdas_version, lambdas);
+    if (head[0] != CHECKPOINT_SLEEP_VERSION || head[1] != (int64_t)n ||
+        sleep_size != (2 + 2 * n) * sizeof(int64_t) ||
+        lambdas_version != CHECKPOINT_SLEEP_VERSION || lambdas_size != (1 + n) * sizeof(double)) {
+      cout << "Ignoring unsupported sleep state in " << filename << endl;
+    } else {
+      vector<int64_t> values(2 * n);
+      read_le(values.data(), sleep + 2 * sizeof(int64_t), 2 * n);
+      fluid->still_steps.assign(values.begin(), values.begin() + n);
+      fluid->asleep.assign(values.begin() + n, values.end());
+      for (uint64_t i = 0; i < n; i++) {
+        read_le(&fluid->particles[i].lambda, lambdas + (1 + i) * sizeof(double));
+        fluid->num_asleep += fluid->asleep[i];
+      }
+    }
+  }
+  return true;
+}
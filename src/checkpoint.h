@@ -0,0 +1,93 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "CGL/CGL.h"
+#include "collision/plane.h"
+#include "fluid.h"
+
+using namespace CGL;
+using namespace std;
+
+// Checkpoint / restart of the full solver state.
+//
+// File layout (little-endian, version CHECKPOINT_VERSION):
+//   64-byte header: magic, version, section count, particle count, step and
+//                   frame counters
+//   section table:  one {tag, reserved, offset, size} entry per section
+//   sections:       each 64-byte aligned, so the particle arrays can be used
+//                   in place from a memory mapping
+//
+// Readers look sections up by tag and skip tags they do not know, so new
+// sections can be added without breaking older files.
+//
+// Sections added after version 1 start with their own version, so they can
+// change layout without bumping the file version. While particles can sleep
+// two more are written, both version CHECKPOINT_SLEEP_VERSION:
+//   SLEP: int64 version, particle count, then still_steps and asleep of
+//         every particle, as int64
+//   SLAM: double version, then lambda of every particle. Sleepers keep the
+//         lambda they fell asleep with, and their awake neighbors read it.
+
+#define CHECKPOINT_MAGIC "PBFCHKPT"
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_SLEEP_VERSION 1
+
+// Run settings and counters that live outside of Fluid
+struct RunState {
+  RunState() {}
+
+  uint64_t frame = 0;
+  double frames_per_sec = 15;
+  int simulation_steps = 2;
+  vector<Vector3D> external_accelerations;
+  vector<Plane> collision_objects;
+};
+
+// Writes checkpoints on a background thread. save() only copies the state into
+// buffers owned by the writer, so the simulation can keep stepping while the
+// previous snapshot is written out.
+struct CheckpointWriter {
+  CheckpointWriter() {}
+  ~CheckpointWriter() { wait(); }
+
+  // Snapshots fluid and run and starts writing them to filename. Waits for a
+  // checkpoint that is still being written first.
+  void save(const string &filename, const Fluid &fluid, const RunState &run);
+
+  // Blocks until the current write has finished, returns whether it succeeded
+  bool wait();
+
+  bool busy() const { return worker.joinable(); }
+
+  CheckpointWriter(const CheckpointWriter &) = delete;
+  CheckpointWriter &operator=(const CheckpointWriter &) = delete;
+
+private:
+  bool write(const string &filename);
+
+  thread worker;
+  bool ok = true;
+
+  // snapshot
+  uint64_t num_steps;
+  uint64_t frame;
+  vector<double> params;
+  vector<int64_t> int_params;
+  vector<double> accelerations;
+  vector<double> planes;
+  vector<double> start_positions;
+  vector<double> positions;
+  vector<double> velocities;
+  vector<int64_t> sleep;
+  vector<double> sleep_lambdas;
+};
+
+// Restores fluid and run from a checkpoint written by CheckpointWriter
+bool load_checkpoint(const string &filename, Fluid *fluid, RunState *run);
+
+#endif /* CHECKPOINT_H */
@@ -0,0 +1,238 @@
+#include <iostream>
+#include <stdio.h>
+
+#include "binary_io.h"
+#include "exporters.h"
+
+using namespace std;
+
+// VTK cell type of a single point
+#define VTK_VERTEX 1
+
+// The per-particle scalars every format carries, in output order
+#define NUM_FIELDS 8
+static const char *FIELD_NAMES[NUM_FIELDS] = {"x", "y", "z", "vx", "vy", "vz", "density", "lambda"};
+
+static void particle_fields(const Particle &p, float *f) {
+  f[0] = p.position.x;
+  f[1] = p.position.y;
+  f[2] = p.position.z;
+  f[3] = p.velocity.x;
+  f[4] = p.velocity.y;
+  f[5] = p.velocity.z;
+  f[6] = p.density_est;
+  f[7] = p.lambda;
+}
+
+template <typename T>
+static void put(char *dst, T value, bool big_endian) {
+  if (big_endian == host_is_little_endian()) byte_swap(&value, sizeof(T));
+  memcpy(dst, &value, sizeof(T));
+}
+
+// Writes components [first_field, first_field + width) of every particle as
+// floats in the given byte order
+static void write_field(BinaryWriter *out, const vector<Particle> &particles, int first_field,
+                        int width, bool big_endian) {
+  write_chunked(out, particles.size(), [&](size_t first, size_t last, vector<char> *buffer) {
+    buffer->resize((last - first) * width * sizeof(float));
+    char *dst = buffer->data();
+    float f[NUM_FIELDS];
+    for (size_t i = first; i < last; i++) {
+      particle_fields(particles[i], f);
+      for (int k = 0; k < width; k++) {
+        put(dst, f[first_field + k], big_endian);
+        dst += sizeof(float);
+      }
+    }
+  });
+}
+
+static void write_text(BinaryWriter *out, const string &text) {
+  out->write_bytes(text.data(), text.size());
+}
+
+static bool export_ply(BinaryWriter *out, const vector<Particle> &particles, uint64_t frame) {
+  string header = "ply\nformat binary_little_endian 1.0\n";
+  header += "comment PBF particles, frame " + to_string(frame) + "\n";
+  header += "element vertex " + to_string(particles.size()) + "\n";
+  for (int k = 0; k < NUM_FIELDS; k++) {
+    header += string("property float ") + FIELD_NAMES[k] + "\n";
+  }
+  header += "end_header\n";
+  write_text(out, header);
+
+  // One interleaved record per vertex
+  write_field(out, particles, 0, NUM_FIELDS, false);
+  return out->good();
+}
+
+static bool export_vtk(BinaryWriter *out, const vector<Particle> &particles, uint64_t frame) {
+  size_t n = particles.size();
+  write_text(out, "# vtk DataFile Version 3.0\nPBF particles, frame " + to_string(frame) +
+                      "\nBINARY\nDATASET POLYDATA\n");
+
+  write_text(out, "POINTS " + to_string(n) + " float\n");
+  write_field(out, particles, 0, 3, true);
+
+  // One vertex cell per point, so viewers draw them without a glyph filter
+  write_text(out, "\nVERTICES " + to_string(n) + " " + to_string(2 * n) + "\n");
+  write_chunked(out, n, [](size_t first, size_t last, vector<char> *buffer) {
+    buffer->resize((last - first) * 2 * sizeof(int32_t));
+    char *dst = buffer->data();
+    for (size_t i = first; i < last; i++) {
+      put(dst, (int32_t)1, true);
+      put(dst + 4, (int32_t)i, true);
+      dst += 8;
+    }
+  });
+
+  write_text(out, "\nPOINT_DATA " + to_string(n) + "\nVECTORS velocity float\n");
+  write_field(out, particles, 3, 3, true);
+  write_text(out, "\nSCALARS density float 1\nLOOKUP_TABLE default\n");
+  write_field(out, particles, 6, 1, true);
+  write_text(out, "\nSCALARS lambda float 1\nLOOKUP_TABLE default\n");
+  write_field(out, particles, 7, 1, true);
+  write_text(out, "\n");
+  return out->good();
+}
+
+static bool export_vtu(BinaryWriter *out, const vector<Particle> &particles, uint64_t frame) {
+  uint64_t n = particles.size();
+
+  // Appended arrays, each preceded by its UInt64 byte count
+  struct Array {
+    const char *name;
+    const char *type;
+    int width;
+    uint64_t bytes;
+  };
+  Array arrays[] = {
+      {"Points", "Float32", 3, n * 3 * 4},       {"connectivity", "Int64", 1, n * 8},
+      {"offsets", "Int64", 1, n * 8},            {"types", "UInt8", 1, n},
+      {"velocity", "Float32", 3, n * 3 * 4},     {"density", "Float32", 1, n * 4},
+      {"lambda", "Float32", 1, n * 4}};
+  uint64_t offsets[7];
+  uint64_t offset = 0;
+  for (int a = 0; a < 7; a++) {
+    offsets[a] = offset;
+    offset += sizeof(uint64_t) + arrays[a].bytes;
+  }
+
+  auto data_array = [&](int a) {
+    char line[256];
+    snprintf(line, sizeof(line),
+             "        <DataArray type=\"%s\" Name=\"%s\" NumberOfComponents=\"%d\" "
+             "format=\"appended\" offset=\"%llu\"/>\n",
+             arrays[a].type, arrays[a].name, arrays[a].width, (unsigned long long)offsets[a]);
+    return string(line);
+  };
+
+  string header = "<?xml version=\"1.0\"?>\n";
+  header += "<!-- PBF particles, frame " + to_string(frame) + " -->\n";
+  header += "<VTKFile type=\"UnstructuredGrid\" version=\"1.0\" byte_order=\"LittleEndian\" "
+            "header_type=\"UInt64\">\n";
+  header += "  <UnstructuredGrid>\n";
+  header += "    <Piece NumberOfPoints=\"" + to_string(n) + "\" NumberOfCells=\"" + to_string(n) + "\">\n";
+  header += "      <Points>\n" + data_array(0) + "      </Points>\n";
+  header += "      <Cells>\n" + data_array(1) + data_array(2) + data_array(3) + "      </Cells>\n";
+  header += "      <PointData Vectors=\"velocity\" Scalars=\"density\">\n" + data_array(4) +
+            data_array(5) + data_array(6) + "      </PointData>\n";
+  header += "    </Piece>\n  </UnstructuredGrid>\n  <AppendedData encoding=\"raw\">\n_";
+  write_text(out, header);
+
+  out->write(arrays[0].bytes);
+  write_field(out, particles, 0, 3, false);
+
+  // Cell i is the single point i, ending at offset i + 1
+  for (int a = 1; a <= 2; a++) {
+    out->write(arrays[a].bytes);
+    write_chunked(out, n, [a](size_t first, size_t last, vector<char> *buffer) {
+      buffer->resize((last - first) * sizeof(int64_t));
+      for (size_t i = first; i < last; i++) {
+        put(buffer->data() + (i - first) * 8, (int64_t)(a == 1 ? i : i + 1), false);
+      }
+    });
+  }
+  out->write(arrays[3].bytes);
+  write_chunked(out, n, [](size_t first, size_t last, vector<char> *buffer) {
+    buffer->assign(last - first, (char)VTK_VERTEX);
+  });
+
+  out->write(arrays[4].bytes);
+  write_field(out, particles, 3, 3, false);
+  out->write(arrays[5].bytes);
+  write_field(out, particles, 6, 1, false);
+  out->write(arrays[6].bytes);
+  write_field(out, particles, 7, 1, false);
+
+  write_text(out, "\n  </AppendedData>\n</VTKFile>\n");
+  return out->good();
+}
+
+static bool export_csv(BinaryWriter *out, const vector<Particle> &particles) {
+  string header;
+  for (int k = 0; k < NUM_FIELDS; k++) {
+    header += string(k ? "," : "") + FIELD_NAMES[k];
+  }
+  write_text(out, header + "\n");
+
+  write_chunked(out, particles.size(), [&](size_t first, size_t last, vector<char> *buffer) {
+    char line[256];
+    for (size_t i = first; i < last; i++) {
+      const Particle &p = particles[i];
+      int length = snprintf(line, sizeof(line), "%.9g,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g\n",
+                            p.position.x, p.position.y, p.position.z, p.velocity.x,
+                            p.velocity.y, p.velocity.z, p.density_est, p.lambda);
+      buffer->insert(buffer->end(), line, line + length);
+    }
+  });
+  return out->good();
+}
+
+bool parse_export_format(const string &name, ExportFormat *format) {
+  if (name == "ply") *format = EXPORT_PLY;
+  else if (name == "vtk") *format = EXPORT_VTK;
+  else if (name == "vtu") *format = EXPORT_VTU;
+  else if (name == "csv") *format = EXPORT_CSV;
+  else return false;
+  return true;
+}
+
+const char *export_extension(ExportFormat format) {
+  switch (format) {
+  case EXPORT_PLY: return "ply";
+  case EXPORT_VTK: return "vtk";
+  case EXPORT_VTU: return "vtu";
+  case EXPORT_CSV: return "csv";
+  }
+  return "";
+}
+
+string export_filename(const string &prefix, uint64_t frame, ExportFormat format) {
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), "_%06llu.", (unsigned long long)frame);
+  return prefix + suffix + export_extension(format);
+}
+
+bool export_particles(const string &filename, const vector<Particle> &particles, uint64_t frame,
+                      ExportFormat format) {
+  BinaryWriter out;
+  if (!out.open(filename)) {
+    cout << "Could not open " << filename << " for writing" << endl;
+    return false;
+  }
+
+  bool ok = false;
+  switch (format) {
+  case EXPORT_PLY: ok = export_ply(&out, particles, frame); break;
+  case EXPORT_VTK: ok = export_vtk(&out, particles, frame); break;
+  case EXPORT_VTU: ok = export_vtu(&out, particles, frame); break;
+  case EXPORT_CSV: ok = export_csv(&out, particles); break;
+  }
+  if (!out.close() || !ok) {
+    cout << "Failed writing " << filename << endl;
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,39 @@
+#ifndef EXPORTERS_H
+#define EXPORTERS_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "particle.h"
+
+using namespace std;
+
+// Particle exporters for external tools. Every format stores position,
+// velocity, density_est and lambda per particle, as 32-bit floats in the
+// binary formats:
+//   EXPORT_PLY  binary little-endian PLY with one vertex element
+//   EXPORT_VTK  legacy VTK polydata (big-endian binary, as the format demands)
+//   EXPORT_VTU  VTK XML unstructured grid with raw appended data
+//   EXPORT_CSV  one text line per particle
+//
+// Particles are serialized in fixed-size chunks in parallel, then written in
+// order, so the output does not depend on the number of threads.
+
+enum ExportFormat {
+  EXPORT_PLY,
+  EXPORT_VTK,
+  EXPORT_VTU,
+  EXPORT_CSV
+};
+
+bool parse_export_format(const string &name, ExportFormat *format);
+const char *export_extension(ExportFormat format);
+
+// e.g. export_filename("out/frame", 12, EXPORT_PLY) is "out/frame_000012.ply"
+string export_filename(const string &prefix, uint64_t frame, ExportFormat format);
+
+bool export_particles(const string &filename, const vector<Particle> &particles, uint64_t frame,
+                      ExportFormat format);
+
+#endif /* EXPORTERS_H */
@@ -1,5 +1,7 @@
 #define _USE_MATH_DEFINES
 
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <math.h>
 #include <random>
@@ -9,6 +11,7 @@
 #include "nanoflann_utils.h"
 #include "fluid.h"
 #include "collision/plane.h"
+#include "rng.h"
 
 using namespace std;
 
@@ -16,12 +19,24 @@ Fluid::Fluid(int num_x, int num_y, int num_z) {
     this->num_x = num_x;
     this->num_y = num_y;
     this->num_z = num_z;
-    this->num_particles = num_x * num_y * num_z;
+    generator.type = GENERATOR_LATTICE;
+    generator.num_x = num_x;
+    generator.num_y = num_y;
+    generator.num_z = num_z;
+    generator.boxes.push_back(FluidBox(Vector3D(-0.2, 0, -0.09), Vector3D(0.2, 0.3, 0.09)));
     buildFluid();
 }
 
-Fluid::Fluid(int num) {
-    this->num_particles = num;
+Fluid::Fluid(int num, uint64_t seed) {
+    generator.type = GENERATOR_RANDOM;
+    generator.seed = seed;
+    generator.num_particles = num;
+    generator.boxes.push_back(FluidBox(Vector3D(-0.4, 0, -0.09), Vector3D(0.4, 0.5, 0.09)));
+    buildFluid();
+}
+
+Fluid::Fluid(const FluidGenerator &generator) {
+    this->generator = generator;
     buildFluid();
 }
 
@@ -30,26 +45,12 @@ Fluid::~Fluid() {
 }
 
 void Fluid::buildFluid() {
-    // USE THIS INSTEAD IF WANT CUBE STARTING POINT
-    //for (int i = 0; i < num_x; i++) {
-    //    for (int j = 0; j < num_y; j++) {
-    //        for (int k = 0; k < num_z; k++) {
-    //            Vector3D pos;
-    //            pos.x = 0.4 / num_x * i - 0.2;
-    //            pos.y = 0.3 / num_y * j;
-    //            pos.z = - 0.18 / num_z * k + 0.09;
-    //            particles.emplace_back(pos);
-    //        }
-    //    }
-    //}
-
-    for (int i = 0; i < num_particles; i++) {
-        Vector3D pos;
-        pos.x = (rand() * 0.8/ RAND_MAX) - 0.4;
-        pos.y = (rand() * 0.5/ RAND_MAX);
-        pos.z = - (rand() * 0.18 / RAND_MAX) + 0.09;
-        particles.emplace_back(pos);
-    }
+    generator.generate(particles, rest_spacing());
+    num_particles = particles.size();
+}
+
+double Fluid::rest_spacing() {
+    return cbrt(pmass / rho_0);
 }
 
 void Fluid::simulate(double frames_per_sec, double simulation_steps, FluidParameters *fp,
@@ -57,97 +58,163 @@ void Fluid::simulate(double frames_per_sec, double simulation_steps, FluidParame
                      vector<Plane *> *collision_objects) {
     double delta_t = 1.0f / frames_per_sec / simulation_steps;
 
+    if (use_sleeping) {
+        wake_disturbed(collision_objects);
+        if (num_asleep == particles.size()) {
+            num_steps++;
+            return;
+        }
+    }
+    auto awake = [this](int i) {
+        return !use_sleeping || !asleep[i];
+    };
 
     // Apply external forces and predict position
+    // The bounds of the predictions are kept for the kd-tree build.
     //----------------------------------
-    for (Particle& p : particles) {
-        for (Vector3D& a : external_accelerations) {
-            p.velocity += delta_t * a;
+    double lo[3] = {INFINITY, INFINITY, INFINITY};
+    double hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+    #pragma omp parallel for reduction(min : lo[:3]) reduction(max : hi[:3])
+    for (int i = 0; i < particles.size(); i++) {
+        Particle& p = particles[i];
+        if (awake(i)) {
+            for (Vector3D& a : external_accelerations) {
+                p.velocity += delta_t * a;
+            }
+            p.next_position = p.position + delta_t * p.velocity;
         }
-        p.next_position = p.position + delta_t * p.velocity;
+        for (int k = 0; k < 3; k++) {
+            lo[k] = min(lo[k], p.next_position[k]);
+            hi[k] = max(hi[k], p.next_position[k]);
+        }
+    }
+    cloud.has_bbox = !particles.empty();
+    for (int k = 0; k < 3; k++) {
+        cloud.bbox_lo[k] = lo[k];
+        cloud.bbox_hi[k] = hi[k];
     }
 
     // Find neighboring particles (using nanoflann)
     //---------------------------
-    compute_neighbors();
-    //// Placeholder code here
-    //neighbor_lookup.clear(); // should I free each entry first?
-    //for (int i = 0; i < particles.size(); i++) {
-    //    neighbor_lookup.push_back(new vector<Particle*>());
-    //    for (int j = 0; j < particles.size(); j++) {
-    //        if (i != j) {
-    //            neighbor_lookup[i]->push_back(&particles[j]);
-    //        }
-    //    }
-    //}
+    if (auto_neighbor_mode && num_steps % neighbor_probe_interval == 0) {
+        choose_neighbor_mode();
+    } else {
+        compute_neighbors();
+    }
 
     // Tweak particle positions using fancy math
     // Perform collision detection
-    // Supposed to be a huge while loop
+    // Every pass below only writes particles[i], so they can all run in parallel
     //------------------------------------------------------------------------
+    corrections.resize(particles.size());
+
+    // Particles past their LOD iteration count sit out the rest of the solve
+    if (use_lod) {
+        assign_lod_iterations();
+    }
+    auto solving = [this, &awake](int i, int it) {
+        return awake(i) && (!use_lod || it < lod_iterations[i]);
+    };
 
     for (int it = 0; it < solver_iterations; it++) {
+        #pragma omp parallel for
         for (int i = 0; i < particles.size(); i++) {
-            compute_density_est(&particles[i], neighbor_lookup[i]);
+            if (solving(i, it)) compute_density_est(i);
         }
 
+        #pragma omp parallel for
         for (int i = 0; i < particles.size(); i++) {
-            compute_lambda_i(&particles[i], neighbor_lookup[i]);
+            if (solving(i, it)) compute_lambda_i(i);
         }
 
+        #pragma omp parallel for
         for (int i = 0; i < particles.size(); i++) {
-            compute_position_update(&particles[i], neighbor_lookup[i]);
+            if (solving(i, it)) {
+                compute_position_update(i);
+            } else {
+                particles[i].delta_pos = 0;
+            }
         }
 
-        // collisions
+        // collisions, computed from the delta_pos of every particle before any is applied
+        #pragma omp parallel for
         for (int i = 0; i < particles.size(); i++) {
-            self_collide(i, simulation_steps);
+            corrections[i] = solving(i, it) ? self_collide(i, simulation_steps) : Vector3D(0);
         }
 
-        for (int i = 0; i < collision_objects->size(); i++) {
-            for (Particle& p : particles) {
-                (*collision_objects)[i]->collide(p);
+        #pragma omp parallel for
+        for (int i = 0; i < particles.size(); i++) {
+            if (!awake(i)) continue;
+            particles[i].delta_pos += corrections[i];
+            for (int j = 0; j < collision_objects->size(); j++) {
+                (*collision_objects)[j]->collide(particles[i]);
             }
-        }
 
-        // update position
-        for (Particle& p : particles) {
-            p.next_position += p.delta_pos;
+            // update position
+            particles[i].next_position += particles[i].delta_pos;
         }
     }
 
     // Update velocity and apply confinements
     //---------------------------------------
+    #pragma omp parallel for
     for (int i = 0; i < particles.size(); i++) {
+        if (!awake(i)) continue;
         particles[i].velocity = (particles[i].next_position - particles[i].position) / delta_t;
+    }
 
-        // DO SOMETHING RELATED TO VORTICITY & CONFINEMENT
+    // DO SOMETHING RELATED TO VORTICITY & CONFINEMENT
+    #pragma omp parallel for
+    for (int i = 0; i < particles.size(); i++) {
+        if (!awake(i)) {
+            corrections[i] = Vector3D(0);
+            continue;
+        }
         Vector3D vadjust = Vector3D(0);
-        for (int j = 0; j < neighbor_lookup[i]->size(); j++) {
-            vadjust += (particles[i].velocity - (*neighbor_lookup[i])[j]->velocity)
-                * W(particles[i].next_position - (*neighbor_lookup[i])[j]->next_position)
+        for_each_neighbor(i, [&](Particle *p) {
+            vadjust += (particles[i].velocity - p->velocity)
+                * W(particles[i].next_position - p->next_position)
                 * viscosity_constant;
-        }
-        particles[i].velocity += vadjust;
+        });
+        corrections[i] = vadjust;
+    }
 
+    #pragma omp parallel for
+    for (int i = 0; i < particles.size(); i++) {
+        particles[i].velocity += corrections[i];
         particles[i].position = particles[i].next_position;
     }
 
+    if (use_sleeping) {
+        update_sleeping();
+    }
+
+    if (track_surface) {
+        classify_surface();
+    }
+
+    num_steps++;
 }
 
-void Fluid::self_collide(int i, double simulation_steps) {
+Vector3D Fluid::self_collide(int i, double simulation_steps) {
     Vector3D total = Vector3D(0);
-    for (Particle* p : *neighbor_lookup[i]) {
+    for_each_neighbor(i, [&](Particle* p) {
         if (p != &particles[i]) {
             Vector3D p2i = particles[i].next_position + particles[i].delta_pos 
                 - p->next_position - p->delta_pos;
-            double correction = 2 * particle_radius - p2i.norm();
+            double distance = p2i.norm();
+            double correction = 2 * particle_radius - distance;
             if (correction > 0) {
-                total += p2i.unit() * correction * particle_bounce;
+                // Particles clamped to the same point, e.g. in a corner of the
+                // walls, have no direction between them. Split them along x by
+                // index so the pair still moves apart in opposite directions.
+                Vector3D direction = distance > 0 ? p2i / distance
+                    : Vector3D(i < p - &particles[0] ? -1 : 1, 0, 0);
+                total += direction * correction * particle_bounce;
             }
         }
-    }
-    particles[i].delta_pos += total / simulation_steps;
+    });
+    return total / simulation_steps;
 }
 
 void Fluid::reset() {
@@ -158,48 +225,401 @@ void Fluid::reset() {
     p->velocity = 0;
     p++;
   }
+
+  // Everything derived from the old positions starts over
+  vector<uint8_t>().swap(asleep);
+  vector<int>().swap(still_steps);
+  num_asleep = 0;
+  vector<uint8_t>().swap(waking);
+  vector<Plane>().swap(sleep_planes);
+  sleep_blocks = ParticleBlocks();
+  vector<int>().swap(lod_iterations);
+  vector<uint8_t>().swap(on_surface);
+  num_surface = 0;
+  if (track_surface && !particles.empty()) {
+    compute_neighbors();
+    classify_surface();
+  }
 }
 
 // Part of the structure of this function comes from examples provided in the nanoflann library
 void Fluid::compute_neighbors() {
+    if (neighbor_mode != NEIGHBORS_LISTS) {
+        // No lists, the solver walks the cells around every particle
+        for (vector<Particle*> *neighbors : neighbor_lookup) {
+            delete neighbors;
+        }
+        vector<vector<Particle*>*>().swap(neighbor_lookup);
+        if (neighbor_mode == NEIGHBORS_GRID) {
+            cell_hash.clear();
+            grid.update(particles, neighbor_radius());
+        } else {
+            grid.clear();
+            cell_hash.build(particles, neighbor_radius());
+        }
+        cloud.has_bbox = false;
+        return;
+    }
+    grid.clear();
+    cell_hash.clear();
+
     // Build pointcloud
     cloud.pts.clear();
     for (int i = 0; i < particles.size(); i++) {
         cloud.pts.push_back(&particles[i]);
     }
 
+    // Refit the last kdtree to the moved points while queries stay cheap enough.
+    // radiusSearch takes a squared radius, so the query radius is its root.
+    double query_radius = sqrt(neighbor_radius());
+    bool rebuild = kdtree == NULL || !kdtree_refit || kdtree->m_size != particles.size();
+    if (!rebuild) {
+        double cost = refit_kdtree(kdtree, query_radius);
+        rebuild = cost > (1 + kdtree_rebuild_threshold) * kdtree_build_cost;
+        if (!rebuild) num_kdtree_refits++;
+    }
+
     // Build kdtree
-    if (kdtree != NULL) free(kdtree);
-    kdtree = new KDTreeSingleIndexAdaptor<L2_Simple_Adaptor<double, PointCloud>, 
-                PointCloud, 3>(3, cloud, KDTreeSingleIndexAdaptorParams());
-    kdtree->buildIndex();
+    if (rebuild) {
+        if (kdtree != NULL) delete kdtree;
+        kdtree = new ParticleKDTree(3, cloud, KDTreeSingleIndexAdaptorParams(kdtree_leaf_size));
+        kdtree->buildIndex();
+        kdtree_build_cost = kdtree_refit ? kdtree_query_cost(*kdtree, query_radius) : 0;
+        num_kdtree_builds++;
+    }
+    // The bounds from simulate() only hold for this step's predictions
+    cloud.has_bbox = false;
 
-    // Clear neighbor_lookup (this assumes we are creating on heap)
-    for (int i = 0; i < neighbor_lookup.size(); i++) {
-        free(neighbor_lookup[i]);
+    // Keep the neighbor vectors (on heap) around between steps so their storage is reused
+    for (int i = particles.size(); i < neighbor_lookup.size(); i++) {
+        delete neighbor_lookup[i];
+    }
+    int old_size = neighbor_lookup.size();
+    neighbor_lookup.resize(particles.size());
+    for (int i = old_size; i < particles.size(); i++) {
+        neighbor_lookup[i] = new vector<Particle*>();
     }
-    neighbor_lookup.clear();
 
     // create neighbor_lookup
     SearchParams params;
     params.sorted = false; // I think sorting takes more time
-    vector<std::pair<size_t, double> > ret_matches; // Should we put this inside or outside the loop?
 
+    #pragma omp parallel
+    {
+        vector<std::pair<size_t, double> > ret_matches; // one per thread, reused across queries
+
+        // Query in the tree's point order, which groups the points by leaf, so
+        // consecutive queries walk the same nodes and find them in cache
+        #pragma omp for
+        for (int k = 0; k < particles.size(); k++) {
+            int i = kdtree->vind[k];
+            // sleepers have not moved, and neither have the neighbors they keep,
+            // unless the lists were freed while another mode was in use
+            if (use_sleeping && i < asleep.size() && asleep[i] && i < old_size) continue;
+            vector<Particle*>* neighbors = neighbor_lookup[i];
+            neighbors->clear();
+            double target[3];
+            target[0] = particles[i].next_position.x;
+            target[1] = particles[i].next_position.y;
+            target[2] = particles[i].next_position.z;
+
+            size_t nMatches = kdtree->radiusSearch(&target[0], neighbor_radius(), ret_matches, params);
+            for (size_t j = 0; j < nMatches; j++) {
+                if (i != ret_matches[j].first) {
+                    neighbors->push_back(&(particles[ret_matches[j].first]));
+                }
+            }
+
+            // particles live in one array, so pointer order is index order
+            if (deterministic) {
+                sort(neighbors->begin(), neighbors->end());
+            }
+        }
+    }
+}
+
+static double seconds_since(const chrono::steady_clock::time_point &start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Picks neighbor_mode from the occupancy and the measured costs, see fluid.h,
+// and leaves its neighbors computed
+void Fluid::choose_neighbor_mode() {
+    if (particles.empty()) {
+        compute_neighbors();
+        return;
+    }
+    const char *names[3] = {"lists", "grid", "hash"};
+
+    // Share of the hash's cells around the bounding box that hold particles
+    double cell_size = neighbor_radius();
+    cell_hash.build(particles, cell_size);
+    Vector3D lo = particles[0].next_position, hi = lo;
+    for (const Particle &p : particles) {
+        for (int k = 0; k < 3; k++) {
+            lo[k] = min(lo[k], p.next_position[k]);
+            hi[k] = max(hi[k], p.next_position[k]);
+        }
+    }
+    double box_cells = 1;
+    for (int k = 0; k < 3; k++) {
+        box_cells *= floor(hi[k] / cell_size) - floor(lo[k] / cell_size) + 1;
+    }
+    double fill = cell_hash.num_cells() / box_cells;
+
+    // Cost per step of every mode, from one build and one pass
+    NeighborMode current = neighbor_mode;
+    for (int m = NEIGHBORS_LISTS; m <= NEIGHBORS_HASH; m++) {
+        if (m == NEIGHBORS_GRID && fill < grid_min_fill) {
+            neighbor_step_cost[m] = INFINITY;
+            continue;
+        }
+        neighbor_mode = (NeighborMode)m;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        compute_neighbors();
+        double build = seconds_since(start);
+
+        // The pass overwrites densities that the solver computes again
+        start = chrono::steady_clock::now();
+        #pragma omp parallel for
+        for (int i = 0; i < particles.size(); i++) {
+            if (!use_sleeping || !asleep[i]) compute_density_est(i);
+        }
+        double pass = seconds_since(start);
+        neighbor_step_cost[m] = build + (4 * solver_iterations + 1) * pass;
+    }
+
+    NeighborMode best = current;
+    for (int m = NEIGHBORS_LISTS; m <= NEIGHBORS_HASH; m++) {
+        if (neighbor_step_cost[m] < neighbor_step_cost[best]) best = (NeighborMode)m;
+    }
+    if (neighbor_step_cost[best] > (1 - neighbor_switch_margin) * neighbor_step_cost[current]) {
+        best = current;
+    }
+
+    cout << "Neighbor search at step " << num_steps << ": " << names[best]
+         << (best == current ? "" : string(", was ") + names[current]) << " (";
+    for (int m = NEIGHBORS_LISTS; m <= NEIGHBORS_HASH; m++) {
+        cout << names[m] << " ";
+        if (isinf(neighbor_step_cost[m])) {
+            cout << "skipped";
+        } else {
+            cout << round(neighbor_step_cost[m] * 1e4) / 10 << " ms";
+        }
+        cout << ", ";
+    }
+    cout << "grid fill " << round(fill * 100) / 100 << ")" << endl;
+
+    // The hash went last, so its cells are already current
+    neighbor_mode = best;
+    if (best != NEIGHBORS_HASH) {
+        compute_neighbors();
+    }
+}
+
+// Flags the particles on the free surface. Only the neighbor lists of the last
+// step are used, so no extra search is needed.
+void Fluid::classify_surface() {
+    double support = neighbor_radius();
+    double rest_neighbors = 4.0 / 3 * M_PI * pow(support / rest_spacing(), 3);
+    on_surface.resize(particles.size());
+
+    size_t count = 0;
+    #pragma omp parallel for reduction(+ : count)
     for (int i = 0; i < particles.size(); i++) {
-        vector<Particle*>* neighbors = new vector<Particle*>();
-        neighbor_lookup.push_back(neighbors);
-        double target[3];
-        target[0] = particles[i].next_position.x;
-        target[1] = particles[i].next_position.y;
-        target[2] = particles[i].next_position.z;
-
-        size_t nMatches = kdtree->radiusSearch(&target[0], 2 * h, ret_matches, params);
-        for (size_t j = 0; j < nMatches; j++) {
-            if (i != ret_matches[j].first) {    
-                neighbors->push_back(&(particles[ret_matches[j].first]));
+        int num_neighbors = 0;
+        Vector3D gradient = Vector3D(0);
+        double magnitude = 0;
+        for_each_neighbor(i, [&](Particle *p) {
+            Vector3D r = particles[i].position - p->position;
+            if (r.norm2() >= support * support) return;
+            num_neighbors++;
+            Vector3D g = grad_W(r);
+            gradient += g;
+            magnitude += g.norm();
+        });
+        on_surface[i] = num_neighbors < surface_neighbor_fraction * rest_neighbors ||
+                        (magnitude > 0 && gradient.norm() > surface_asymmetry * magnitude);
+        count += on_surface[i];
+    }
+    num_surface = count;
+}
+
+// Iteration counts for the solver LOD, see fluid.h
+void Fluid::assign_lod_iterations() {
+    lod_iterations.resize(particles.size());
+    if (particles.empty()) return;
+
+    // Block grid over the predicted positions, coarsened so it stays small
+    Vector3D lo = particles[0].next_position, hi = lo;
+    for (const Particle &p : particles) {
+        for (int k = 0; k < 3; k++) {
+            lo[k] = min(lo[k], p.next_position[k]);
+            hi[k] = max(hi[k], p.next_position[k]);
+        }
+    }
+    double size = lod_block_size > 0 ? lod_block_size : 4 * h;
+    const int max_blocks = 64; // per axis
+    size = max(size, (hi - lo).norm() / max_blocks);
+    int dims[3];
+    for (int k = 0; k < 3; k++) {
+        dims[k] = min(max_blocks, (int)floor((hi[k] - lo[k]) / size) + 1);
+    }
+
+    // Iteration count of every block, from the distance of its center
+    vector<double> counts((size_t)dims[0] * dims[1] * dims[2]);
+    int min_iterations = min(max(lod_min_iterations, 0), solver_iterations);
+    for (int z = 0; z < dims[2]; z++) {
+        for (int y = 0; y < dims[1]; y++) {
+            for (int x = 0; x < dims[0]; x++) {
+                Vector3D center = lo + size * Vector3D(x + 0.5, y + 0.5, z + 0.5);
+                double d = (center - lod_eye).norm();
+                double scale = d > lod_distance ? lod_distance / d : 1;
+                counts[((size_t)z * dims[1] + y) * dims[0] + x] =
+                    max((double)min_iterations, solver_iterations * scale);
             }
         }
     }
+
+    #pragma omp parallel for
+    for (int i = 0; i < particles.size(); i++) {
+        // Trilinear weights of the two nearest block centers along each axis
+        int b0[3], b1[3];
+        double t[3];
+        for (int k = 0; k < 3; k++) {
+            double f = (particles[i].next_position[k] - lo[k]) / size - 0.5;
+            f = min(max(f, 0.0), dims[k] - 1.0);
+            b0[k] = (int)f;
+            b1[k] = min(b0[k] + 1, dims[k] - 1);
+            t[k] = f - b0[k];
+        }
+        double count = 0;
+        for (int c = 0; c < 8; c++) {
+            int x = c & 1 ? b1[0] : b0[0], y = c & 2 ? b1[1] : b0[1], z = c & 4 ? b1[2] : b0[2];
+            double w = (c & 1 ? t[0] : 1 - t[0]) * (c & 2 ? t[1] : 1 - t[1]) * (c & 4 ? t[2] : 1 - t[2]);
+            count += w * counts[((size_t)z * dims[1] + y) * dims[0] + x];
+        }
+        lod_iterations[i] = (int)(count + 0.5);
+    }
+}
+
+// Wakes the sleepers an awake particle or a collision object reaches. Only
+// the neighbor lists of the last step are used.
+void Fluid::wake_disturbed(vector<Plane *> *collision_objects) {
+    if (asleep.size() != particles.size()) {
+        asleep.assign(particles.size(), 0);
+        still_steps.assign(particles.size(), 0);
+        num_asleep = 0;
+    }
+
+    // Planes that moved since the last step, with where they were then. A
+    // plane that was not seen before counts as having been where it is.
+    vector<Plane> &last = sleep_planes;
+    vector<pair<const Plane *, const Plane *> > moved;
+    for (int j = 0; j < collision_objects->size(); j++) {
+        const Plane *plane = (*collision_objects)[j];
+        if (j < last.size() && !(last[j].point == plane->point && last[j].normal == plane->normal)) {
+            moved.push_back(make_pair(plane, &last[j]));
+        }
+    }
+
+    if (num_asleep > 0) {
+        wake_sleepers(moved);
+    }
+
+    last.clear();
+    for (Plane *plane : *collision_objects) {
+        last.push_back(*plane);
+    }
+}
+
+// Wakes the sleepers near a fast awake particle or a moved plane, given as
+// pairs of the plane now and before
+void Fluid::wake_sleepers(const vector<pair<const Plane *, const Plane *> > &moved) {
+    double support = neighbor_radius();
+    double fast = sleep_velocity * sleep_velocity;
+    double touch = particle_radius + SURFACE_OFFSET;
+    vector<uint8_t> &wake = waking;
+    wake.assign(particles.size(), 0);
+
+    // The neighbors of the last step, which a run resumed from a checkpoint
+    // does not have yet
+    bool missing = neighbor_mode == NEIGHBORS_GRID ? grid.empty() :
+                   neighbor_mode == NEIGHBORS_HASH ? cell_hash.empty() :
+                   neighbor_lookup.size() != particles.size();
+    if (missing) {
+        compute_neighbors();
+    }
+
+    #pragma omp parallel for
+    for (int i = 0; i < particles.size(); i++) {
+        if (asleep[i]) {
+            // a plane moved to within reach of the particle, or across it
+            for (const pair<const Plane *, const Plane *> &m : moved) {
+                double now = dot(particles[i].position - m.first->point, m.first->normal);
+                double before = dot(particles[i].position - m.second->point, m.second->normal);
+                if (fabs(now) < touch || (now < 0) != (before < 0)) {
+                    #pragma omp atomic write
+                    wake[i] = 1;
+                }
+            }
+        } else if (particles[i].velocity.norm2() >= fast) {
+            for_each_neighbor(i, [&](Particle *p) {
+                size_t j = p - &particles[0];
+                if (asleep[j] && (particles[i].position - p->position).norm2() < support * support) {
+                    #pragma omp atomic write
+                    wake[j] = 1;
+                }
+            });
+        }
+    }
+
+    for (int i = 0; i < particles.size(); i++) {
+        if (wake[i]) {
+            asleep[i] = 0;
+            still_steps[i] = 0;
+            num_asleep--;
+        }
+    }
+}
+
+// Counts the steps every particle has been still and puts every block whose
+// particles are all still to sleep. Blocks holding a particle that moves are
+// woken whole.
+void Fluid::update_sleeping() {
+    #pragma omp parallel for
+    for (int i = 0; i < particles.size(); i++) {
+        if (asleep[i]) continue;
+        bool still = particles[i].velocity.norm2() < sleep_velocity * sleep_velocity;
+        still_steps[i] = still ? min(still_steps[i] + 1, sleep_steps) : 0;
+    }
+
+    double size = sleep_block_size > 0 ? sleep_block_size : 4 * h;
+    if (!sleep_blocks.build(particles, size, 0)) {
+        // too spread out to bin, so nothing can be known to rest
+        asleep.assign(particles.size(), 0);
+        num_asleep = 0;
+        return;
+    }
+
+    size_t count = 0;
+    for (const auto &block : sleep_blocks.occupied) {
+        bool rest = true;
+        for (size_t k = block.second.first; k < block.second.second && rest; k++) {
+            rest = still_steps[sleep_blocks.binned[k].second] >= sleep_steps;
+        }
+        for (size_t k = block.second.first; k < block.second.second; k++) {
+            uint32_t i = sleep_blocks.binned[k].second;
+            if (rest && !asleep[i]) {
+                particles[i].velocity = 0;
+                particles[i].delta_pos = 0;
+                particles[i].next_position = particles[i].position;
+            }
+            asleep[i] = rest;
+        }
+        if (rest) count += block.second.second - block.second.first;
+    }
+    num_asleep = count;
 }
 
 // Smoothing kernel, implemented as a simple cubic B-spline
@@ -222,12 +642,13 @@ double Fluid::C_i(Particle *p) {
     return p->density_est / rho_0 - 1;
 }
 
-// Compute density estimate for particle p
-void Fluid::compute_density_est(Particle *p, vector<Particle*> *neighbors) {
+// Compute density estimate for particles[i]
+void Fluid::compute_density_est(int i) {
+    Particle *p = &particles[i];
     p->density_est = 0;
-    for (int i = 0; i < neighbors->size(); i++) {
-        p->density_est += W(p->next_position - (*neighbors)[i]->next_position);
-    }
+    for_each_neighbor(i, [&](Particle *q) {
+        p->density_est += W(p->next_position - q->next_position);
+    });
     p->density_est *= pmass;
 }
 
@@ -255,36 +676,39 @@ Vector3D Fluid::grad_W(Vector3D x) {
 }
 
 // The gradient of C_i with respective to p_k
-Vector3D Fluid::grad_p_k_C_i(Particle* p_k, Particle* p_i, vector<Particle*>* neighbors) {
+Vector3D Fluid::grad_p_k_C_i(Particle* p_k, int i) {
+    Particle *p_i = &particles[i];
     if (p_i != p_k) {
         return -grad_W(p_i->next_position - p_k->next_position) / rho_0;
     }
     
     Vector3D sum = 0;
-    for (int j = 0; j < neighbors->size(); j++) {
-        sum += grad_W(p_i->next_position - (*neighbors)[j]->next_position);
-    }
+    for_each_neighbor(i, [&](Particle *p_j) {
+        sum += grad_W(p_i->next_position - p_j->next_position);
+    });
     return sum / rho_0;
 }
 
 // Calculate lambda_i
 // Make sure we call compute_density_est before
-void Fluid::compute_lambda_i(Particle* p_i, vector<Particle*>* neighbors) {
+void Fluid::compute_lambda_i(int i) {
+    Particle *p_i = &particles[i];
     double denom = epsilon;
-    for (int k = 0; k < neighbors->size(); k++) {
-        denom += grad_p_k_C_i((*neighbors)[k], p_i, neighbors).norm2();
-    }
+    for_each_neighbor(i, [&](Particle *p_k) {
+        denom += grad_p_k_C_i(p_k, i).norm2();
+    });
     p_i->lambda = -C_i(p_i) / denom;
 }
 
 // Compute p_i->delta_pos
 // Make sure we call compute_lambda_i before
-void Fluid::compute_position_update(Particle* p_i, vector<Particle*>* neighbors) {
+void Fluid::compute_position_update(int i) {
+    Particle *p_i = &particles[i];
     p_i->delta_pos = 0;
-    for (int j = 0; j < neighbors->size(); j++) {
-        p_i->delta_pos += (p_i->lambda + (*neighbors)[j]->lambda + s_corr(p_i, (*neighbors)[j]))
-            * grad_W(p_i->next_position - (*neighbors)[j]->next_position);
-    }
+    for_each_neighbor(i, [&](Particle *p_j) {
+        p_i->delta_pos += (p_i->lambda + p_j->lambda + s_corr(p_i, p_j))
+            * grad_W(p_i->next_position - p_j->next_position);
+    });
     p_i->delta_pos = p_i->delta_pos / rho_0;
 }
 
@@ -1,6 +1,7 @@
 #ifndef FLUID_H
 #define FLUID_H
 
+#include <stdint.h>
 #include <unordered_set>
 #include <unordered_map>
 #include <vector>
@@ -9,7 +10,12 @@
 #include "CGL/CGL.h"
 #include "CGL/misc.h"
 #include "collision/plane.h"
+#include "generator.h"
 #include "particle.h"
+#include "neighbor_grid.h"
+#include "spatial_hash.h"
+#include "particle_blocks.h"
+#include "kdtree_refit.h"
 #include "misc/nanoflann.hpp"
 #include "nanoflann_utils.h"
 
@@ -27,13 +33,22 @@ struct FluidParameters {
   double particle_mass;
 };
 
+// How the solver finds the neighbors of a particle
+enum NeighborMode {
+  NEIGHBORS_LISTS, // kd-tree search into a stored list per particle, every step
+  NEIGHBORS_GRID,  // walk the cells around the particle in a uniform grid, no lists
+  NEIGHBORS_HASH   // the same in a hash table of the occupied cells, for open domains
+};
+
 struct Fluid {
   Fluid() {}
   Fluid(int num_x, int num_y, int num_z);
-  Fluid(int num);
+  Fluid(int num, uint64_t seed = 0);
+  Fluid(const FluidGenerator &generator);
   ~Fluid();
 
   void buildFluid();
+  double rest_spacing(); // lattice spacing at which particles have rest density
 
   void simulate(double frames_per_sec, double simulation_steps, FluidParameters *fp,
                 vector<Vector3D> external_accelerations,
@@ -41,20 +56,45 @@ struct Fluid {
 
   void reset();
 
-  void self_collide(int i, double simulation_steps); // dealing with the particle partices[i]
-
-  void compute_neighbors(); // compute neighbor_lookup
+  Vector3D self_collide(int i, double simulation_steps); // correction for the particle particles[i]
+
+  void compute_neighbors(); // compute neighbor_lookup, or the grid
+  void choose_neighbor_mode(); // time the neighbor searches and switch to the cheapest
+  double neighbor_radius() const { return 2 * h; }
+
+  // Calls f(Particle *p) for every neighbor p of particles[i]
+  template <typename F>
+  void for_each_neighbor(int i, F f) {
+    const Vector3D &x = particles[i].next_position;
+    double r2 = neighbor_radius() * neighbor_radius();
+    auto near = [&](uint32_t j) {
+      if (j != (uint32_t)i && (particles[j].next_position - x).norm2() < r2) f(&particles[j]);
+    };
+    if (neighbor_mode == NEIGHBORS_GRID) {
+      grid.for_each_candidate(x, near);
+    } else if (neighbor_mode == NEIGHBORS_HASH) {
+      cell_hash.for_each_candidate(x, near);
+    } else if (i < neighbor_lookup.size()) {
+      for (Particle *p : *neighbor_lookup[i]) f(p);
+    }
+  }
 
   // computations from the paper Position Based Fluids
   double W(Vector3D x); // smoothing kernel
   double C_i(Particle *p); // density contraint
-  void compute_density_est(Particle *p, vector<Particle *> *neighbors); // compute density_est
+  void compute_density_est(int i); // compute density_est of particles[i]
   Vector3D grad_W(Vector3D x); // gradient of W
-  Vector3D grad_p_k_C_i(Particle* p_k, Particle* p_i, vector<Particle*>* neighbors); // grad of C_i wrt p_k
-  void compute_lambda_i(Particle* p_i, vector<Particle*>* neighbors); // compute lambda_i
-  void compute_position_update(Particle* p_i, vector<Particle*>* neighbors); // compute delta_pos
+  Vector3D grad_p_k_C_i(Particle* p_k, int i); // grad of C_i wrt p_k
+  void compute_lambda_i(int i); // compute lambda_i
+  void compute_position_update(int i); // compute delta_pos
   double s_corr(Particle* p_i, Particle* p_j); // artifical pressure
 
+  void classify_surface(); // compute on_surface from the last neighbor lists
+  void assign_lod_iterations(); // compute lod_iterations from the distance to lod_eye
+  void wake_disturbed(vector<Plane *> *collision_objects); // wake sleepers touched since the last step
+  void wake_sleepers(const vector<pair<const Plane *, const Plane *> > &moved_planes);
+  void update_sleeping(); // put the blocks that have come to rest to sleep
+
   // Fluid properties
   double rho_0 = 1; // rest density
   double pmass = 0.0001; // particle mass
@@ -65,18 +105,118 @@ struct Fluid {
   double s_corr_constant = 0.0000005; // for s_corr
   double viscosity_constant = 0.00001; // for viscosity
   int solver_iterations = 1;
+  uint64_t num_steps = 0; // number of completed calls to simulate
   int num_particles;
   int num_x;
   int num_y;
   int num_z;
 
+  // Determinism
+  // Every solver phase is a per-particle gather: particle i only writes its own
+  // state and reads its neighbors' state from the previous phase, so there are
+  // no cross-thread reductions. In deterministic mode the neighbor lists are
+  // additionally sorted by index so every per-particle sum runs in a fixed
+  // order, which makes results bitwise identical across runs and thread counts.
+  bool deterministic = false;
+
+  // Initial configuration, including the seed for the counter-based RNG
+  FluidGenerator generator;
+
+  // Surface classification
+  // A particle is on the free surface if fewer than surface_neighbor_fraction
+  // of the neighbors it would have at rest density lie in its kernel support,
+  // or if the color field gradient around it is lopsided: its magnitude over
+  // the sum of the neighbors' gradient magnitudes is above surface_asymmetry.
+  // That ratio is near 0 inside the fluid and grows towards the surface.
+  bool track_surface = false; // classify after every step
+  double surface_neighbor_fraction = 0.75;
+  double surface_asymmetry = 0.3;
+  vector<uint8_t> on_surface; // 1 for surface particles, per particle
+  size_t num_surface = 0;
+
+  // Camera-distance level of detail
+  // The predicted positions are binned into blocks of lod_block_size. Every
+  // block gets solver_iterations halved for each doubling of its center's
+  // distance to lod_eye past lod_distance, but at least lod_min_iterations.
+  // Particles interpolate the counts of the nearest block centers
+  // trilinearly, so counts change smoothly across block boundaries instead
+  // of jumping at them. A particle takes part in the first lod_iterations[i]
+  // solver iterations and keeps its position and lambda after that.
+  bool use_lod = false;
+  Vector3D lod_eye;
+  double lod_distance = 1.0;
+  double lod_block_size = 0; // 0 uses 4h
+  int lod_min_iterations = 1;
+  vector<int> lod_iterations; // per particle, for the current step
+
+  // Sleeping
+  // A particle is still once its speed has stayed below sleep_velocity for
+  // sleep_steps steps. The particles are binned into blocks of
+  // sleep_block_size after every step, and the blocks whose particles are
+  // all still go to sleep together, like islands in a rigid body solver.
+  // Sleepers skip prediction, the neighbor search and the solver, and keep
+  // their position with zero velocity; awake neighbors still see them. A
+  // sleeper wakes at the start of a step if an awake particle moving at
+  // sleep_velocity or more is within 2h of it, or if a plane has moved
+  // since the last step to within particle_radius of it or across it.
+  // Planes resting under sleepers do not wake them. When every particle is
+  // asleep a step does nothing else.
+  bool use_sleeping = false;
+  double sleep_velocity = 0.05;
+  int sleep_steps = 30;
+  double sleep_block_size = 0; // 0 uses 4h
+  vector<uint8_t> asleep; // 1 for sleeping particles, per particle
+  vector<int> still_steps; // steps each particle has been still, per particle
+  size_t num_asleep = 0;
+  vector<uint8_t> waking; // scratch for wake_disturbed
+  vector<Plane> sleep_planes; // the collision planes at the last step
+  ParticleBlocks sleep_blocks;
+
   // Fluid components
   vector<Particle> particles;
+  vector<Vector3D> corrections; // scratch space for the Jacobi-style passes
 
   // Neighbor map
+  // In NEIGHBORS_GRID and NEIGHBORS_HASH modes there are no lists: every pass
+  // visits the particles within neighbor_radius() in the 27 cells around it, which
+  // costs a few bytes per particle instead of a list of ~50 pointers, at the
+  // price of redoing the distance tests in every pass. The lists hold every
+  // particle the kd-tree finds, a superset of that radius, but the kernels
+  // vanish past it, so both modes give the same results up to the order of
+  // the sums as long as no particle moves more than about h in a step.
+  NeighborMode neighbor_mode = NEIGHBORS_LISTS;
+  NeighborGrid grid;
+  SpatialHash cell_hash;
   vector <vector<Particle*>*> neighbor_lookup;
   PointCloud cloud;
-  KDTreeSingleIndexAdaptor<L2_Simple_Adaptor<double, PointCloud>, PointCloud, 3> *kdtree = NULL;
+  ParticleKDTree *kdtree = NULL;
+  int kdtree_leaf_size = 16; // points per kd-tree leaf, at most
+
+  // kd-tree refitting, see kdtree_refit.h
+  // The tree is refit to the predicted positions every step, and rebuilt once
+  // its estimated query cost exceeds the cost right after the last build by
+  // more than kdtree_rebuild_threshold.
+  bool kdtree_refit = false;
+  double kdtree_rebuild_threshold = 0.25;
+  double kdtree_build_cost = 0;
+  uint64_t num_kdtree_builds = 0;
+  uint64_t num_kdtree_refits = 0;
+
+  // Automatic neighbor search
+  // Every neighbor_probe_interval steps, choose_neighbor_mode() tries each
+  // mode on the current predictions and times one build plus one density
+  // pass. That pass stands in for the 4 * solver_iterations + 1 passes per
+  // step that walk the neighbors. The grid is skipped when the occupied
+  // cells, counted by the hash, fill less than grid_min_fill of the
+  // particles' bounding box, since it stores every cell of the box. The
+  // mode switches when another one is estimated cheaper by more than
+  // neighbor_switch_margin, and every probe is logged. The choice depends
+  // on timing, so pin a mode for deterministic runs.
+  bool auto_neighbor_mode = false;
+  int neighbor_probe_interval = 200;
+  double grid_min_fill = 0.125;
+  double neighbor_switch_margin = 0.1;
+  double neighbor_step_cost[3] = {0, 0, 0}; // seconds per step by NeighborMode, at the last probe
 };
 
 #endif /* FLUID_H */
\ No newline at end of file
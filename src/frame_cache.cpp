@@ -0,0 +1,343 @@
+#include <iostream>
+
+#include "frame_cache.h"
+
+using namespace std;
+
+#define FILE_HEADER_SIZE 64
+#define CHUNK_HEADER_SIZE 64
+#define INDEX_ENTRY_SIZE 24
+#define FOOTER_SIZE 32
+
+const uint32_t CHUNK_MAGIC = FOURCC('F', 'R', 'A', 'M');
+
+// Per-particle element count of every channel, in channel bit order
+static const int CHANNEL_WIDTH[NUM_FRAME_CHANNELS] = {3, 3, 1};
+
+struct ChunkHeader {
+  uint32_t magic;
+  uint32_t channels;
+  uint64_t frame;
+  uint64_t num_particles;
+  uint32_t encoding;
+  uint32_t flags;
+  uint64_t chunk_size;
+  uint64_t channel_size[NUM_FRAME_CHANNELS];
+};
+
+static bool read_chunk_header(const char *data, uint64_t size, uint64_t offset, ChunkHeader *h) {
+  if (offset + CHUNK_HEADER_SIZE > size) return false;
+  const char *p = data + offset;
+  read_le(&h->magic, p);
+  read_le(&h->channels, p + 4);
+  read_le(&h->frame, p + 8);
+  read_le(&h->num_particles, p + 16);
+  read_le(&h->encoding, p + 24);
+  read_le(&h->flags, p + 28);
+  read_le(&h->chunk_size, p + 32);
+  read_le(h->channel_size, p + 40, NUM_FRAME_CHANNELS);
+  return h->magic == CHUNK_MAGIC && h->chunk_size >= CHUNK_HEADER_SIZE &&
+         offset + h->chunk_size <= size;
+}
+
+static const vector<double> &channel_vector(const FrameSnapshot &s, int c) {
+  return c == 0 ? s.positions : (c == 1 ? s.velocities : s.densities);
+}
+
+static vector<double> &channel_vector(FrameSnapshot &s, int c) {
+  return c == 0 ? s.positions : (c == 1 ? s.velocities : s.densities);
+}
+
+void FrameSnapshot::capture(const Fluid &fluid, uint64_t frame, uint32_t channels) {
+  this->frame = frame;
+  this->channels = channels;
+  num_particles = fluid.particles.size();
+
+  // resize() keeps the capacity, so a recycled snapshot does not allocate
+  positions.resize(channels & CHANNEL_POSITION ? num_particles * 3 : 0);
+  velocities.resize(channels & CHANNEL_VELOCITY ? num_particles * 3 : 0);
+  densities.resize(channels & CHANNEL_DENSITY ? num_particles : 0);
+
+  #pragma omp parallel for
+  for (int64_t i = 0; i < (int64_t)num_particles; i++) {
+    const Particle &p = fluid.particles[i];
+    if (channels & CHANNEL_POSITION) {
+      positions[i * 3] = p.position.x;
+      positions[i * 3 + 1] = p.position.y;
+      positions[i * 3 + 2] = p.position.z;
+    }
+    if (channels & CHANNEL_VELOCITY) {
+      velocities[i * 3] = p.velocity.x;
+      velocities[i * 3 + 1] = p.velocity.y;
+      velocities[i * 3 + 2] = p.velocity.z;
+    }
+    if (channels & CHANNEL_DENSITY) {
+      densities[i] = p.density_est;
+    }
+  }
+}
+
+bool read_frame_index(const char *data, uint64_t size, vector<FrameIndexEntry> *index,
+                      uint64_t *end_offset) {
+  index->clear();
+  if (size < FILE_HEADER_SIZE || memcmp(data, FRAME_CACHE_MAGIC, 8) != 0) return false;
+
+  // Closed cache: the footer points at the index
+  if (size >= FILE_HEADER_SIZE + FOOTER_SIZE &&
+      memcmp(data + size - FOOTER_SIZE, FRAME_CACHE_INDEX_MAGIC, 8) == 0) {
+    uint64_t index_offset, num_frames;
+    read_le(&index_offset, data + size - FOOTER_SIZE + 8);
+    read_le(&num_frames, data + size - FOOTER_SIZE + 16);
+    if (index_offset + num_frames * INDEX_ENTRY_SIZE + FOOTER_SIZE == size) {
+      index->resize(num_frames);
+      for (uint64_t i = 0; i < num_frames; i++) {
+        read_le(&(*index)[i].offset, data + index_offset + i * INDEX_ENTRY_SIZE);
+        read_le(&(*index)[i].frame, data + index_offset + i * INDEX_ENTRY_SIZE + 8);
+        read_le(&(*index)[i].size, data + index_offset + i * INDEX_ENTRY_SIZE + 16);
+      }
+      *end_offset = index_offset;
+      return true;
+    }
+  }
+
+  // Unclosed cache: walk the chunks up to the last complete one
+  uint64_t offset = FILE_HEADER_SIZE;
+  ChunkHeader h;
+  while (read_chunk_header(data, size, offset, &h)) {
+    FrameIndexEntry entry = {offset, h.frame, h.chunk_size};
+    index->push_back(entry);
+    offset += h.chunk_size;
+  }
+  *end_offset = offset;
+  return true;
+}
+
+bool FrameCacheWriter::open(const string &filename, bool append, uint64_t first_frame) {
+  close();
+  index.clear();
+  total_bytes = 0;
+
+  if (append) {
+    MappedFile existing;
+    if (existing.open(filename)) {
+      if (!read_frame_index(existing.data(), existing.size(), &index, &end_offset)) {
+        cout << filename << " is not a frame cache" << endl;
+        return false;
+      }
+      existing.close();
+
+      while (!index.empty() && index.back().frame >= first_frame) {
+        end_offset = index.back().offset;
+        index.pop_back();
+      }
+      if (!out.open(filename, "r+b") || !out.truncate(end_offset)) {
+        cout << "Could not append to " << filename << endl;
+        return false;
+      }
+      return true;
+    }
+  }
+
+  if (!out.open(filename, "wb")) {
+    cout << "Could not open " << filename << " for writing" << endl;
+    return false;
+  }
+  out.write_bytes(FRAME_CACHE_MAGIC, 8);
+  out.write((uint32_t)FRAME_CACHE_VERSION);
+  out.pad_to();
+  end_offset = FILE_HEADER_SIZE;
+  return out.good();
+}
+
+void FrameCacheWriter::set_codec(const FrameCodecParams &params) {
+  use_codec = true;
+  encoder = FrameEncoder(params);
+}
+
+bool FrameCacheWriter::write_frame(const FrameSnapshot &snapshot) {
+  if (!out.is_open()) return false;
+
+  bool coded = use_codec && (snapshot.channels & CHANNEL_POSITION);
+  uint32_t flags = 0;
+  if (coded) {
+    encoded.clear();
+    encoder.encode(snapshot.positions, &encoded);
+    if (FrameDecoder::is_keyframe(encoded.data(), encoded.size())) flags |= CHUNK_FLAG_KEYFRAME;
+  }
+
+  uint64_t channel_size[NUM_FRAME_CHANNELS];
+  uint64_t chunk_size = CHUNK_HEADER_SIZE;
+  for (int c = 0; c < NUM_FRAME_CHANNELS; c++) {
+    channel_size[c] = snapshot.channels & (1 << c) ? channel_vector(snapshot, c).size() * sizeof(double) : 0;
+    if (c == 0 && coded) channel_size[c] = encoded.size();
+    chunk_size = align_offset(chunk_size + channel_size[c]);
+  }
+
+  out.write(CHUNK_MAGIC);
+  out.write(snapshot.channels);
+  out.write(snapshot.frame);
+  out.write(snapshot.num_particles);
+  out.write((uint32_t)(coded ? ENCODING_CODEC : ENCODING_RAW));
+  out.write(flags);
+  out.write(chunk_size);
+  out.write_array(channel_size, NUM_FRAME_CHANNELS);
+
+  for (int c = 0; c < NUM_FRAME_CHANNELS; c++) {
+    if (channel_size[c] == 0) continue;
+    if (c == 0 && coded) {
+      out.write_bytes(encoded.data(), encoded.size());
+    } else {
+      const vector<double> &values = channel_vector(snapshot, c);
+      out.write_array(values.data(), values.size());
+    }
+    out.pad_to();
+  }
+
+  FrameIndexEntry entry = {end_offset, snapshot.frame, chunk_size};
+  index.push_back(entry);
+  end_offset += chunk_size;
+  total_bytes += chunk_size;
+  return out.good();
+}
+
+bool FrameCacheWriter::close() {
+  if (!out.is_open()) return true;
+
+  for (const FrameIndexEntry &entry : index) {
+    out.write(entry.offset);
+    out.write(entry.frame);
+    out.write(entry.size);
+  }
+  out.write_bytes(FRAME_CACHE_INDEX_MAGIC, 8);
+  out.write(end_offset);
+  out.write((uint64_t)index.size());
+  out.write((uint64_t)FRAME_CACHE_VERSION);
+  return out.close();
+}
+
+bool FrameCacheReader::open(const string &filename) {
+  close();
+  if (!file.open(filename)) {
+    cout << "Could not open frame cache " << filename << endl;
+    return false;
+  }
+  uint64_t end_offset;
+  if (!read_frame_index(file.data(), file.size(), &index, &end_offset)) {
+    cout << filename << " is not a frame cache" << endl;
+    close();
+    return false;
+  }
+  return true;
+}
+
+void FrameCacheReader::close() {
+  file.close();
+  index.clear();
+  decoder.reset();
+  last_decoded = -1;
+}
+
+uint64_t FrameCacheReader::num_particles(size_t i) const {
+  ChunkHeader h;
+  if (!read_chunk_header(file.data(), file.size(), index[i].offset, &h)) return 0;
+  return h.num_particles;
+}
+
+uint32_t FrameCacheReader::channels(size_t i) const {
+  ChunkHeader h;
+  if (!read_chunk_header(file.data(), file.size(), index[i].offset, &h)) return 0;
+  return h.channels;
+}
+
+bool FrameCacheReader::is_keyframe(size_t i) const {
+  ChunkHeader h;
+  if (!read_chunk_header(file.data(), file.size(), index[i].offset, &h)) return true;
+  return h.encoding == ENCODING_RAW || (h.flags & CHUNK_FLAG_KEYFRAME);
+}
+
+int64_t FrameCacheReader::find_frame(uint64_t frame) const {
+  if (index.empty()) return -1;
+
+  // Frames are usually consecutive, in which case this is a direct lookup
+  uint64_t guess = frame - index[0].frame;
+  if (frame >= index[0].frame && guess < index.size() && index[guess].frame == frame) {
+    return guess;
+  }
+
+  size_t lo = 0, hi = index.size();
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (index[mid].frame < frame) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo < index.size() && index[lo].frame == frame ? (int64_t)lo : -1;
+}
+
+const char *FrameCacheReader::channel_data(size_t i, FrameChannel channel, uint64_t *size) const {
+  ChunkHeader h;
+  if (!read_chunk_header(file.data(), file.size(), index[i].offset, &h)) return NULL;
+  if (!(h.channels & channel)) return NULL;
+
+  // Every channel up to the requested one has to lie inside the chunk
+  uint64_t offset = index[i].offset + CHUNK_HEADER_SIZE;
+  uint64_t end = index[i].offset + h.chunk_size;
+  for (int c = 0; c < NUM_FRAME_CHANNELS; c++) {
+    if (offset > end || h.channel_size[c] > end - offset) return NULL;
+    if ((1u << c) == (uint32_t)channel) {
+      *size = h.channel_size[c];
+      return file.data() + offset;
+    }
+    offset = align_offset(offset + h.channel_size[c]);
+  }
+  return NULL;
+}
+
+bool FrameCacheReader::read_frame(size_t i, FrameSnapshot *snapshot) const {
+  ChunkHeader h;
+  if (i >= index.size() || !read_chunk_header(file.data(), file.size(), index[i].offset, &h)) {
+    return false;
+  }
+  if (h.encoding != ENCODING_RAW && h.encoding != ENCODING_CODEC) {
+    cout << "Frame " << h.frame << " has unknown encoding " << h.encoding << endl;
+    return false;
+  }
+
+  snapshot->frame = h.frame;
+  snapshot->channels = h.channels;
+  snapshot->num_particles = h.num_particles;
+  for (int c = 0; c < NUM_FRAME_CHANNELS; c++) {
+    vector<double> &values = channel_vector(*snapshot, c);
+    uint64_t size = 0;
+    const char *data = channel_data(i, (FrameChannel)(1 << c), &size);
+    if (data == NULL) {
+      if (h.channels & (1u << c)) return false; // listed but does not fit the chunk
+      values.clear();
+      continue;
+    }
+
+    if (c == 0 && h.encoding == ENCODING_CODEC) {
+      // Catch the decoder up from the nearest keyframe unless frame i - 1 was the last one decoded
+      size_t first = i;
+      if (last_decoded != (int64_t)i - 1 || (int64_t)i == 0) {
+        while (first > 0 && !is_keyframe(first)) first--;
+      }
+      for (size_t j = first; j <= i; j++) {
+        uint64_t coded_size;
+        const char *coded = channel_data(j, CHANNEL_POSITION, &coded_size);
+        vector<double> &target = j == i ? values : scratch;
+        if (coded == NULL || !decoder.decode((const uint8_t *)coded, coded_size, &target)) {
+          last_decoded = -1;
+          return false;
+        }
+        last_decoded = j;
+      }
+      if (values.size() != h.num_particles * 3) return false;
+      continue;
+    }
+
+    if (size != h.num_particles * CHANNEL_WIDTH[c] * sizeof(double)) return false;
+    values.resize(size / sizeof(double));
+    read_le(values.data(), data, values.size());
+  }
+  return true;
+}
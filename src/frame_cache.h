@@ -0,0 +1,153 @@
+#ifndef FRAME_CACHE_H
+#define FRAME_CACHE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "binary_io.h"
+#include "fluid.h"
+#include "frame_codec.h"
+
+using namespace std;
+
+// Streaming particle frame cache.
+//
+// File layout (little-endian, 64-bit offsets throughout):
+//   64-byte file header
+//   frame chunks, appended one after another. Each chunk is a 64-byte chunk
+//     header followed by one 64-byte aligned block per channel
+//   index:  one {offset, frame, size} entry per chunk
+//   footer: magic, index offset, number of frames
+//
+// The index is only written when the cache is closed. Appending to an
+// existing cache truncates the old index and footer and rewrites them at the
+// new end, without touching any frame. A cache whose writer died before
+// closing has no footer; opening it scans the chunk headers instead.
+//
+// Positions are either stored raw or compressed with the frame codec. Coded
+// frames depend on the frames since the last keyframe, which chunk headers
+// flag so a reader can seek to the nearest one.
+
+#define FRAME_CACHE_MAGIC "PBFFRAME"
+#define FRAME_CACHE_INDEX_MAGIC "PBFINDEX"
+#define FRAME_CACHE_VERSION 1
+
+enum FrameChannel {
+  CHANNEL_POSITION = 1,
+  CHANNEL_VELOCITY = 2,
+  CHANNEL_DENSITY = 4
+};
+
+#define NUM_FRAME_CHANNELS 3
+
+enum FrameEncoding {
+  ENCODING_RAW = 0,  // little-endian doubles
+  ENCODING_CODEC = 1 // positions compressed with FrameEncoder, other channels raw
+};
+
+#define CHUNK_FLAG_KEYFRAME 1
+
+// One frame of particle data. Positions and velocities hold 3 doubles per
+// particle, densities one.
+struct FrameSnapshot {
+  FrameSnapshot() {}
+
+  // Copies the requested channels out of fluid
+  void capture(const Fluid &fluid, uint64_t frame, uint32_t channels);
+
+  uint64_t frame = 0;
+  uint32_t channels = 0;
+  uint64_t num_particles = 0;
+  vector<double> positions;
+  vector<double> velocities;
+  vector<double> densities;
+};
+
+struct FrameIndexEntry {
+  uint64_t offset;
+  uint64_t frame;
+  uint64_t size;
+};
+
+struct FrameCacheWriter {
+  FrameCacheWriter() {}
+  ~FrameCacheWriter() { close(); }
+
+  // Creates a new cache, or appends to an existing one if append is set. When
+  // appending, frames numbered first_frame or later are dropped first, so a
+  // run resumed from a checkpoint overwrites what it is about to redo.
+  bool open(const string &filename, bool append = false, uint64_t first_frame = UINT64_MAX);
+
+  // Compresses positions of all following frames with the frame codec
+  void set_codec(const FrameCodecParams &params);
+
+  bool write_frame(const FrameSnapshot &snapshot);
+
+  // Writes the index and footer
+  bool close();
+
+  bool is_open() const { return out.is_open(); }
+  uint64_t bytes_written() const { return total_bytes; }
+
+  FrameCacheWriter(const FrameCacheWriter &) = delete;
+  FrameCacheWriter &operator=(const FrameCacheWriter &) = delete;
+
+private:
+  BinaryWriter out;
+  vector<FrameIndexEntry> index;
+  uint64_t end_offset = 0;
+  uint64_t total_bytes = 0;
+
+  bool use_codec = false;
+  FrameEncoder encoder;
+  vector<uint8_t> encoded;
+};
+
+struct FrameCacheReader {
+  FrameCacheReader() {}
+
+  bool open(const string &filename);
+  void close();
+
+  size_t num_frames() const { return index.size(); }
+  uint64_t frame_number(size_t i) const { return index[i].frame; }
+  // Header fields of frame i, 0 if its chunk header cannot be read
+  uint64_t num_particles(size_t i) const;
+  uint32_t channels(size_t i) const;
+
+  // Position in the index of the given frame number, or -1 if it is missing
+  int64_t find_frame(uint64_t frame) const;
+
+  // Pointer into the mapping for one channel of frame i, or NULL if the frame
+  // does not have that channel or its sizes run past the chunk. The data is
+  // stored little-endian.
+  const char *channel_data(size_t i, FrameChannel channel, uint64_t *size) const;
+
+  // Whether frame i decodes on its own. Unreadable chunks count as
+  // keyframes, so catching up stops at them and fails there.
+  bool is_keyframe(size_t i) const;
+
+  // Decodes frame i into snapshot. Coded frames are decoded from the nearest
+  // keyframe, or just from frame i - 1 when reading in order. Since this keeps
+  // decoder state, each thread needs its own reader.
+  bool read_frame(size_t i, FrameSnapshot *snapshot) const;
+
+  FrameCacheReader(const FrameCacheReader &) = delete;
+  FrameCacheReader &operator=(const FrameCacheReader &) = delete;
+
+private:
+  MappedFile file;
+  vector<FrameIndexEntry> index;
+
+  mutable FrameDecoder decoder;
+  mutable int64_t last_decoded = -1;
+  mutable vector<double> scratch;
+};
+
+// Recovers the index of a cache from its footer, or by scanning its chunks if
+// it has none. end_offset is set to where new chunks should be appended.
+bool read_frame_index(const char *data, uint64_t size, vector<FrameIndexEntry> *index,
+                      uint64_t *end_offset);
+
+#endif /* FRAME_CACHE_H */
@@ -0,0 +1,208 @@
+#include <chrono>
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+
+#include "CGL/lodepng.h"
+#include "CGL/tinyexr.h"
+#include "frame_capture.h"
+
+using namespace std;
+
+static double seconds_since(const chrono::steady_clock::time_point &start) {
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+bool FrameCapture::start(const string &prefix, CaptureFormat format, size_t num_pbos,
+                         size_t num_encoders, size_t num_buffers) {
+  finish();
+  this->prefix = prefix;
+  this->format = format;
+
+  slots.assign(num_pbos < 2 ? 2 : num_pbos, Slot());
+  for (Slot &slot : slots) {
+    glGenBuffers(1, &slot.pbo);
+  }
+  next_slot = 0;
+  pending.clear();
+
+  images.assign(num_buffers < 1 ? 1 : num_buffers, Image());
+  free_images.clear();
+  for (Image &image : images) {
+    free_images.push_back(&image);
+  }
+  queue.clear();
+  stopping = false;
+  counters = CaptureStats();
+
+  for (size_t i = 0; i < (num_encoders < 1 ? 1 : num_encoders); i++) {
+    encoders.push_back(thread(&FrameCapture::encode, this));
+  }
+  return true;
+}
+
+void FrameCapture::capture(int width, int height, uint64_t frame) {
+  if (!is_active() || width <= 0 || height <= 0) return;
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+  // Collect the reads that have completed, oldest first, and the one in the
+  // slot about to be reused whether it has completed or not
+  while (!pending.empty()) {
+    Slot &slot = slots[pending.front()];
+    bool reuse = pending.front() == next_slot;
+    if (!reuse && glClientWaitSync(slot.fence, 0, 0) == GL_TIMEOUT_EXPIRED) break;
+    pending.pop_front();
+    collect(&slot);
+  }
+
+  Slot &slot = slots[next_slot];
+  size_t size = (size_t)width * height * pixel_size();
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+  if (slot.capacity < size) {
+    glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+    slot.capacity = size;
+  }
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  glReadPixels(0, 0, width, height, GL_RGB, format == CAPTURE_PNG ? GL_UNSIGNED_BYTE : GL_FLOAT, 0);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  slot.width = width;
+  slot.height = height;
+  slot.frame = frame;
+  pending.push_back(next_slot);
+  next_slot = (next_slot + 1) % slots.size();
+
+  lock_guard<mutex> guard(lock);
+  counters.frames_captured++;
+  counters.readback_seconds += seconds_since(start);
+}
+
+// Maps a slot's buffer and queues its pixels for the encoders, or drops them
+// if every image buffer is taken
+void FrameCapture::collect(Slot *slot) {
+  glDeleteSync(slot->fence);
+  slot->fence = 0;
+
+  Image *image = NULL;
+  {
+    lock_guard<mutex> guard(lock);
+    if (free_images.empty()) {
+      counters.frames_dropped++;
+      return;
+    }
+    image = free_images.back();
+    free_images.pop_back();
+  }
+
+  size_t row = (size_t)slot->width * pixel_size();
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+  const uint8_t *mapped = (const uint8_t *)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, row * slot->height,
+                                                            GL_MAP_READ_BIT);
+  if (mapped != NULL) {
+    // OpenGL rows start at the bottom, image files at the top
+    image->pixels.resize(row * slot->height);
+    for (int y = 0; y < slot->height; y++) {
+      memcpy(&image->pixels[y * row], mapped + (slot->height - 1 - y) * row, row);
+    }
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+  image->width = slot->width;
+  image->height = slot->height;
+  image->frame = slot->frame;
+  {
+    lock_guard<mutex> guard(lock);
+    if (mapped == NULL) {
+      counters.frames_dropped++;
+      free_images.push_back(image);
+      return;
+    }
+    queue.push_back(image);
+  }
+  queued.notify_one();
+}
+
+void FrameCapture::finish() {
+  if (!is_active()) return;
+  while (!pending.empty()) {
+    collect(&slots[pending.front()]);
+    pending.pop_front();
+  }
+  for (Slot &slot : slots) {
+    glDeleteBuffers(1, &slot.pbo);
+  }
+  slots.clear();
+
+  {
+    lock_guard<mutex> guard(lock);
+    stopping = true;
+  }
+  queued.notify_all();
+  for (thread &encoder : encoders) {
+    encoder.join();
+  }
+  encoders.clear();
+  images.clear();
+  free_images.clear();
+}
+
+CaptureStats FrameCapture::stats() {
+  lock_guard<mutex> guard(lock);
+  return counters;
+}
+
+void FrameCapture::encode() {
+  // EXR channels are stored planar, in name order
+  vector<float> planes[3];
+  static const char *CHANNEL_NAMES[3] = {"B", "G", "R"};
+
+  unique_lock<mutex> guard(lock);
+  while (true) {
+    queued.wait(guard, [this]() { return !queue.empty() || stopping; });
+    if (queue.empty()) break;
+    Image *image = queue.front();
+    queue.pop_front();
+    guard.unlock();
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), "_%06llu.%s", (unsigned long long)image->frame,
+             format == CAPTURE_PNG ? "png" : "exr");
+    string filename = prefix + suffix;
+    bool ok;
+    if (format == CAPTURE_PNG) {
+      ok = lodepng::encode(filename, image->pixels, image->width, image->height, LCT_RGB, 8) == 0;
+    } else {
+      size_t n = (size_t)image->width * image->height;
+      const float *rgb = (const float *)image->pixels.data();
+      unsigned char *channels[3];
+      int pixel_types[3];
+      for (int c = 0; c < 3; c++) {
+        planes[c].resize(n);
+        for (size_t i = 0; i < n; i++) planes[c][i] = rgb[i * 3 + 2 - c];
+        channels[c] = (unsigned char *)planes[c].data();
+        pixel_types[c] = TINYEXR_PIXELTYPE_FLOAT;
+      }
+      EXRImage exr;
+      InitEXRImage(&exr);
+      exr.num_channels = 3;
+      exr.channel_names = CHANNEL_NAMES;
+      exr.images = channels;
+      exr.pixel_types = pixel_types;
+      exr.requested_pixel_types = pixel_types;
+      exr.width = image->width;
+      exr.height = image->height;
+      ok = SaveMultiChannelEXRToFile(&exr, filename.c_str(), NULL) == 0;
+    }
+    if (!ok) {
+      cout << "Failed writing " << filename << endl;
+    }
+    double elapsed = seconds_since(start);
+
+    guard.lock();
+    counters.encode_seconds += elapsed;
+    if (ok) counters.frames_written++;
+    free_images.push_back(image);
+  }
+}
@@ -0,0 +1,103 @@
+#ifndef FRAME_CAPTURE_H
+#define FRAME_CAPTURE_H
+
+#include <glad/glad.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Asynchronous capture of the viewer's framebuffer to image files.
+//
+// Every captured frame is read into the next of a ring of pixel buffer
+// objects with glReadPixels, which returns as soon as the copy is queued, and
+// a fence marks when the GPU has finished it. A buffer is mapped once its
+// fence has signaled, or at the latest when the ring comes around to it
+// again, so the render loop never waits for more than that map. The pixels
+// are copied out, flipped to top row first, and handed to encoder threads
+// that write PNG (8-bit RGB, with lodepng) or OpenEXR (float RGB, with
+// tinyexr) files named <prefix>_<frame>.<format>.
+//
+// Copies go to a fixed pool of pixel buffers. When the encoders fall so far
+// behind that none is free, frames are dropped rather than stalling the
+// viewer, and counted.
+
+enum CaptureFormat {
+  CAPTURE_PNG,
+  CAPTURE_EXR
+};
+
+struct CaptureStats {
+  uint64_t frames_captured = 0;
+  uint64_t frames_written = 0;
+  uint64_t frames_dropped = 0;
+  double readback_seconds = 0; // time the render loop spent mapping and copying
+  double encode_seconds = 0;   // time the encoder threads spent writing files
+};
+
+struct FrameCapture {
+  FrameCapture() {}
+  ~FrameCapture() { finish(); }
+
+  // Sets up the ring and starts the encoders. Needs a current GL context.
+  bool start(const string &prefix, CaptureFormat format, size_t num_pbos = 3,
+             size_t num_encoders = 2, size_t num_buffers = 8);
+
+  // Queues a read of the width x height back buffer as frame. Call after
+  // drawing and before swapping buffers.
+  void capture(int width, int height, uint64_t frame);
+
+  // Collects the pending reads, waits for the encoders and frees the buffer
+  // objects. Needs the GL context to still be current.
+  void finish();
+
+  bool is_active() const { return !encoders.empty(); }
+  CaptureStats stats();
+
+  FrameCapture(const FrameCapture &) = delete;
+  FrameCapture &operator=(const FrameCapture &) = delete;
+
+private:
+  struct Slot {
+    GLuint pbo = 0;
+    GLsync fence = 0;
+    size_t capacity = 0;
+    int width = 0;
+    int height = 0;
+    uint64_t frame = 0;
+  };
+
+  struct Image {
+    vector<uint8_t> pixels; // top row first, RGB bytes or floats
+    int width = 0;
+    int height = 0;
+    uint64_t frame = 0;
+  };
+
+  size_t pixel_size() const { return format == CAPTURE_PNG ? 3 : 3 * sizeof(float); }
+  void collect(Slot *slot);
+  void encode();
+
+  string prefix;
+  CaptureFormat format = CAPTURE_PNG;
+  vector<Slot> slots;
+  size_t next_slot = 0;
+  deque<size_t> pending; // slots being read back, oldest first
+  vector<thread> encoders;
+
+  mutex lock;
+  condition_variable queued;
+  vector<Image> images;
+  vector<Image *> free_images;
+  deque<Image *> queue;
+  bool stopping = false;
+  CaptureStats counters;
+};
+
+#endif /* FRAME_CAPTURE_H */
@@ -0,0 +1,428 @@
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+
+#include "binary_io.h"
+#include "frame_codec.h"
+
+using namespace std;
+
+#define FLAG_KEYFRAME 1
+#define FLAG_LOSSLESS 2
+
+#define HEADER_SIZE 72
+#define RICE_ESCAPE 24   // unary prefixes this long are followed by the raw value
+#define MORTON_BITS 10   // per axis, for ordering only
+
+// Bit stream helpers
+//----------------------------------------------------------------------------
+
+struct BitWriter {
+  BitWriter(vector<uint8_t> *out) : out(out) {}
+
+  // bits <= 32
+  inline void put(uint64_t value, int bits) {
+    acc |= value << n;
+    n += bits;
+    while (n >= 8) {
+      out->push_back((uint8_t)acc);
+      acc >>= 8;
+      n -= 8;
+    }
+  }
+
+  inline void put64(uint64_t value, int bits) {
+    if (bits > 32) {
+      put(value & 0xFFFFFFFFULL, 32);
+      put((value >> 32) & ((1ULL << (bits - 32)) - 1), bits - 32);
+    } else {
+      put(value & ((1ULL << bits) - 1), bits);
+    }
+  }
+
+  inline void rice(uint64_t value, int k) {
+    uint64_t prefix = value >> k;
+    if (prefix < RICE_ESCAPE) {
+      put((1ULL << prefix) - 1, (int)prefix + 1); // prefix ones, then a zero
+      put64(value, k);
+    } else {
+      put((1ULL << RICE_ESCAPE) - 1, RICE_ESCAPE);
+      put64(value, 64);
+    }
+  }
+
+  void flush() {
+    if (n > 0) out->push_back((uint8_t)acc);
+    acc = 0;
+    n = 0;
+  }
+
+  vector<uint8_t> *out;
+  uint64_t acc = 0;
+  int n = 0;
+};
+
+struct BitReader {
+  BitReader(const uint8_t *p, const uint8_t *end) : p(p), end(end) {}
+
+  inline void refill() {
+    while (n <= 56) {
+      acc |= (uint64_t)(p < end ? *p++ : 0) << n;
+      n += 8;
+    }
+  }
+
+  // bits <= 32
+  inline uint64_t get(int bits) {
+    refill();
+    uint64_t value = acc & ((1ULL << bits) - 1);
+    acc >>= bits;
+    n -= bits;
+    return value;
+  }
+
+  inline uint64_t get64(int bits) {
+    if (bits > 32) {
+      uint64_t lo = get(32);
+      return lo | (get(bits - 32) << 32);
+    }
+    return get(bits);
+  }
+
+  inline uint64_t rice(int k) {
+    refill();
+    int prefix = 0;
+    uint64_t ones = ~acc;
+#ifdef __GNUC__
+    prefix = ones == 0 ? 64 : __builtin_ctzll(ones);
+#else
+    while (prefix < 64 && !((ones >> prefix) & 1)) prefix++;
+#endif
+    if (prefix >= RICE_ESCAPE) {
+      get(RICE_ESCAPE);
+      return get64(64);
+    }
+    get(prefix + 1);
+    return ((uint64_t)prefix << k) | get64(k);
+  }
+
+  const uint8_t *p;
+  const uint8_t *end;
+  uint64_t acc = 0;
+  int n = 0;
+};
+
+// Value mappings
+//----------------------------------------------------------------------------
+
+static inline uint64_t zigzag(uint64_t r) {
+  return (r << 1) ^ (uint64_t)((int64_t)r >> 63);
+}
+
+static inline uint64_t unzigzag(uint64_t z) {
+  return (z >> 1) ^ (0 - (z & 1));
+}
+
+// Order-preserving map from doubles to unsigned integers
+static inline uint64_t double_to_ordered(double x) {
+  uint64_t b;
+  memcpy(&b, &x, sizeof(b));
+  return b & 0x8000000000000000ULL ? ~b : b | 0x8000000000000000ULL;
+}
+
+static inline double ordered_to_double(uint64_t b) {
+  b = b & 0x8000000000000000ULL ? b & ~0x8000000000000000ULL : ~b;
+  double x;
+  memcpy(&x, &b, sizeof(x));
+  return x;
+}
+
+static inline double axis(const Vector3D &v, int a) {
+  return a == 0 ? v.x : (a == 1 ? v.y : v.z);
+}
+
+static inline uint64_t quantize(double x, double lo, double hi, uint64_t max_q) {
+  double t = (x - lo) / (hi - lo);
+  t = t < 0 ? 0 : (t > 1 ? 1 : t);
+  return (uint64_t)(t * max_q + 0.5);
+}
+
+static inline double dequantize(uint64_t q, double lo, double hi, uint64_t max_q) {
+  return lo + (hi - lo) * ((double)q / max_q);
+}
+
+static inline uint32_t spread_bits(uint32_t x) {
+  x &= 0x3FF;
+  x = (x | (x << 16)) & 0x030000FF;
+  x = (x | (x << 8)) & 0x0300F00F;
+  x = (x | (x << 4)) & 0x030C30C3;
+  x = (x | (x << 2)) & 0x09249249;
+  return x;
+}
+
+// Particle indices sorted by Morton code, ties broken by index. An LSD radix
+// sort keeps this linear time and identical on every run.
+static void morton_order(const vector<double> &positions, const FluidBox &bounds,
+                         vector<uint32_t> *order) {
+  size_t n = positions.size() / 3;
+  vector<uint32_t> codes(n);
+  uint64_t max_q = (1 << MORTON_BITS) - 1;
+
+  #pragma omp parallel for
+  for (int64_t i = 0; i < (int64_t)n; i++) {
+    uint32_t c = 0;
+    for (int a = 0; a < 3; a++) {
+      uint32_t q = (uint32_t)quantize(positions[i * 3 + a], axis(bounds.min, a), axis(bounds.max, a), max_q);
+      c |= spread_bits(q) << a;
+    }
+    codes[i] = c;
+  }
+
+  order->resize(n);
+  for (size_t i = 0; i < n; i++) (*order)[i] = i;
+
+  vector<uint32_t> tmp(n);
+  const int RADIX_BITS = 10, RADIX = 1 << RADIX_BITS;
+  for (int shift = 0; shift < 3 * MORTON_BITS; shift += RADIX_BITS) {
+    vector<size_t> count(RADIX + 1, 0);
+    for (size_t i = 0; i < n; i++) count[((codes[(*order)[i]] >> shift) & (RADIX - 1)) + 1]++;
+    for (int b = 0; b < RADIX; b++) count[b + 1] += count[b];
+    for (size_t i = 0; i < n; i++) tmp[count[(codes[(*order)[i]] >> shift) & (RADIX - 1)]++] = (*order)[i];
+    order->swap(tmp);
+  }
+}
+
+static inline uint64_t max_quantized(int bits) {
+  return bits >= 64 ? ~0ULL : (1ULL << bits) - 1;
+}
+
+// Encoder
+//----------------------------------------------------------------------------
+
+void FrameEncoder::encode(const vector<double> &positions, vector<uint8_t> *out) {
+  size_t n = positions.size() / 3;
+
+  // Grow the quantization domain if particles left it
+  double lo[3] = {INF_D, INF_D, INF_D}, hi[3] = {-INF_D, -INF_D, -INF_D};
+  for (size_t i = 0; i < n; i++) {
+    for (int a = 0; a < 3; a++) {
+      lo[a] = min(lo[a], positions[i * 3 + a]);
+      hi[a] = max(hi[a], positions[i * 3 + a]);
+    }
+  }
+  bool bounds_changed = false;
+  FluidBox &b = params.bounds;
+  if (n > 0 && (lo[0] < b.min.x || lo[1] < b.min.y || lo[2] < b.min.z ||
+                hi[0] > b.max.x || hi[1] > b.max.y || hi[2] > b.max.z)) {
+    Vector3D new_min(min(lo[0], b.min.x), min(lo[1], b.min.y), min(lo[2], b.min.z));
+    Vector3D new_max(max(hi[0], b.max.x), max(hi[1], b.max.y), max(hi[2], b.max.z));
+    Vector3D margin = (new_max - new_min) * 0.5 + Vector3D(1e-6);
+    b = FluidBox(new_min - margin, new_max + margin);
+    bounds_changed = true;
+  }
+
+  bool keyframe = prev_q.size() != n * 3 || bounds_changed ||
+                  frames_since_keyframe + 1 >= params.keyframe_interval;
+  frames_since_keyframe = keyframe ? 0 : frames_since_keyframe + 1;
+
+  // Map to integers
+  params.bits = max(1, min(32, params.bits));
+  uint64_t max_q = max_quantized(params.bits);
+  q.resize(n * 3);
+  #pragma omp parallel for
+  for (int64_t i = 0; i < (int64_t)n; i++) {
+    for (int a = 0; a < 3; a++) {
+      q[i * 3 + a] = params.lossless ? double_to_ordered(positions[i * 3 + a])
+                                     : quantize(positions[i * 3 + a], axis(b.min, a), axis(b.max, a), max_q);
+    }
+  }
+
+  if (keyframe) {
+    order.resize(n);
+    for (size_t i = 0; i < n; i++) order[i] = i;
+  } else {
+    morton_order(prev_positions, b, &order);
+  }
+
+  // Code every chunk into its own buffer
+  size_t chunk_size = max(1, params.chunk_size);
+  size_t num_chunks = (n + chunk_size - 1) / chunk_size;
+  vector<vector<uint8_t> > chunks(num_chunks);
+
+  #pragma omp parallel for schedule(dynamic)
+  for (int64_t c = 0; c < (int64_t)num_chunks; c++) {
+    size_t k0 = c * chunk_size, k1 = min(n, k0 + chunk_size);
+    vector<uint64_t> residuals((k1 - k0) * 3);
+    double mean[3] = {0, 0, 0};
+
+    uint64_t pred[3] = {0, 0, 0};
+    for (size_t k = k0; k < k1; k++) {
+      uint32_t p = order[k];
+      for (int a = 0; a < 3; a++) {
+        uint64_t d = keyframe ? q[p * 3 + a] : q[p * 3 + a] - prev_q[p * 3 + a];
+        uint64_t z = zigzag(d - pred[a]);
+        pred[a] = d;
+        residuals[(k - k0) * 3 + a] = z;
+        mean[a] += (double)z;
+      }
+    }
+
+    // Rice parameter close to log2 of the mean residual
+    uint8_t rice_k[3];
+    for (int a = 0; a < 3; a++) {
+      mean[a] /= (k1 - k0);
+      rice_k[a] = mean[a] < 2 ? 0 : (uint8_t)min(63.0, floor(log2(mean[a])));
+    }
+
+    vector<uint8_t> &bytes = chunks[c];
+    bytes.assign(rice_k, rice_k + 3);
+    BitWriter bits(&bytes);
+    for (size_t i = 0; i < residuals.size(); i++) {
+      bits.rice(residuals[i], rice_k[i % 3]);
+    }
+    bits.flush();
+  }
+
+  // Header, chunk table, chunks
+  size_t start = out->size();
+  out->resize(start + HEADER_SIZE + num_chunks * 8);
+  uint8_t *h = out->data() + start;
+
+  uint32_t flags = (keyframe ? FLAG_KEYFRAME : 0) | (params.lossless ? FLAG_LOSSLESS : 0);
+  uint32_t bits = params.bits;
+  uint64_t count = n;
+  double bounds_values[6] = {b.min.x, b.min.y, b.min.z, b.max.x, b.max.y, b.max.z};
+  uint32_t cs = chunk_size, nc = num_chunks;
+  memcpy(h, &flags, 4);
+  memcpy(h + 4, &bits, 4);
+  memcpy(h + 8, &count, 8);
+  memcpy(h + 16, bounds_values, 48);
+  memcpy(h + 64, &cs, 4);
+  memcpy(h + 68, &nc, 4);
+
+  uint64_t end = 0;
+  for (size_t c = 0; c < num_chunks; c++) {
+    end += chunks[c].size();
+    memcpy(h + HEADER_SIZE + c * 8, &end, 8);
+  }
+  if (!host_is_little_endian()) {
+    byte_swap(h, 4);
+    byte_swap(h + 4, 4);
+    byte_swap(h + 8, 8);
+    for (int i = 0; i < 6; i++) byte_swap(h + 16 + i * 8, 8);
+    byte_swap(h + 64, 4);
+    byte_swap(h + 68, 4);
+    for (size_t c = 0; c < num_chunks; c++) byte_swap(h + HEADER_SIZE + c * 8, 8);
+  }
+
+  for (size_t c = 0; c < num_chunks; c++) {
+    out->insert(out->end(), chunks[c].begin(), chunks[c].end());
+  }
+
+  // Keep what the decoder will see as the reference for the next frame
+  prev_q.swap(q);
+  prev_positions.resize(n * 3);
+  #pragma omp parallel for
+  for (int64_t i = 0; i < (int64_t)n; i++) {
+    for (int a = 0; a < 3; a++) {
+      prev_positions[i * 3 + a] = params.lossless ? positions[i * 3 + a]
+          : dequantize(prev_q[i * 3 + a], axis(b.min, a), axis(b.max, a), max_q);
+    }
+  }
+}
+
+// Decoder
+//----------------------------------------------------------------------------
+
+bool FrameDecoder::is_keyframe(const uint8_t *data, uint64_t size) {
+  if (size < HEADER_SIZE) return false;
+  uint32_t flags;
+  read_le(&flags, data);
+  return flags & FLAG_KEYFRAME;
+}
+
+uint64_t FrameDecoder::max_size(uint64_t num_particles) {
+  // One particle per chunk, with every residual escaped
+  return HEADER_SIZE + num_particles * (8 + 3 + (3 * (RICE_ESCAPE + 64) + 7) / 8);
+}
+
+bool FrameDecoder::decode(const uint8_t *data, uint64_t size, vector<double> *positions) {
+  if (size < HEADER_SIZE) return false;
+
+  uint32_t flags, bits, chunk_size, num_chunks;
+  uint64_t n;
+  double bounds_values[6];
+  read_le(&flags, data);
+  read_le(&bits, data + 4);
+  read_le(&n, data + 8);
+  read_le(bounds_values, data + 16, 6);
+  read_le(&chunk_size, data + 64);
+  read_le(&num_chunks, data + 68);
+
+  bool keyframe = flags & FLAG_KEYFRAME;
+  bool lossless = flags & FLAG_LOSSLESS;
+  FluidBox b(Vector3D(bounds_values[0], bounds_values[1], bounds_values[2]),
+             Vector3D(bounds_values[3], bounds_values[4], bounds_values[5]));
+
+  if (chunk_size == 0 || num_chunks != (n + chunk_size - 1) / chunk_size ||
+      HEADER_SIZE + (uint64_t)num_chunks * 8 > size) {
+    return false;
+  }
+  if (!keyframe && prev_q.size() != n * 3) return false;
+
+  vector<uint64_t> chunk_end(num_chunks);
+  read_le(chunk_end.data(), data + HEADER_SIZE, num_chunks);
+  const uint8_t *payload = data + HEADER_SIZE + num_chunks * 8;
+  uint64_t payload_size = size - HEADER_SIZE - num_chunks * 8;
+  if (num_chunks > 0 && chunk_end.back() > payload_size) return false;
+
+  if (keyframe) {
+    order.resize(n);
+    for (size_t i = 0; i < n; i++) order[i] = i;
+  } else {
+    morton_order(prev_positions, b, &order);
+  }
+
+  q.resize(n * 3);
+  bool bad = false; // a chunk too short for its Rice parameters
+  #pragma omp parallel for schedule(dynamic)
+  for (int64_t c = 0; c < (int64_t)num_chunks; c++) {
+    uint64_t begin = c == 0 ? 0 : chunk_end[c - 1];
+    const uint8_t *p = payload + begin;
+    const uint8_t *end = payload + chunk_end[c];
+    if (begin > chunk_end[c] || end - p < 3) {
+      #pragma omp atomic write
+      bad = true;
+      continue;
+    }
+
+    uint8_t rice_k[3] = {p[0], p[1], p[2]};
+    BitReader reader(p + 3, end);
+
+    size_t k0 = c * (size_t)chunk_size, k1 = min((size_t)n, k0 + chunk_size);
+    uint64_t pred[3] = {0, 0, 0};
+    for (size_t k = k0; k < k1; k++) {
+      uint32_t pi = order[k];
+      for (int a = 0; a < 3; a++) {
+        uint64_t d = pred[a] + unzigzag(reader.rice(rice_k[a]));
+        pred[a] = d;
+        q[pi * 3 + a] = keyframe ? d : prev_q[pi * 3 + a] + d;
+      }
+    }
+  }
+  if (bad) return false;
+
+  uint64_t max_q = max_quantized(bits);
+  positions->resize(n * 3);
+  #pragma omp parallel for
+  for (int64_t i = 0; i < (int64_t)n; i++) {
+    for (int a = 0; a < 3; a++) {
+      (*positions)[i * 3 + a] = lossless ? ordered_to_double(q[i * 3 + a])
+          : dequantize(q[i * 3 + a], axis(b.min, a), axis(b.max, a), max_q);
+    }
+  }
+
+  prev_q.swap(q);
+  prev_positions = *positions;
+  return true;
+}
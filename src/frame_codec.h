@@ -0,0 +1,84 @@
+#ifndef FRAME_CODEC_H
+#define FRAME_CODEC_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "generator.h"
+
+using namespace std;
+
+// Compression codec for per-frame particle positions.
+//
+// Every coordinate is first mapped to an unsigned integer. The lossy mode
+// quantizes it to the domain bounding box with `bits` bits per axis; the
+// lossless mode uses an order-preserving mapping of the raw double bits.
+//
+// Keyframes predict each particle from the previous particle in index order.
+// Other frames visit particles in the Morton order of the previous decoded
+// frame (which the decoder also has), take each particle's displacement since
+// that frame, and predict it from the displacement of the previous particle
+// in that order. Neighboring fluid moves coherently, so the residuals are
+// small.
+//
+// The residuals are zigzag mapped and Rice coded, with the Rice parameter
+// picked per chunk and axis. Chunks of chunk_size particles are coded
+// independently, so encoding and decoding run in parallel by chunk.
+
+struct FrameCodecParams {
+  FrameCodecParams() {}
+
+  bool lossless = false;
+  int bits = 16;                // per axis, lossy mode only (1 to 32)
+  int chunk_size = 1 << 16;     // particles per independently coded chunk
+  int keyframe_interval = 30;   // frames between keyframes
+
+  // Quantization domain, normally the scene's domain. If empty (min > max)
+  // it is derived from the first frame. It is grown whenever particles leave
+  // it, which starts a new keyframe, so positions are never clamped.
+  FluidBox bounds = FluidBox(Vector3D(INF_D), Vector3D(-INF_D));
+};
+
+struct FrameEncoder {
+  FrameEncoder() {}
+  FrameEncoder(const FrameCodecParams &params) : params(params) {}
+
+  // Encodes num_particles * 3 positions and appends the result to out
+  void encode(const vector<double> &positions, vector<uint8_t> *out);
+
+  // Restarts the stream, so the next frame is a keyframe
+  void reset() { prev_q.clear(); }
+
+  FrameCodecParams params;
+
+private:
+  vector<uint64_t> prev_q;       // quantized previous frame, as decoded
+  vector<double> prev_positions; // previous frame, as decoded
+  vector<uint64_t> q;
+  vector<uint32_t> order;
+  int frames_since_keyframe = 0;
+};
+
+struct FrameDecoder {
+  FrameDecoder() {}
+
+  // Decodes one encoded frame. Frames after a keyframe must be decoded in
+  // order; returns false if the stream is corrupt or a delta frame arrives
+  // without its predecessor.
+  bool decode(const uint8_t *data, uint64_t size, vector<double> *positions);
+
+  void reset() { prev_q.clear(); }
+
+  static bool is_keyframe(const uint8_t *data, uint64_t size);
+
+  // Largest encoding of num_particles positions under any parameters
+  static uint64_t max_size(uint64_t num_particles);
+
+private:
+  vector<uint64_t> prev_q;
+  vector<double> prev_positions;
+  vector<uint64_t> q;
+  vector<uint32_t> order;
+};
+
+#endif /* FRAME_CODEC_H */
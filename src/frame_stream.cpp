@@ -0,0 +1,422 @@
+#include <chrono>
+#include <iostream>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "frame_stream.h"
+
+using namespace std;
+
+#define MESSAGE_HEADER_SIZE 32
+
+#ifndef _WIN32
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+// Splits "unix:<path>" or "<host>:<port>"
+static bool parse_endpoint(const string &endpoint, bool *is_unix, string *host, string *port) {
+  if (endpoint.compare(0, 5, "unix:") == 0) {
+    *is_unix = true;
+    *host = endpoint.substr(5);
+    return !host->empty();
+  }
+  size_t colon = endpoint.rfind(':');
+  if (colon == string::npos || colon + 1 == endpoint.size()) return false;
+  *is_unix = false;
+  *host = endpoint.substr(0, colon);
+  *port = endpoint.substr(colon + 1);
+  return true;
+}
+
+static bool unix_address(const string &path, sockaddr_un *addr) {
+  if (path.size() >= sizeof(addr->sun_path)) return false;
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  memcpy(addr->sun_path, path.c_str(), path.size() + 1);
+  return true;
+}
+
+// Fails if the data has not all gone out by the deadline. Every send() is
+// also bounded by the socket's SO_SNDTIMEO, so a stalled peer cannot block
+// past it.
+static bool send_all(int fd, const void *data, size_t size,
+                     const chrono::steady_clock::time_point &deadline) {
+  const char *p = (const char *)data;
+  while (size > 0) {
+    if (chrono::steady_clock::now() > deadline) return false;
+    ssize_t n = send(fd, p, size, SEND_FLAGS);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+static bool recv_all(int fd, void *data, size_t size) {
+  char *p = (char *)data;
+  while (size > 0) {
+    ssize_t n = recv(fd, p, size, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+template <typename T>
+static void append_le(vector<uint8_t> *out, T value) {
+  if (!host_is_little_endian()) byte_swap(&value, sizeof(T));
+  const uint8_t *b = (const uint8_t *)&value;
+  out->insert(out->end(), b, b + sizeof(T));
+}
+
+bool FrameStreamServer::listen(const string &endpoint, int decimation,
+                               const FrameCodecParams &params) {
+  close();
+  bool is_unix;
+  string host, port;
+  if (!parse_endpoint(endpoint, &is_unix, &host, &port)) {
+    cout << "Bad stream endpoint " << endpoint << ", expected unix:<path> or <host>:<port>" << endl;
+    return false;
+  }
+
+  if (is_unix) {
+    sockaddr_un addr;
+    if (!unix_address(host, &addr)) {
+      cout << "Socket path " << host << " is too long" << endl;
+      return false;
+    }
+    unlink(host.c_str());
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, (sockaddr *)&addr, sizeof(addr)) != 0) {
+      cout << "Could not bind " << endpoint << endl;
+      close();
+      return false;
+    }
+    unix_path = host;
+  } else {
+    addrinfo hints, *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &result) != 0) {
+      cout << "Could not resolve " << endpoint << endl;
+      return false;
+    }
+    for (addrinfo *a = result; a != NULL && listener < 0; a = a->ai_next) {
+      listener = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+      if (listener < 0) continue;
+      int one = 1;
+      setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+      if (bind(listener, a->ai_addr, a->ai_addrlen) != 0) {
+        ::close(listener);
+        listener = -1;
+      }
+    }
+    freeaddrinfo(result);
+    if (listener < 0) {
+      cout << "Could not bind " << endpoint << endl;
+      return false;
+    }
+  }
+
+  if (::listen(listener, 4) != 0) {
+    cout << "Could not listen on " << endpoint << endl;
+    close();
+    return false;
+  }
+  // The sender thread polls for new viewers between frames
+  fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+
+  this->decimation = decimation < 1 ? 1 : decimation;
+  encoder = FrameEncoder(params);
+  stopping = false;
+  has_pending = false;
+  counters = StreamStats();
+  worker = thread(&FrameStreamServer::run, this);
+  cout << "Streaming frames on " << endpoint << endl;
+  return true;
+}
+
+void FrameStreamServer::close() {
+  if (worker.joinable()) {
+    {
+      lock_guard<mutex> guard(lock);
+      stopping = true;
+    }
+    offered.notify_one();
+    worker.join();
+  }
+  for (int fd : clients) {
+    ::close(fd);
+  }
+  clients.clear();
+  if (listener >= 0) {
+    ::close(listener);
+    listener = -1;
+  }
+  if (!unix_path.empty()) {
+    unlink(unix_path.c_str());
+    unix_path.clear();
+  }
+}
+
+void FrameStreamServer::offer(const vector<double> &positions, uint64_t frame) {
+  if (!is_open()) return;
+
+  size_t n = positions.size() / 3;
+  size_t kept = (n + decimation - 1) / decimation;
+  staging.resize(kept * 3);
+  for (size_t i = 0; i < kept; i++) {
+    staging[i * 3] = positions[i * decimation * 3];
+    staging[i * 3 + 1] = positions[i * decimation * 3 + 1];
+    staging[i * 3 + 2] = positions[i * decimation * 3 + 2];
+  }
+
+  {
+    lock_guard<mutex> guard(lock);
+    counters.frames_offered++;
+    if (has_pending) counters.frames_dropped++;
+    staging.swap(pending);
+    pending_frame = frame;
+    has_pending = true;
+  }
+  offered.notify_one();
+}
+
+void FrameStreamServer::accept_clients() {
+  while (true) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) break;
+    // Some platforms pass the listener's O_NONBLOCK on to accepted sockets
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    timeval timeout;
+    timeout.tv_sec = STREAM_SEND_TIMEOUT_MS / 1000;
+    timeout.tv_usec = STREAM_SEND_TIMEOUT_MS % 1000 * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+#ifdef SO_NOSIGPIPE
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+    clients.push_back(fd);
+    // The new viewer needs a keyframe to start from
+    encoder.reset();
+  }
+}
+
+void FrameStreamServer::run() {
+  unique_lock<mutex> guard(lock);
+  while (!stopping) {
+    offered.wait_for(guard, chrono::milliseconds(100), [this]() { return has_pending || stopping; });
+    guard.unlock();
+    accept_clients();
+    guard.lock();
+    counters.num_clients = clients.size();
+    if (!has_pending || stopping) continue;
+
+    pending.swap(sending);
+    uint64_t frame = pending_frame;
+    has_pending = false;
+    guard.unlock();
+
+    if (!clients.empty()) {
+      message.clear();
+      append_le(&message, (uint32_t)STREAM_MAGIC);
+      append_le(&message, (uint32_t)0);
+      append_le(&message, frame);
+      append_le(&message, (uint64_t)(sending.size() / 3));
+      append_le(&message, (uint64_t)0); // payload size, filled in below
+      encoder.encode(sending, &message);
+      uint64_t payload_size = message.size() - MESSAGE_HEADER_SIZE;
+      if (!host_is_little_endian()) byte_swap(&payload_size, sizeof(payload_size));
+      memcpy(message.data() + 24, &payload_size, sizeof(payload_size));
+
+      for (size_t i = 0; i < clients.size();) {
+        chrono::steady_clock::time_point deadline =
+            chrono::steady_clock::now() + chrono::milliseconds(STREAM_SEND_TIMEOUT_MS);
+        if (send_all(clients[i], message.data(), message.size(), deadline)) {
+          i++;
+          continue;
+        }
+        // Viewer went away, or stopped reading. Part of the frame may have
+        // gone out, so the stream cannot be resumed.
+        ::close(clients[i]);
+        clients.erase(clients.begin() + i);
+      }
+    }
+
+    guard.lock();
+    if (!clients.empty()) {
+      counters.frames_sent++;
+      counters.bytes_sent += message.size() * clients.size();
+    }
+    counters.num_clients = clients.size();
+  }
+}
+
+bool FrameStreamClient::connect(const string &endpoint, double timeout_sec) {
+  close();
+  bool is_unix;
+  string host, port;
+  if (!parse_endpoint(endpoint, &is_unix, &host, &port)) {
+    cout << "Bad stream endpoint " << endpoint << ", expected unix:<path> or <host>:<port>" << endl;
+    return false;
+  }
+
+  // The solver may still be starting up, so keep trying for a while
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  while (sock < 0) {
+    if (is_unix) {
+      sockaddr_un addr;
+      if (!unix_address(host, &addr)) {
+        cout << "Socket path " << host << " is too long" << endl;
+        return false;
+      }
+      sock = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (sock >= 0 && ::connect(sock, (sockaddr *)&addr, sizeof(addr)) != 0) {
+        ::close(sock);
+        sock = -1;
+      }
+    } else {
+      addrinfo hints, *result;
+      memset(&hints, 0, sizeof(hints));
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      if (getaddrinfo(host.empty() ? "localhost" : host.c_str(), port.c_str(), &hints, &result) == 0) {
+        for (addrinfo *a = result; a != NULL && sock < 0; a = a->ai_next) {
+          sock = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+          if (sock >= 0 && ::connect(sock, a->ai_addr, a->ai_addrlen) != 0) {
+            ::close(sock);
+            sock = -1;
+          }
+        }
+        freeaddrinfo(result);
+      }
+    }
+
+    if (sock < 0) {
+      if (chrono::duration<double>(chrono::steady_clock::now() - start).count() > timeout_sec) {
+        cout << "Could not connect to " << endpoint << endl;
+        return false;
+      }
+      this_thread::sleep_for(chrono::milliseconds(200));
+    }
+  }
+
+  decoder.reset();
+  open = true;
+  has_frame = false;
+  worker = thread(&FrameStreamClient::run, this);
+  return true;
+}
+
+void FrameStreamClient::close() {
+  if (sock >= 0) {
+    // Unblocks the receiver thread
+    shutdown(sock, SHUT_RDWR);
+  }
+  if (worker.joinable()) {
+    worker.join();
+  }
+  if (sock >= 0) {
+    ::close(sock);
+    sock = -1;
+  }
+  open = false;
+}
+
+void FrameStreamClient::run() {
+  uint8_t header[MESSAGE_HEADER_SIZE];
+  while (recv_all(sock, header, MESSAGE_HEADER_SIZE)) {
+    uint32_t magic;
+    uint64_t frame, num_particles, size;
+    read_le(&magic, header);
+    read_le(&frame, header + 8);
+    read_le(&num_particles, header + 16);
+    read_le(&size, header + 24);
+    if (magic != STREAM_MAGIC || num_particles > STREAM_MAX_PARTICLES ||
+        size > FrameDecoder::max_size(num_particles)) {
+      cout << "Bad frame stream message" << endl;
+      break;
+    }
+
+    payload.resize(size);
+    if (!recv_all(sock, payload.data(), size)) break;
+    if (!decoder.decode(payload.data(), size, &decoded) || decoded.size() != num_particles * 3) {
+      // Wait for the next keyframe
+      decoder.reset();
+      continue;
+    }
+
+    lock_guard<mutex> guard(lock);
+    frame_positions.resize(decoded.size());
+    for (size_t i = 0; i < decoded.size(); i++) {
+      frame_positions[i] = decoded[i];
+    }
+    frame_number = frame;
+    has_frame = true;
+  }
+
+  lock_guard<mutex> guard(lock);
+  open = false;
+}
+
+#else
+
+bool FrameStreamServer::listen(const string &endpoint, int decimation,
+                               const FrameCodecParams &params) {
+  cout << "Frame streaming is not supported on this platform" << endl;
+  return false;
+}
+
+void FrameStreamServer::close() {}
+void FrameStreamServer::offer(const vector<double> &positions, uint64_t frame) {}
+void FrameStreamServer::accept_clients() {}
+void FrameStreamServer::run() {}
+
+bool FrameStreamClient::connect(const string &endpoint, double timeout_sec) {
+  cout << "Frame streaming is not supported on this platform" << endl;
+  return false;
+}
+
+void FrameStreamClient::close() {}
+void FrameStreamClient::run() {}
+
+#endif
+
+StreamStats FrameStreamServer::stats() {
+  lock_guard<mutex> guard(lock);
+  return counters;
+}
+
+bool FrameStreamClient::latest(vector<float> *positions, uint64_t *frame) {
+  lock_guard<mutex> guard(lock);
+  if (!has_frame) return false;
+  positions->swap(frame_positions);
+  *frame = frame_number;
+  has_frame = false;
+  return true;
+}
+
+bool FrameStreamClient::connected() {
+  lock_guard<mutex> guard(lock);
+  return open;
+}
@@ -0,0 +1,129 @@
+#ifndef FRAME_STREAM_H
+#define FRAME_STREAM_H
+
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "binary_io.h"
+#include "frame_codec.h"
+
+using namespace std;
+
+// Streaming of particle frames over a TCP or Unix domain socket, from a
+// headless solver to standalone viewers.
+//
+// Endpoints are written "unix:<path>" or "<host>:<port>"; a server may leave
+// the host out to listen on all interfaces.
+//
+// Each frame is sent as a 32-byte message header (magic, flags, frame number,
+// particle count, payload size, all little-endian) followed by the positions
+// coded with FrameEncoder. The encoder restarts with a keyframe whenever a
+// viewer connects, and every viewer gets every coded frame, so their decoders
+// stay in step.
+//
+// The solver never waits for the network: offer() only swaps its frame into a
+// pending slot that a sender thread picks up. If the sender is still busy with
+// an earlier frame, because a viewer is slow, the pending frame is replaced
+// and counted as dropped, so viewers always get the newest frame. A viewer
+// that does not take a frame within STREAM_SEND_TIMEOUT_MS is disconnected,
+// so it cannot hold up the others or close().
+
+#define STREAM_MAGIC FOURCC('P', 'B', 'F', 'S')
+
+// Time a viewer gets to take one frame before it is disconnected
+#define STREAM_SEND_TIMEOUT_MS 2000
+
+// Largest frame a viewer accepts. Messages announcing more particles, or a
+// payload larger than the codec can produce for them, end the connection.
+#define STREAM_MAX_PARTICLES (1ULL << 28)
+
+struct StreamStats {
+  uint64_t frames_offered = 0;
+  uint64_t frames_sent = 0;
+  uint64_t frames_dropped = 0;
+  uint64_t bytes_sent = 0;
+  size_t num_clients = 0;
+};
+
+// Solver side
+struct FrameStreamServer {
+  FrameStreamServer() {}
+  ~FrameStreamServer() { close(); }
+
+  // Starts listening on endpoint. Only every decimation-th particle is sent.
+  bool listen(const string &endpoint, int decimation = 1,
+              const FrameCodecParams &params = FrameCodecParams());
+  void close();
+
+  // Hands the positions (3 doubles per particle) of frame to the sender thread
+  void offer(const vector<double> &positions, uint64_t frame);
+
+  bool is_open() const { return worker.joinable(); }
+  StreamStats stats();
+
+  FrameStreamServer(const FrameStreamServer &) = delete;
+  FrameStreamServer &operator=(const FrameStreamServer &) = delete;
+
+private:
+  void run();
+  void accept_clients();
+
+  int listener = -1;
+  string unix_path;
+  int decimation = 1;
+  vector<int> clients;
+  FrameEncoder encoder;
+  vector<uint8_t> message;
+  thread worker;
+
+  mutex lock;
+  condition_variable offered;
+  bool stopping = false;
+  bool has_pending = false;
+  vector<double> staging;  // filled by offer() outside the lock
+  vector<double> pending;
+  vector<double> sending;
+  uint64_t pending_frame = 0;
+  StreamStats counters;
+};
+
+// Viewer side. A receiver thread decodes every incoming frame and keeps the
+// newest one for the render loop.
+struct FrameStreamClient {
+  FrameStreamClient() {}
+  ~FrameStreamClient() { close(); }
+
+  // Connects to endpoint, retrying for up to timeout_sec seconds
+  bool connect(const string &endpoint, double timeout_sec = 10);
+  void close();
+
+  // Swaps the newest frame into positions (3 floats per particle) if one
+  // arrived since the last call
+  bool latest(vector<float> *positions, uint64_t *frame);
+
+  bool connected();
+
+  FrameStreamClient(const FrameStreamClient &) = delete;
+  FrameStreamClient &operator=(const FrameStreamClient &) = delete;
+
+private:
+  void run();
+
+  int sock = -1;
+  thread worker;
+  FrameDecoder decoder;
+  vector<uint8_t> payload;
+  vector<double> decoded;
+
+  mutex lock;
+  bool open = false;
+  bool has_frame = false;
+  vector<float> frame_positions;
+  uint64_t frame_number = 0;
+};
+
+#endif /* FRAME_STREAM_H */
@@ -0,0 +1,122 @@
+#include <chrono>
+#include <iostream>
+
+#include "frame_writer.h"
+
+using namespace std;
+
+static double seconds_since(const chrono::steady_clock::time_point &start) {
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+bool AsyncFrameWriter::open(const string &filename, bool append, uint64_t first_frame,
+                            size_t queue_capacity, QueuePolicy policy,
+                            const FrameCodecParams *codec) {
+  close();
+  if (!cache.open(filename, append, first_frame)) {
+    return false;
+  }
+  if (codec) {
+    cache.set_codec(*codec);
+  }
+
+  this->policy = policy;
+  if (queue_capacity < 1) queue_capacity = 1;
+  pool.assign(queue_capacity + 1, FrameSnapshot());
+  free_buffers.clear();
+  for (FrameSnapshot &snapshot : pool) {
+    free_buffers.push_back(&snapshot);
+  }
+  queue.clear();
+  stopping = false;
+  failed = false;
+  counters = FrameWriterStats();
+
+  worker = thread(&AsyncFrameWriter::run, this);
+  return true;
+}
+
+FrameSnapshot *AsyncFrameWriter::acquire() {
+  unique_lock<mutex> guard(lock);
+  if (free_buffers.empty() && (queue.size() + 1 < pool.size() || policy == QUEUE_BLOCK)) {
+    // Only the buffer being written is missing, or we are allowed to wait
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    freed.wait(guard, [this]() { return !free_buffers.empty() || failed; });
+    counters.blocked_seconds += seconds_since(start);
+  }
+
+  if (!free_buffers.empty()) {
+    FrameSnapshot *snapshot = free_buffers.back();
+    free_buffers.pop_back();
+    return snapshot;
+  }
+  if (policy == QUEUE_COALESCE && !queue.empty()) {
+    FrameSnapshot *snapshot = queue.back();
+    queue.pop_back();
+    counters.frames_coalesced++;
+    return snapshot;
+  }
+  counters.frames_dropped++;
+  return NULL;
+}
+
+void AsyncFrameWriter::submit(FrameSnapshot *snapshot) {
+  {
+    lock_guard<mutex> guard(lock);
+    queue.push_back(snapshot);
+    counters.frames_submitted++;
+    counters.queue_depth = queue.size();
+    if (queue.size() > counters.max_queue_depth) counters.max_queue_depth = queue.size();
+  }
+  queued.notify_one();
+}
+
+void AsyncFrameWriter::run() {
+  unique_lock<mutex> guard(lock);
+  while (true) {
+    queued.wait(guard, [this]() { return !queue.empty() || stopping; });
+    if (queue.empty()) break;
+
+    FrameSnapshot *snapshot = queue.front();
+    queue.pop_front();
+    counters.queue_depth = queue.size();
+    guard.unlock();
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    uint64_t bytes_before = cache.bytes_written();
+    bool ok = !failed && cache.write_frame(*snapshot);
+    double elapsed = seconds_since(start);
+
+    guard.lock();
+    if (!ok && !failed) {
+      cout << "Failed writing frame " << snapshot->frame << " to the frame cache" << endl;
+      failed = true;
+    }
+    counters.frames_written += ok;
+    counters.bytes_written += cache.bytes_written() - bytes_before;
+    counters.write_seconds += elapsed;
+    free_buffers.push_back(snapshot);
+    freed.notify_one();
+  }
+}
+
+bool AsyncFrameWriter::close() {
+  if (!worker.joinable()) return true;
+  {
+    lock_guard<mutex> guard(lock);
+    stopping = true;
+  }
+  queued.notify_one();
+  worker.join();
+  return cache.close() && !failed;
+}
+
+bool AsyncFrameWriter::good() {
+  lock_guard<mutex> guard(lock);
+  return !failed;
+}
+
+FrameWriterStats AsyncFrameWriter::stats() {
+  lock_guard<mutex> guard(lock);
+  return counters;
+}
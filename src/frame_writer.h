@@ -0,0 +1,93 @@
+#ifndef FRAME_WRITER_H
+#define FRAME_WRITER_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "frame_cache.h"
+
+using namespace std;
+
+// Asynchronous frame cache writer.
+//
+// The simulation loop takes a snapshot buffer from a fixed pool, fills it and
+// submits it. A writer thread encodes and writes queued snapshots and returns
+// their buffers to the pool, so neither side allocates once the buffers have
+// grown to the frame size. The pool holds one buffer more than the queue, for
+// the snapshot being written.
+//
+// When the queue is full, the policy decides what happens to the new frame:
+//   QUEUE_BLOCK     wait for the writer to free a buffer
+//   QUEUE_DROP      skip the new frame
+//   QUEUE_COALESCE  overwrite the newest queued frame with the new one, so the
+//                   cache keeps up with the simulation at a lower frame rate
+
+enum QueuePolicy {
+  QUEUE_BLOCK,
+  QUEUE_DROP,
+  QUEUE_COALESCE
+};
+
+struct FrameWriterStats {
+  uint64_t frames_submitted = 0;
+  uint64_t frames_written = 0;
+  uint64_t frames_dropped = 0;
+  uint64_t frames_coalesced = 0;
+  uint64_t bytes_written = 0;
+  size_t queue_depth = 0;
+  size_t max_queue_depth = 0;
+  double write_seconds = 0;  // time the writer thread spent encoding and writing
+  double blocked_seconds = 0; // time the simulation spent waiting for a buffer
+
+  double bandwidth() const { return write_seconds > 0 ? bytes_written / write_seconds : 0; }
+};
+
+struct AsyncFrameWriter {
+  AsyncFrameWriter() {}
+  ~AsyncFrameWriter() { close(); }
+
+  // Opens the cache like FrameCacheWriter::open and starts the writer thread.
+  // codec may be NULL to store positions raw.
+  bool open(const string &filename, bool append, uint64_t first_frame, size_t queue_capacity,
+            QueuePolicy policy, const FrameCodecParams *codec = NULL);
+
+  // Returns a buffer to capture the next frame into, or NULL if the policy
+  // drops the frame. Every buffer returned must be passed to submit().
+  FrameSnapshot *acquire();
+  void submit(FrameSnapshot *snapshot);
+
+  // Writes the remaining queue, stops the writer thread and closes the cache.
+  // Returns false if any write failed.
+  bool close();
+
+  bool is_open() const { return worker.joinable(); }
+  bool good();
+  FrameWriterStats stats();
+
+  AsyncFrameWriter(const AsyncFrameWriter &) = delete;
+  AsyncFrameWriter &operator=(const AsyncFrameWriter &) = delete;
+
+private:
+  void run();
+
+  FrameCacheWriter cache;
+  QueuePolicy policy = QUEUE_BLOCK;
+  thread worker;
+
+  mutex lock;
+  condition_variable queued;
+  condition_variable freed;
+  vector<FrameSnapshot> pool;
+  vector<FrameSnapshot *> free_buffers;
+  deque<FrameSnapshot *> queue;
+  bool stopping = false;
+  bool failed = false;
+  FrameWriterStats counters;
+};
+
+#endif /* FRAME_WRITER_H */
@@ -0,0 +1,141 @@
+#include <algorithm>
+#include <math.h>
+
+#include "generator.h"
+#include "rng.h"
+
+using namespace std;
+
+void FluidGenerator::generate(vector<Particle> &particles, double rest_spacing) const {
+  if (type == GENERATOR_RANDOM) {
+    generate_random(particles);
+  } else {
+    generate_lattice(particles, rest_spacing);
+  }
+}
+
+int FluidGenerator::count(double rest_spacing) const {
+  if (type == GENERATOR_RANDOM) return num_particles;
+
+  int nx, ny, nz;
+  Vector3D d;
+  vector<int> row_start;
+  lattice_dimensions(rest_spacing, &nx, &ny, &nz, &d);
+  count_rows(nx, ny, nz, d, row_start);
+  return row_start.back();
+}
+
+FluidBox FluidGenerator::bounds() const {
+  FluidBox b(Vector3D(INF_D), Vector3D(-INF_D));
+  for (const FluidBox &box : boxes) {
+    b.min = Vector3D(min(b.min.x, box.min.x), min(b.min.y, box.min.y), min(b.min.z, box.min.z));
+    b.max = Vector3D(max(b.max.x, box.max.x), max(b.max.y, box.max.y), max(b.max.z, box.max.z));
+  }
+  for (const FluidSphere &s : spheres) {
+    b.min = Vector3D(min(b.min.x, s.origin.x - s.radius), min(b.min.y, s.origin.y - s.radius),
+                     min(b.min.z, s.origin.z - s.radius));
+    b.max = Vector3D(max(b.max.x, s.origin.x + s.radius), max(b.max.y, s.origin.y + s.radius),
+                     max(b.max.z, s.origin.z + s.radius));
+  }
+  return b;
+}
+
+bool FluidGenerator::inside(const Vector3D &x) const {
+  for (const FluidBox &box : boxes) {
+    if (box.contains(x)) return true;
+  }
+  for (const FluidSphere &s : spheres) {
+    if (s.contains(x)) return true;
+  }
+  return false;
+}
+
+// Particle i draws counters 3i, 3i + 1 and 3i + 2, independent of any other particle
+void FluidGenerator::generate_random(vector<Particle> &particles) const {
+  const FluidBox &box = boxes[0];
+  CounterRNG rng(seed);
+
+  particles.assign(num_particles, Particle(Vector3D(0)));
+
+  #pragma omp parallel for
+  for (int i = 0; i < num_particles; i++) {
+    Vector3D pos;
+    pos.x = rng.uniform(3 * (uint64_t)i, box.min.x, box.max.x);
+    pos.y = rng.uniform(3 * (uint64_t)i + 1, box.min.y, box.max.y);
+    pos.z = rng.uniform(3 * (uint64_t)i + 2, box.min.z, box.max.z);
+    particles[i] = Particle(pos);
+  }
+}
+
+void FluidGenerator::lattice_dimensions(double rest_spacing, int *nx, int *ny, int *nz,
+                                        Vector3D *d) const {
+  Vector3D extent = bounds().max - bounds().min;
+  if (num_x > 0 && num_y > 0 && num_z > 0) {
+    *nx = num_x;
+    *ny = num_y;
+    *nz = num_z;
+    *d = Vector3D(extent.x / num_x, extent.y / num_y, extent.z / num_z);
+  } else {
+    double s = spacing > 0 ? spacing : rest_spacing;
+    *nx = (int)floor(extent.x / s) + 1;
+    *ny = (int)floor(extent.y / s) + 1;
+    *nz = (int)floor(extent.z / s) + 1;
+    *d = Vector3D(s);
+  }
+}
+
+// row_start[r] is the index of the first particle in lattice row r (fixed j, k)
+void FluidGenerator::count_rows(int nx, int ny, int nz, const Vector3D &d,
+                                vector<int> &row_start) const {
+  Vector3D origin = bounds().min;
+  int num_rows = ny * nz;
+  row_start.assign(num_rows + 1, 0);
+
+  #pragma omp parallel for
+  for (int r = 0; r < num_rows; r++) {
+    int j = r % ny, k = r / ny;
+    int count = 0;
+    for (int i = 0; i < nx; i++) {
+      if (inside(origin + Vector3D(i * d.x, j * d.y, k * d.z))) count++;
+    }
+    row_start[r + 1] = count;
+  }
+  for (int r = 0; r < num_rows; r++) {
+    row_start[r + 1] += row_start[r];
+  }
+}
+
+// Two passes over the lattice rows: the first counts the sites inside the
+// shapes so every row knows where its particles start, the second writes them.
+void FluidGenerator::generate_lattice(vector<Particle> &particles, double rest_spacing) const {
+  FluidBox b = bounds();
+  int nx, ny, nz;
+  Vector3D d;
+  vector<int> row_start;
+  lattice_dimensions(rest_spacing, &nx, &ny, &nz, &d);
+  count_rows(nx, ny, nz, d, row_start);
+
+  int num_rows = ny * nz;
+  particles.assign(row_start[num_rows], Particle(Vector3D(0)));
+
+  CounterRNG rng(seed);
+  bool jittered = type == GENERATOR_JITTERED;
+
+  #pragma omp parallel for
+  for (int r = 0; r < num_rows; r++) {
+    int j = r % ny, k = r / ny;
+    int next = row_start[r];
+    for (int i = 0; i < nx; i++) {
+      Vector3D pos = b.min + Vector3D(i * d.x, j * d.y, k * d.z);
+      if (!inside(pos)) continue;
+
+      if (jittered) {
+        uint64_t site = (uint64_t)r * nx + i;
+        pos.x += (rng.uniform(3 * site) - 0.5) * jitter * d.x;
+        pos.y += (rng.uniform(3 * site + 1) - 0.5) * jitter * d.y;
+        pos.z += (rng.uniform(3 * site + 2) - 0.5) * jitter * d.z;
+      }
+      particles[next++] = Particle(pos);
+    }
+  }
+}
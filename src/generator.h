@@ -0,0 +1,84 @@
+#ifndef GENERATOR_H
+#define GENERATOR_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "CGL/CGL.h"
+#include "particle.h"
+
+using namespace CGL;
+using namespace std;
+
+enum GeneratorType {
+  GENERATOR_RANDOM,   // uniformly random points in the first box
+  GENERATOR_LATTICE,  // regular lattice filling the union of all shapes
+  GENERATOR_JITTERED  // lattice with every point randomly offset
+};
+
+struct FluidBox {
+  FluidBox() {}
+  FluidBox(const Vector3D &min, const Vector3D &max) : min(min), max(max) {}
+
+  bool contains(const Vector3D &x) const {
+    return x.x >= min.x && x.x <= max.x && x.y >= min.y && x.y <= max.y &&
+           x.z >= min.z && x.z <= max.z;
+  }
+
+  Vector3D min;
+  Vector3D max;
+};
+
+struct FluidSphere {
+  FluidSphere() {}
+  FluidSphere(const Vector3D &origin, double radius)
+      : origin(origin), radius(radius) {}
+
+  bool contains(const Vector3D &x) const {
+    return (x - origin).norm2() <= radius * radius;
+  }
+
+  Vector3D origin;
+  double radius;
+};
+
+// Describes the initial particle configuration. The lattice generators fill
+// the union of all boxes and spheres; the random generator scatters
+// num_particles points in the first box.
+//
+// Every generator sizes the particle array once and fills it in parallel. All
+// randomness comes from a CounterRNG keyed by particle (or lattice site)
+// index, so the result only depends on the parameters and the seed.
+struct FluidGenerator {
+  FluidGenerator() {}
+
+  void generate(vector<Particle> &particles, double rest_spacing) const;
+
+  // Number of particles generate() will produce, without producing them
+  int count(double rest_spacing) const;
+
+  // Bounding box of the union of all shapes
+  FluidBox bounds() const;
+
+  GeneratorType type = GENERATOR_RANDOM;
+  uint64_t seed = 0;
+
+  int num_particles = 0;   // random generator only
+  double spacing = 0;      // lattice spacing, 0 means rest spacing
+  double jitter = 0.25;    // jittered generator, offset as a fraction of spacing
+  int num_x = 0;           // if set, lattice point counts across the first box
+  int num_y = 0;           // instead of using the spacing
+  int num_z = 0;
+
+  vector<FluidBox> boxes;
+  vector<FluidSphere> spheres;
+
+private:
+  void generate_random(vector<Particle> &particles) const;
+  void generate_lattice(vector<Particle> &particles, double rest_spacing) const;
+  void lattice_dimensions(double rest_spacing, int *nx, int *ny, int *nz, Vector3D *d) const;
+  void count_rows(int nx, int ny, int nz, const Vector3D &d, vector<int> &row_start) const;
+  bool inside(const Vector3D &x) const;
+};
+
+#endif /* GENERATOR_H */
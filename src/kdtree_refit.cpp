@@ -0,0 +1,86 @@
+#include <algorithm>
+
+#include "kdtree_refit.h"
+
+using namespace std;
+
+typedef ParticleKDTree::Node KDNode;
+
+struct Box {
+  double lo[3], hi[3];
+};
+
+static bool is_leaf(const KDNode *node) {
+  return node->child1 == NULL && node->child2 == NULL;
+}
+
+// Refits the split bounds in the subtree of node and returns the bounds of
+// its points
+static Box refit(const ParticleKDTree &tree, KDNode *node) {
+  Box box;
+  if (is_leaf(node)) {
+    size_t first = node->node_type.lr.left, last = node->node_type.lr.right;
+    for (int k = 0; k < 3; k++) {
+      box.lo[k] = box.hi[k] = tree.dataset.kdtree_get_pt(tree.vind[first], k);
+    }
+    for (size_t i = first + 1; i < last; i++) {
+      for (int k = 0; k < 3; k++) {
+        double x = tree.dataset.kdtree_get_pt(tree.vind[i], k);
+        box.lo[k] = min(box.lo[k], x);
+        box.hi[k] = max(box.hi[k], x);
+      }
+    }
+    return box;
+  }
+
+  Box left = refit(tree, node->child1);
+  Box right = refit(tree, node->child2);
+  int axis = node->node_type.sub.divfeat;
+  node->node_type.sub.divlow = left.hi[axis];
+  node->node_type.sub.divhigh = right.lo[axis];
+  for (int k = 0; k < 3; k++) {
+    box.lo[k] = min(left.lo[k], right.lo[k]);
+    box.hi[k] = max(left.hi[k], right.hi[k]);
+  }
+  return box;
+}
+
+// Sums the point count of every leaf times the volume of the region where a
+// query reaches it: box, cut down by the split bounds on the way and grown by
+// radius at every cut
+static double cost(const KDNode *node, Box box, double radius) {
+  if (is_leaf(node)) {
+    double volume = 1;
+    for (int k = 0; k < 3; k++) {
+      volume *= max(0.0, box.hi[k] - box.lo[k]);
+    }
+    return (node->node_type.lr.right - node->node_type.lr.left) * volume;
+  }
+  int axis = node->node_type.sub.divfeat;
+  Box left = box, right = box;
+  left.hi[axis] = min(box.hi[axis], node->node_type.sub.divlow + radius);
+  right.lo[axis] = max(box.lo[axis], node->node_type.sub.divhigh - radius);
+  return cost(node->child1, left, radius) + cost(node->child2, right, radius);
+}
+
+double kdtree_query_cost(const ParticleKDTree &tree, double radius) {
+  if (tree.root_node == NULL) return 0;
+  Box root;
+  double volume = 1;
+  for (int k = 0; k < 3; k++) {
+    root.lo[k] = tree.root_bbox[k].low - radius;
+    root.hi[k] = tree.root_bbox[k].high + radius;
+    volume *= root.hi[k] - root.lo[k];
+  }
+  return cost(tree.root_node, root, radius) / volume;
+}
+
+double refit_kdtree(ParticleKDTree *tree, double radius) {
+  if (tree->root_node == NULL) return 0;
+  Box root = refit(*tree, tree->root_node);
+  for (int k = 0; k < 3; k++) {
+    tree->root_bbox[k].low = root.lo[k];
+    tree->root_bbox[k].high = root.hi[k];
+  }
+  return kdtree_query_cost(*tree, radius);
+}
@@ -0,0 +1,35 @@
+#ifndef KDTREE_REFIT_H
+#define KDTREE_REFIT_H
+
+#include "misc/nanoflann.hpp"
+#include "nanoflann_utils.h"
+
+using namespace nanoflann;
+
+// Refitting the particle kd-tree to moved points instead of rebuilding it.
+//
+// A refit keeps the tree's topology and point order. It recomputes each
+// node's split bounds bottom-up from the current positions: the largest
+// coordinate of the left child along the split axis and the smallest of the
+// right one. That is what buildIndex() stores for them. Once points cross a
+// split the children overlap, and the search in misc/nanoflann.hpp then
+// stops pruning by that cut. Queries stay exact but visit more of the tree.
+//
+// How much more is estimated from the split bounds. A radius query goes
+// into the left child of a node if it is within the radius of the left
+// child's largest coordinate, and likewise into the right child. So the
+// query reaches a leaf from the region left of or right of every split on
+// the way down, each widened by the radius. Summed over leaves, the point
+// count times that region's share of the root box is the expected number of
+// points a query at a random spot tests. Comparing it with the value right
+// after a build tells when a rebuild pays off.
+
+typedef KDTreeSingleIndexAdaptor<L2_Simple_Adaptor<double, PointCloud>, PointCloud, 3> ParticleKDTree;
+
+// Refits tree to the current points, returns kdtree_query_cost afterwards
+double refit_kdtree(ParticleKDTree *tree, double radius);
+
+// Expected number of points a query of radius tests, see above
+double kdtree_query_cost(const ParticleKDTree &tree, double radius);
+
+#endif /* KDTREE_REFIT_H */
@@ -10,31 +10,86 @@
 
 #include <CGL/vector3D.h>
 #include <nanogui/nanogui.h>
+#include <fstream>
 #include <iostream>
+#include <signal.h>
+#include <stdlib.h>
+#include <unordered_set>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifdef _WIN32
+#include "misc/getopt.h" // getopt for windows
+#else
+#include <getopt.h>
+#include <unistd.h>
+#endif
 
 #include "camera.h"
+#include "camera_matrices.h"
 #include "shader_s.h"
 #include "fluid.h"
+#include "generator.h"
+#include "state_cache.h"
+#include "checkpoint.h"
+#include "frame_cache.h"
+#include "frame_writer.h"
+#include "shm_ring.h"
+#include "frame_stream.h"
+#include "playback.h"
+#include "exporters.h"
+#include "surface.h"
+#include "volume.h"
+#include "splat_renderer.h"
+#include "frame_capture.h"
+#include "point_lod.h"
 #include "collision/plane.h"
+#include "json.hpp"
 
 using namespace nanogui;
+using json = nlohmann::json;
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods);
-Matrix4f getProjectionMatrix();
-Matrix4f getViewMatrix();
 
 // settings
 const unsigned int SCR_WIDTH = 800;
 const unsigned int SCR_HEIGHT = 600;
+const float POINT_SIZE = 10; // pixels at unit distance from the camera, at SCR_HEIGHT
 
 // simulation variables
 bool is_paused = true;
 int frames_per_sec = 15; // CHANGE LATER - JUST TEMP HERE TO SLOW DOWN THE ANIMATION
 int simulation_steps = 2;
+uint64_t frame = 0;
+volatile sig_atomic_t stop_requested = 0;
+
+// frames for external processes, see shm_ring.h and frame_stream.h
+ShmRingWriter frame_ring;
+FrameStreamServer frame_stream;
+FrameSnapshot stream_snapshot;
+
+// playback of a frame cache, see playback.h
+FramePlayer player;
+size_t playhead = 0;
+bool loop_playback = true;
+
+// software previews of headless runs, see splat_renderer.h
+SplatRenderer renderer;
+vector<float> render_positions;
+
+// only draw and export the particles on the fluid surface
+bool shell_only = false;
+vector<Particle> shell_particles;
 
 #define NUM_PARTICLES 1000
 
+const string FLUID = "fluid";
+const string PLANES = "planes";
+const unordered_set<string> VALID_KEYS = {FLUID, PLANES};
+
 // scene variables
 CGL::Camera camera;
 Fluid fluid;
@@ -42,8 +97,823 @@ FluidParameters fp;
 vector<Plane*> objects;
 vector<Vector3D> external_accelerations;
 
-int main()
+void usage(const char *binaryName) {
+    printf("Usage: %s [options]\n", binaryName);
+    printf("Program options:\n");
+    printf("  -f     <STRING>    Filename of scene\n");
+    printf("  -c     <STRING>    Initialize from a pre-settled state cache\n");
+    printf("  -S     <STRING>    Settle the scene, write its state cache and exit\n");
+    printf("  -n     <INT>       Number of simulation steps used to settle (default 500)\n");
+    printf("  -H     <INT>       Run headless until this frame, 0 runs until interrupted\n");
+    printf("  -k     <STRING>    Checkpoint file written during headless runs\n");
+    printf("  -K     <INT>       Frames between checkpoints (default 100)\n");
+    printf("  -r     <STRING>    Resume from a checkpoint\n");
+    printf("  -o     <STRING>    Frame cache written during headless runs\n");
+    printf("  -C     <STRING>    Channels stored in the frame cache: any of p(osition), v(elocity), d(ensity) (default p)\n");
+    printf("  -Q     <INT>       Compress frame cache positions, quantized to this many bits per axis\n");
+    printf("  -L                 Compress frame cache positions losslessly\n");
+    printf("  -q     <INT>       Frames queued for the frame cache writer thread (default 4)\n");
+    printf("  -B     <STRING>    When the frame queue is full: block, drop or coalesce (default block)\n");
+    printf("  -x     <STRING>    Export particles during headless runs to <prefix>_<frame>.<format>\n");
+    printf("  -X     <STRING>    Export format: ply, vtk, vtu or csv (default ply)\n");
+    printf("  -N     <INT>       Write every export every Nth frame (default 1)\n");
+    printf("  -u     <STRING>    Write surface meshes during headless runs to <prefix>_<frame>.<format>\n");
+    printf("  -U     <STRING>    Surface mesh format: obj or ply (default obj)\n");
+    printf("  -g     <STRING>    Write sparse density/velocity grids during headless runs to <prefix>_<frame>.vol\n");
+    printf("  -E                 Also write the grids as OpenEXR slices, <prefix>_<frame>_z<layer>.exr\n");
+    printf("  -R     <STRING>    Render preview images during headless runs to <prefix>_<frame>.png\n");
+    printf("  -w     <STRING>    Preview image size as <width>x<height> (default 1920x1080)\n");
+    printf("  -m     <STRING>    Publish every frame to this shared memory ring, e.g. /pbf_frames\n");
+    printf("  -M     <INT>       Number of frames kept in the shared memory ring (default 8)\n");
+    printf("  -l     <STRING>    Stream frames to viewers on unix:<path> or [host]:<port>\n");
+    printf("  -D     <INT>       Only stream every Nth particle (default 1)\n");
+    printf("  -V     <STRING>    Run as a viewer of the simulation streamed on unix:<path> or host:port\n");
+    printf("  -P     <STRING>    Play back a frame cache instead of simulating\n");
+    printf("  -a     <STRING>    Capture every new frame the viewer shows to <prefix>_<frame>.<format>\n");
+    printf("  -A     <STRING>    Capture format: png or exr (default png)\n");
+    printf("  -b                 Only draw and export the particles on the fluid surface\n");
+    printf("  -i     <INT>       Solver iterations per simulation step (default 1)\n");
+    printf("  -O     <FLOAT>     Solver LOD: fewer iterations for particles farther than this from the camera\n");
+    printf("  -z     <FLOAT>     Put particles slower than this to sleep once their neighborhood has settled\n");
+    printf("  -G     <STRING>    Neighbor search: lists (kd-tree), refit (lists, refitting the kd-tree between builds), grid (uniform grid), hash (hashed grid, for open domains) or auto (timed every 200 steps) (default lists)\n");
+    printf("  -T     <INT>       Points per kd-tree leaf, at most (default 16)\n");
+    printf("  -d                 Deterministic mode: bitwise identical results across runs and thread counts\n");
+    printf("  -s     <INT>       Seed for particle initialization\n");
+    printf("  -t     <INT>       Number of solver threads\n");
+    printf("  -h                 Print this help message\n");
+    printf("\n");
+}
+
+void incompleteObjectError(const char *object, const char *attribute) {
+    cout << "Incomplete " << object << " definition, missing " << attribute << endl;
+    exit(-1);
+}
+
+Vector3D readVector(const json &object, const char *name, const char *attribute) {
+    auto it = object.find(attribute);
+    if (it == object.end()) {
+        incompleteObjectError(name, attribute);
+    }
+    vector<double> vec = *it;
+    return Vector3D(vec[0], vec[1], vec[2]);
+}
+
+bool loadObjectsFromFile(string filename, FluidGenerator *generator, vector<Plane *> *objects) {
+    // Read JSON from file
+    ifstream i(filename);
+    if (!i.good()) {
+        return false;
+    }
+    json j;
+    i >> j;
+
+    // Loop over objects in scene
+    for (json::iterator it = j.begin(); it != j.end(); ++it) {
+        string key = it.key();
+
+        // Check that object is valid
+        unordered_set<string>::const_iterator query = VALID_KEYS.find(key);
+        if (query == VALID_KEYS.end()) {
+            cout << "Invalid scene object found: " << key << endl;
+            exit(-1);
+        }
+
+        json object = it.value();
+
+        if (key == FLUID) {
+            string type = object.value("generator", string("random"));
+            if (type == "random") {
+                generator->type = GENERATOR_RANDOM;
+            } else if (type == "lattice") {
+                generator->type = GENERATOR_LATTICE;
+            } else if (type == "jittered") {
+                generator->type = GENERATOR_JITTERED;
+            } else {
+                cout << "Invalid fluid generator: " << type << endl;
+                exit(-1);
+            }
+
+            generator->seed = object.value("seed", (uint64_t)0);
+            generator->spacing = object.value("spacing", 0.0);
+            generator->jitter = object.value("jitter", generator->jitter);
+            generator->num_particles = object.value("num_particles", 0);
+
+            auto it_boxes = object.find("boxes");
+            if (it_boxes != object.end()) {
+                for (const json &box : *it_boxes) {
+                    generator->boxes.push_back(FluidBox(readVector(box, "box", "min"),
+                                                        readVector(box, "box", "max")));
+                }
+            }
+            auto it_spheres = object.find("spheres");
+            if (it_spheres != object.end()) {
+                for (const json &sphere : *it_spheres) {
+                    auto it_radius = sphere.find("radius");
+                    if (it_radius == sphere.end()) {
+                        incompleteObjectError("sphere", "radius");
+                    }
+                    generator->spheres.push_back(FluidSphere(readVector(sphere, "sphere", "origin"),
+                                                             *it_radius));
+                }
+            }
+
+            if (generator->type == GENERATOR_RANDOM) {
+                if (generator->boxes.empty()) incompleteObjectError("fluid", "boxes");
+                if (generator->num_particles <= 0) incompleteObjectError("fluid", "num_particles");
+            } else if (generator->boxes.empty() && generator->spheres.empty()) {
+                incompleteObjectError("fluid", "boxes or spheres");
+            }
+        } else { // PLANES
+            for (const json &plane : object) {
+                Vector3D point = readVector(plane, "plane", "point");
+                Vector3D normal = readVector(plane, "plane", "normal");
+                auto it_friction = plane.find("friction");
+                if (it_friction == plane.end()) {
+                    incompleteObjectError("plane", "friction");
+                }
+                objects->push_back(new Plane(point, normal, *it_friction));
+            }
+        }
+    }
+
+    i.close();
+    return true;
+}
+
+bool settleScene(const string &filename, int steps) {
+    cout << "Settling " << fluid.particles.size() << " particles for " << steps << " steps" << endl;
+    for (int i = 0; i < steps; i++) {
+        fluid.simulate(frames_per_sec, simulation_steps, &fp, external_accelerations, &objects);
+        if ((i + 1) % 100 == 0) {
+            cout << "  step " << i + 1 << "/" << steps << endl;
+        }
+    }
+    if (!write_state_cache(filename, fluid, objects)) {
+        return false;
+    }
+    cout << "Wrote state cache " << filename << endl;
+    return true;
+}
+
+void requestStop(int signal) {
+    stop_requested = 1;
+}
+
+RunState currentRunState() {
+    RunState run;
+    run.frame = frame;
+    run.frames_per_sec = frames_per_sec;
+    run.simulation_steps = simulation_steps;
+    run.external_accelerations = external_accelerations;
+    for (Plane *p : objects) {
+        run.collision_objects.push_back(*p);
+    }
+    return run;
+}
+
+bool resumeFromCheckpoint(const string &filename) {
+    RunState run;
+    if (!load_checkpoint(filename, &fluid, &run)) {
+        return false;
+    }
+    frame = run.frame;
+    frames_per_sec = run.frames_per_sec;
+    simulation_steps = run.simulation_steps;
+    external_accelerations = run.external_accelerations;
+    for (Plane *p : objects) {
+        delete p;
+    }
+    objects.clear();
+    for (const Plane &p : run.collision_objects) {
+        objects.push_back(new Plane(p));
+    }
+    cout << "Resumed " << filename << " at frame " << frame << endl;
+    return true;
+}
+
+uint32_t parseChannels(const string &channels) {
+    uint32_t mask = 0;
+    for (char c : channels) {
+        if (c == 'p') mask |= CHANNEL_POSITION;
+        else if (c == 'v') mask |= CHANNEL_VELOCITY;
+        else if (c == 'd') mask |= CHANNEL_DENSITY;
+    }
+    return mask;
+}
+
+bool parseQueuePolicy(const string &name, QueuePolicy *policy) {
+    if (name == "block") *policy = QUEUE_BLOCK;
+    else if (name == "drop") *policy = QUEUE_DROP;
+    else if (name == "coalesce") *policy = QUEUE_COALESCE;
+    else return false;
+    return true;
+}
+
+// Copies the current particle positions into the next slot of the ring
+void publishFrame(ShmRingWriter *ring) {
+    if (!ring->is_open()) {
+        return;
+    }
+    float *positions = ring->begin_frame(frame, fluid.particles.size());
+    if (positions == NULL) {
+        return;
+    }
+    #pragma omp parallel for
+    for (int i = 0; i < (int)fluid.particles.size(); i++) {
+        positions[i * 3] = fluid.particles[i].position.x;
+        positions[i * 3 + 1] = fluid.particles[i].position.y;
+        positions[i * 3 + 2] = fluid.particles[i].position.z;
+    }
+    ring->publish();
+}
+
+// Hands the current particle positions to the stream's sender thread
+void streamFrame(FrameStreamServer *server) {
+    if (!server->is_open()) {
+        return;
+    }
+    stream_snapshot.capture(fluid, frame, CHANNEL_POSITION);
+    server->offer(stream_snapshot.positions, frame);
+}
+
+// Points the camera at the origin from above and in front, the view the
+// viewer starts with
+void placeCamera(size_t width, size_t height) {
+    CGL::Collada::CameraInfo camera_info;
+    camera_info.hFov = 80;
+    camera_info.vFov = 80;
+    camera_info.nClip = 0.01;
+    camera_info.fClip = 10000;
+    CGL::Vector3D target(0., 0., 0.);
+    
+    // direction of camera from target (i.e. target -> camera direction)
+    CGL::Vector3D c_dir(0, 1, 3);
+    c_dir = c_dir.unit();
+
+    camera.place(target, acos(c_dir.y), atan2(c_dir.x, c_dir.z), 1.0, 0.2, 20.);
+    camera.configure(camera_info, width, height);
+
+    // the solver LOD measures distances from the same eye
+    fluid.lod_eye = camera.position();
+}
+
+// Box the axis-aligned planes enclose, the domain of the scene. Empty if a
+// side is open, in which case the codec takes its bounds from the frames.
+FluidBox planeBounds(const vector<Plane *> &planes) {
+    double lo[3] = {-INF_D, -INF_D, -INF_D};
+    double hi[3] = {INF_D, INF_D, INF_D};
+    for (const Plane *plane : planes) {
+        for (int k = 0; k < 3; k++) {
+            if (plane->normal[k] > 1 - 1e-9) lo[k] = max(lo[k], plane->point[k]);
+            if (plane->normal[k] < -1 + 1e-9) hi[k] = min(hi[k], plane->point[k]);
+        }
+    }
+    for (int k = 0; k < 3; k++) {
+        if (isinf(lo[k]) || isinf(hi[k]) || lo[k] >= hi[k]) {
+            return FluidBox(Vector3D(INF_D), Vector3D(-INF_D));
+        }
+    }
+    // collisions can leave particles just past a plane
+    Vector3D lower(lo[0], lo[1], lo[2]), upper(hi[0], hi[1], hi[2]);
+    Vector3D margin = (upper - lower) * 0.01;
+    return FluidBox(lower - margin, upper + margin);
+}
+
+// Whether particle i is drawn and exported
+bool isShown(size_t i) {
+    return !shell_only || (i < fluid.on_surface.size() && fluid.on_surface[i]);
+}
+
+// Copies the positions of the shown particles, 3 floats each, and their
+// indices into ids if it is not NULL
+void gatherPositions(vector<float> *positions, vector<uint32_t> *ids = NULL) {
+    positions->clear();
+    if (ids != NULL) {
+        ids->clear();
+    }
+    for (size_t i = 0; i < fluid.particles.size(); i++) {
+        if (isShown(i)) {
+            const Vector3D &p = fluid.particles[i].position;
+            positions->push_back(p.x);
+            positions->push_back(p.y);
+            positions->push_back(p.z);
+            if (ids != NULL) {
+                ids->push_back(i);
+            }
+        }
+    }
+}
+
+// The particles exporters write
+const vector<Particle> &shownParticles() {
+    if (!shell_only) {
+        return fluid.particles;
+    }
+    shell_particles.clear();
+    for (size_t i = 0; i < fluid.particles.size(); i++) {
+        if (isShown(i)) {
+            shell_particles.push_back(fluid.particles[i]);
+        }
+    }
+    return shell_particles;
+}
+
+// Per-frame files written by headless runs
+struct FrameExports {
+    string particle_prefix;
+    ExportFormat particle_format = EXPORT_PLY;
+    string surface_prefix;
+    bool surface_ply = false;
+    string volume_prefix;
+    bool volume_exr = false;
+    string render_prefix;
+    SplatParams render;
+    int every = 1;
+};
+
+// Writes the exports due at the current frame
+bool exportFrame(const FrameExports &exports) {
+    if (exports.every <= 0 || frame % exports.every != 0) {
+        return true;
+    }
+    if (!exports.particle_prefix.empty() &&
+        !export_particles(export_filename(exports.particle_prefix, frame, exports.particle_format),
+                          shownParticles(), frame, exports.particle_format)) {
+        return false;
+    }
+    if (!exports.surface_prefix.empty()) {
+        SurfaceMesh mesh;
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), "_%06llu.%s", (unsigned long long)frame, exports.surface_ply ? "ply" : "obj");
+        string filename = exports.surface_prefix + suffix;
+        if (!extract_surface(fluid, SurfaceParams(), &mesh) ||
+            !(exports.surface_ply ? write_ply(filename, mesh) : write_obj(filename, mesh))) {
+            return false;
+        }
+    }
+    if (!exports.volume_prefix.empty()) {
+        DensityVolume volume;
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), "_%06llu", (unsigned long long)frame);
+        string base = exports.volume_prefix + suffix;
+        if (!rasterize_volume(fluid, VolumeParams(), &volume) ||
+            !write_volume(base + ".vol", volume, frame) ||
+            (exports.volume_exr && !write_exr_slices(base, volume))) {
+            return false;
+        }
+    }
+    if (!exports.render_prefix.empty()) {
+        gatherPositions(&render_positions);
+        renderer.render(render_positions.data(), render_positions.size() / 3,
+                        getProjectionMatrix(camera) * getViewMatrix(camera), exports.render);
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), "_%06llu.png", (unsigned long long)frame);
+        if (!renderer.write_png(exports.render_prefix + suffix)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Simulates without a window until end_frame (or forever if it is 0), writing
+// a checkpoint every checkpoint_interval frames and when interrupted. Every
+// frame is written to the frame cache, if there is one, compressing positions
+// if codec is set. Frames are written on a background thread; policy decides
+// what happens when queue_capacity frames are already waiting. A resumed run
+// appends to the cache, replacing the frames it is about to redo. Particles,
+// surfaces, volumes and previews are exported as set up in exports.
+int runHeadless(uint64_t end_frame, const string &checkpoint_file, int checkpoint_interval,
+                const string &cache_file, uint32_t channels, const FrameCodecParams *codec,
+                size_t queue_capacity, QueuePolicy policy, const FrameExports &exports,
+                bool resumed) {
+    CheckpointWriter checkpoints;
+    AsyncFrameWriter frames;
+    signal(SIGINT, requestStop);
+    signal(SIGTERM, requestStop);
+
+    if (!cache_file.empty()) {
+        if (!frames.open(cache_file, resumed, frame + 1, queue_capacity, policy, codec)) {
+            return 1;
+        }
+        if (!resumed) {
+            FrameSnapshot *snapshot = frames.acquire();
+            if (snapshot) {
+                snapshot->capture(fluid, frame, channels);
+                frames.submit(snapshot);
+            }
+        }
+    }
+
+    if (!resumed && !exportFrame(exports)) {
+        return 1;
+    }
+
+    while ((end_frame == 0 || frame < end_frame) && !stop_requested) {
+        for (int i = 0; i < simulation_steps; i++) {
+            fluid.simulate(frames_per_sec, simulation_steps, &fp, external_accelerations, &objects);
+        }
+        frame++;
+        publishFrame(&frame_ring);
+        streamFrame(&frame_stream);
+
+        if (frames.is_open()) {
+            if (!frames.good()) {
+                return 1;
+            }
+            FrameSnapshot *snapshot = frames.acquire();
+            if (snapshot) {
+                snapshot->capture(fluid, frame, channels);
+                frames.submit(snapshot);
+            }
+        }
+
+        if (!exportFrame(exports)) {
+            return 1;
+        }
+
+        if (!checkpoint_file.empty() && checkpoint_interval > 0 && frame % checkpoint_interval == 0) {
+            checkpoints.save(checkpoint_file, fluid, currentRunState());
+        }
+    }
+
+    if (frames.is_open()) {
+        if (!frames.close()) {
+            cout << "Failed closing frame cache " << cache_file << endl;
+            return 1;
+        }
+        FrameWriterStats stats = frames.stats();
+        printf("Wrote %llu frames, %.1f MB at %.1f MB/s; dropped %llu, coalesced %llu; "
+               "max queue depth %zu, solver blocked %.2f s\n",
+               (unsigned long long)stats.frames_written, stats.bytes_written / 1e6,
+               stats.bandwidth() / 1e6, (unsigned long long)stats.frames_dropped,
+               (unsigned long long)stats.frames_coalesced, stats.max_queue_depth,
+               stats.blocked_seconds);
+    }
+
+    if (frame_stream.is_open()) {
+        StreamStats stats = frame_stream.stats();
+        frame_stream.close();
+        printf("Streamed %llu frames, %.1f MB; dropped %llu for slow viewers\n",
+               (unsigned long long)stats.frames_sent, stats.bytes_sent / 1e6,
+               (unsigned long long)stats.frames_dropped);
+    }
+
+    if (!checkpoint_file.empty()) {
+        checkpoints.save(checkpoint_file, fluid, currentRunState());
+        if (!checkpoints.wait()) {
+            return 1;
+        }
+        cout << "Wrote checkpoint " << checkpoint_file << " at frame " << frame << endl;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
 {
+    // parse command line options
+    // --------------------------
+    string scene_file;
+    string cache_file;
+    string settle_file;
+    int settle_steps = 500;
+    bool headless = false;
+    uint64_t end_frame = 0;
+    string checkpoint_file;
+    int checkpoint_interval = 100;
+    string resume_file;
+    string frame_cache_file;
+    uint32_t channels = CHANNEL_POSITION;
+    bool compress = false;
+    FrameCodecParams codec;
+    int queue_capacity = 4;
+    FrameExports exports;
+    exports.render.point_size = POINT_SIZE;
+    exports.render.reference_height = SCR_HEIGHT;
+    string ring_name;
+    int ring_slots = 8;
+    string stream_endpoint;
+    int stream_decimation = 1;
+    string view_endpoint;
+    string playback_file;
+    string capture_prefix;
+    CaptureFormat capture_format = CAPTURE_PNG;
+    QueuePolicy policy = QUEUE_BLOCK;
+    bool deterministic = false;
+    bool seed_set = false;
+    uint64_t seed = 0;
+    int num_threads = 0;
+    int solver_iterations = 0;
+    double lod_distance = 0;
+    double sleep_velocity = 0;
+    NeighborMode neighbor_mode = NEIGHBORS_LISTS;
+    bool kdtree_refit = false;
+    bool auto_neighbor_mode = false;
+    int kdtree_leaf_size = 0;
+
+    int c;
+    while ((c = getopt(argc, argv, "f:c:S:n:H:k:K:r:o:C:Q:Lq:B:x:X:N:u:U:g:ER:w:m:M:l:D:V:P:a:A:bi:O:z:G:T:ds:t:h")) != -1) {
+        switch (c) {
+        case 'f':
+            scene_file = optarg;
+            break;
+        case 'c':
+            cache_file = optarg;
+            break;
+        case 'S':
+            settle_file = optarg;
+            break;
+        case 'n':
+            settle_steps = atoi(optarg);
+            break;
+        case 'H':
+            headless = true;
+            end_frame = strtoull(optarg, NULL, 10);
+            break;
+        case 'k':
+            checkpoint_file = optarg;
+            break;
+        case 'K':
+            checkpoint_interval = atoi(optarg);
+            break;
+        case 'r':
+            resume_file = optarg;
+            break;
+        case 'o':
+            frame_cache_file = optarg;
+            break;
+        case 'C':
+            channels = parseChannels(optarg);
+            break;
+        case 'Q':
+            compress = true;
+            codec.bits = atoi(optarg);
+            if (codec.bits < 1 || codec.bits > 32) {
+                cout << "Quantization bits must be between 1 and 32" << endl;
+                return 1;
+            }
+            break;
+        case 'L':
+            compress = true;
+            codec.lossless = true;
+            break;
+        case 'q':
+            queue_capacity = atoi(optarg);
+            if (queue_capacity < 1) {
+                cout << "Invalid queue capacity " << optarg << endl;
+                return 1;
+            }
+            break;
+        case 'B':
+            if (!parseQueuePolicy(optarg, &policy)) {
+                cout << "Unknown queue policy " << optarg << endl;
+                return 1;
+            }
+            break;
+        case 'x':
+            exports.particle_prefix = optarg;
+            break;
+        case 'X':
+            if (!parse_export_format(optarg, &exports.particle_format)) {
+                cout << "Unknown export format " << optarg << endl;
+                return 1;
+            }
+            break;
+        case 'N':
+            exports.every = atoi(optarg);
+            break;
+        case 'u':
+            exports.surface_prefix = optarg;
+            break;
+        case 'U':
+            if (string(optarg) != "obj" && string(optarg) != "ply") {
+                cout << "Unknown surface mesh format " << optarg << endl;
+                return 1;
+            }
+            exports.surface_ply = string(optarg) == "ply";
+            break;
+        case 'g':
+            exports.volume_prefix = optarg;
+            break;
+        case 'E':
+            exports.volume_exr = true;
+            break;
+        case 'R':
+            exports.render_prefix = optarg;
+            break;
+        case 'w':
+            if (sscanf(optarg, "%dx%d", &exports.render.width, &exports.render.height) != 2 ||
+                exports.render.width <= 0 || exports.render.height <= 0) {
+                cout << "Invalid preview image size " << optarg << endl;
+                return 1;
+            }
+            break;
+        case 'm':
+            ring_name = optarg;
+            break;
+        case 'M':
+            ring_slots = atoi(optarg);
+            break;
+        case 'l':
+            stream_endpoint = optarg;
+            break;
+        case 'D':
+            stream_decimation = atoi(optarg);
+            break;
+        case 'V':
+            view_endpoint = optarg;
+            break;
+        case 'P':
+            playback_file = optarg;
+            break;
+        case 'a':
+            capture_prefix = optarg;
+            break;
+        case 'A':
+            if (string(optarg) != "png" && string(optarg) != "exr") {
+                cout << "Unknown capture format " << optarg << endl;
+                return 1;
+            }
+            capture_format = string(optarg) == "png" ? CAPTURE_PNG : CAPTURE_EXR;
+            break;
+        case 'b':
+            shell_only = true;
+            break;
+        case 'i':
+            solver_iterations = atoi(optarg);
+            break;
+        case 'O':
+            lod_distance = atof(optarg);
+            if (lod_distance <= 0) {
+                cout << "Invalid LOD distance " << optarg << endl;
+                return 1;
+            }
+            break;
+        case 'z':
+            sleep_velocity = atof(optarg);
+            if (sleep_velocity <= 0) {
+                cout << "Invalid sleep velocity " << optarg << endl;
+                return 1;
+            }
+            break;
+        case 'G':
+            if (string(optarg) == "lists") {
+                neighbor_mode = NEIGHBORS_LISTS;
+            } else if (string(optarg) == "refit") {
+                neighbor_mode = NEIGHBORS_LISTS;
+                kdtree_refit = true;
+            } else if (string(optarg) == "grid") {
+                neighbor_mode = NEIGHBORS_GRID;
+            } else if (string(optarg) == "hash") {
+                neighbor_mode = NEIGHBORS_HASH;
+            } else if (string(optarg) == "auto") {
+                auto_neighbor_mode = true;
+            } else {
+                cout << "Unknown neighbor search " << optarg << endl;
+                return 1;
+            }
+            break;
+        case 'T':
+            kdtree_leaf_size = atoi(optarg);
+            if (kdtree_leaf_size <= 0) {
+                cout << "Invalid kd-tree leaf size " << optarg << endl;
+                return 1;
+            }
+            break;
+        case 'd':
+            deterministic = true;
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            seed_set = true;
+            break;
+        case 't':
+            num_threads = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+#ifdef _OPENMP
+    if (num_threads > 0) {
+        omp_set_num_threads(num_threads);
+    }
+#endif
+
+    // initalize fluid and simulation variables
+    // ----------------------------------------
+    FluidGenerator generator;
+    if (!scene_file.empty()) {
+        if (!loadObjectsFromFile(scene_file, &generator, &objects)) {
+            cout << "Failed to load scene " << scene_file << endl;
+            return 1;
+        }
+    } else {
+        // NUM_PARTICLES random particles, see Fluid(int num) for the cube starting point
+        generator.num_particles = NUM_PARTICLES;
+        generator.boxes.push_back(FluidBox(Vector3D(-0.4, 0, -0.09), Vector3D(0.4, 0.5, 0.09)));
+    }
+    if (seed_set) {
+        generator.seed = seed;
+    }
+
+    fluid.generator = generator;
+    fluid.deterministic = deterministic;
+    fluid.neighbor_mode = neighbor_mode;
+    fluid.kdtree_refit = kdtree_refit;
+    fluid.auto_neighbor_mode = auto_neighbor_mode;
+    if (kdtree_leaf_size > 0) {
+        fluid.kdtree_leaf_size = kdtree_leaf_size;
+    }
+
+    // set up some collision objects, unless the scene provides its own.
+    // A state cache is only valid for the planes it settled against.
+    if (objects.empty()) {
+        objects.push_back(new Plane(Vector3D(0, -0.2, 0), Vector3D(0, 1, 0), 0.3)); // bottom
+        objects.push_back(new Plane(Vector3D(0, 0, -0.1), Vector3D(0, 0, 1), 0.3)); // back
+        objects.push_back(new Plane(Vector3D(0.5, 0, 0), Vector3D(-1, 0, 0), 0.3)); // right
+        objects.push_back(new Plane(Vector3D(-0.5, 0, 0), Vector3D(1, 0, 0), 0.3)); // left
+        objects.push_back(new Plane(Vector3D(0, 0, 0.1), Vector3D(0, 0, -1), 0.3)); // front
+
+        // set a cover for testing
+        objects.push_back(new Plane(Vector3D(0, 0.55, 0), Vector3D(0, -1, 0), 0.5));
+    }
+
+    bool viewing = !view_endpoint.empty();
+    if (viewing) {
+        // the particles come from the stream
+    } else if (!playback_file.empty()) {
+        // the particles come from the frame cache
+    } else if (!resume_file.empty()) {
+        // the particles come from the checkpoint
+    } else if (cache_file.empty() || !load_state_cache(cache_file, &fluid, objects)) {
+        fluid.buildFluid();
+    }
+
+    fp = FluidParameters(1);
+    external_accelerations.emplace_back(0, -9.8, 0);
+
+    if (!resume_file.empty() && !resumeFromCheckpoint(resume_file)) {
+        return 1;
+    }
+
+    if (solver_iterations > 0) {
+        fluid.solver_iterations = solver_iterations;
+    }
+    if (sleep_velocity > 0) {
+        fluid.use_sleeping = true;
+        fluid.sleep_velocity = sleep_velocity;
+    }
+
+    if (!settle_file.empty()) {
+        return settleScene(settle_file, settle_steps) ? 0 : 1;
+    }
+
+    if (!ring_name.empty()) {
+        if (!frame_ring.create(ring_name, ring_slots, fluid.particles.size())) {
+            return 1;
+        }
+        publishFrame(&frame_ring);
+    }
+
+    // quantize to the scene's domain, the codec grows it if the fluid escapes
+    codec.bounds = planeBounds(objects);
+    FrameCodecParams stream_codec;
+    stream_codec.bounds = codec.bounds;
+    if (!stream_endpoint.empty() && !frame_stream.listen(stream_endpoint, stream_decimation, stream_codec)) {
+        return 1;
+    }
+
+    FrameStreamClient stream_client;
+    bool stream_lost = false;
+    if (viewing && !stream_client.connect(view_endpoint)) {
+        return 1;
+    }
+
+    if (!playback_file.empty() && !player.open(playback_file)) {
+        return 1;
+    }
+
+    if (lod_distance > 0) {
+        fluid.use_lod = true;
+        fluid.lod_distance = lod_distance;
+    }
+
+    // classify the initial state, later steps keep it up to date
+    fluid.track_surface = shell_only;
+    if (shell_only && !fluid.particles.empty()) {
+        fluid.compute_neighbors();
+        fluid.classify_surface();
+    }
+
+    if (headless) {
+        placeCamera(exports.render.width, exports.render.height);
+        return runHeadless(end_frame, checkpoint_file, checkpoint_interval,
+                           frame_cache_file, channels, compress ? &codec : NULL,
+                           queue_capacity, policy, exports, !resume_file.empty());
+    }
+
     // glfw: initialize and configure
     // ------------------------------
     glfwInit();
@@ -84,36 +954,17 @@ int main()
     // ------------------------------------
     Shader ourShader("../../../shaders/particle.vert", "../../../shaders/particle.frag"); 
 
-    // initalize fluid and simulation variables
-    // later we can support reading in parameters from json files
-    // ----------------------------------------------------------
-    fluid = Fluid(NUM_PARTICLES);
-    // fluid = Fluid(10, 10, 10); USE THIS with NUM_PARTICLE = 1000 IF WANT A CUBE STARTING POINT
-    float vertices[NUM_PARTICLES * 3];
-    for (int i = 0; i < NUM_PARTICLES; i++) {
-        vertices[i * 3] = fluid.particles[i].position.x;
-        vertices[i * 3 + 1] = fluid.particles[i].position.y;
-        vertices[i * 3 + 2] = fluid.particles[i].position.z;
-    }
+    // upload the initial particle positions
+    // --------------------------------------
+    vector<float> vertices;
+    vector<uint32_t> vertex_ids;
+    gatherPositions(&vertices, &vertex_ids);
 
-    fp = FluidParameters(1);
-    external_accelerations.emplace_back(0, -9.8, 0);
-
-    // set up some collision objects
-    Plane bottom = Plane(Vector3D(0, -0.2, 0), Vector3D(0, 1, 0), 0.3);
-    objects.push_back(&bottom);
-    Plane back = Plane(Vector3D(0, 0, -0.1), Vector3D(0, 0, 1), 0.3);
-    objects.push_back(&back);
-    Plane right = Plane(Vector3D(0.5, 0, 0), Vector3D(-1, 0, 0), 0.3);
-    objects.push_back(&right);
-    Plane left = Plane(Vector3D(-0.5, 0, 0), Vector3D(1, 0, 0), 0.3);
-    objects.push_back(&left);
-    Plane front = Plane(Vector3D(0, 0, 0.1), Vector3D(0, 0, -1), 0.3);
-    objects.push_back(&front);
-
-    // set a cover for testing
-    Plane top = Plane(Vector3D(0, 0.55, 0), Vector3D(0, -1, 0), 0.5);
-    objects.push_back(&top);
+    // points are culled and decimated per block, see point_lod.h
+    PointLOD lod;
+    lod.build(vertices.data(), vertex_ids.data(), vertices.size() / 3);
+    PointLODBuilder lod_builder;
+    lod_builder.start();
 
     // set up OpenGL and configure OpenGL buffer objects with data
     // ------------------------------------------------------------
@@ -127,13 +978,12 @@ int main()
 
     // bind, setup vertex buffer, and fill with data
     glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_DYNAMIC_DRAW);
+    glBufferData(GL_ARRAY_BUFFER, lod.vertices.size() * sizeof(float), lod.vertices.data(), GL_DYNAMIC_DRAW);
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
     glEnableVertexAttribArray(0);
 
-    // enable drawing points
+    // enable drawing points, sized by the vertex shader
     glEnable(GL_PROGRAM_POINT_SIZE);
-    glPointSize(10);
 
     // enable depth, Z-buffer
     glEnable(GL_DEPTH_TEST);
@@ -149,53 +999,100 @@ int main()
 
     // set up camera and perspective
     // -----------------------------
-    CGL::Collada::CameraInfo camera_info;
-    camera_info.hFov = 80;
-    camera_info.vFov = 80;
-    camera_info.nClip = 0.01;
-    camera_info.fClip = 10000;
-    CGL::Vector3D target(0., 0., 0.);
-    
-    // direction of camera from target (i.e. target -> camera direction)
-    CGL::Vector3D c_dir(0, 1, 3);
-    c_dir = c_dir.unit();
-
-    camera.place(target, acos(c_dir.y), atan2(c_dir.x, c_dir.z), 1.0, 0.2, 20.);
-    camera.configure(camera_info, SCR_WIDTH, SCR_HEIGHT);
+    placeCamera(SCR_WIDTH, SCR_HEIGHT);
 
     // calculate and input the perspective transformations into the shader
-    Matrix4f view = getViewMatrix();
-    Matrix4f projection = getProjectionMatrix();
+    Matrix4f view = getViewMatrix(camera);
+    Matrix4f projection = getProjectionMatrix(camera);
     Matrix4f viewProjection = projection * view;
     ourShader.setMat4("u_view_projection", viewProjection);
 
+    // read frames back asynchronously, if capturing
+    FrameCapture capture;
+    if (!capture_prefix.empty()) {
+        capture.start(capture_prefix, capture_format);
+    }
+
     // render loop
     // -----------
+    size_t shown_frame = SIZE_MAX;
     while (!glfwWindowShouldClose(window))
     {
         glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // clear buffers
 
-        if (!is_paused) {
-            // update positions of vertices
-            for (int i = 0; i < simulation_steps; i++) {
-                fluid.simulate(frames_per_sec, simulation_steps, &fp, external_accelerations, &objects);
-            }  
-            for (int i = 0; i < NUM_PARTICLES; i++) {
-                vertices[i * 3] = fluid.particles[i].position.x;
-                vertices[i * 3 + 1] = fluid.particles[i].position.y;
-                vertices[i * 3 + 2] = fluid.particles[i].position.z;
+        // Frames are sorted into blocks off this thread, see point_lod.h, so
+        // the loop only uploads finished ones
+        const PointLOD *ready = NULL;
+        uint64_t drawn_frame = frame;
+        if (player.is_open()) {
+            // show the playhead frame once it has been prefetched, and only
+            // advance when it is on screen
+            const PointLOD *cached = player.frame(playhead);
+            if (cached != NULL && playhead != shown_frame) {
+                ready = cached;
+                shown_frame = playhead;
+                frame = player.frame_number(playhead);
+                drawn_frame = frame;
+            }
+            if (!is_paused && shown_frame == playhead) {
+                if (playhead + 1 < player.num_frames()) {
+                    playhead++;
+                } else if (loop_playback) {
+                    playhead = 0;
+                }
             }
+        } else {
+            if (viewing) {
+                // sort the newest frame the solver sent, if there is a new
+                // one; streamed frames hold a fixed set of particles
+                if (stream_client.latest(&vertices, &frame)) {
+                    lod_builder.submit(&vertices, NULL, frame);
+                }
+                if (!stream_client.connected() && !stream_lost) {
+                    cout << "Lost connection to " << view_endpoint << endl;
+                    stream_lost = true;
+                }
+            } else if (!is_paused) {
+                // update positions of vertices
+                for (int i = 0; i < simulation_steps; i++) {
+                    fluid.simulate(frames_per_sec, simulation_steps, &fp, external_accelerations, &objects);
+                }
+                frame++;
+                publishFrame(&frame_ring);
+                streamFrame(&frame_stream);
+                gatherPositions(&vertices, &vertex_ids);
+                lod_builder.submit(&vertices, &vertex_ids, frame);
+            }
+            if (lod_builder.latest(&lod, &drawn_frame)) {
+                ready = &lod;
+            }
+        }
 
-            // update the buffer with the new positions
+        if (ready != NULL) {
+            // update the buffer with the new positions, sorted into blocks
+            if (ready != &lod) {
+                lod.blocks = ready->blocks;
+            }
             glBindBuffer(GL_ARRAY_BUFFER, VBO);
-            glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_DYNAMIC_DRAW);
+            glBufferData(GL_ARRAY_BUFFER, ready->vertices.size() * sizeof(float), ready->vertices.data(), GL_DYNAMIC_DRAW);
             glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
             glEnableVertexAttribArray(0);
         }
 
-        // draw
-        glDrawArrays(GL_POINTS, 0, NUM_PARTICLES);
+        // draw the blocks in view, far ones decimated with larger points
+        int width, height;
+        glfwGetFramebufferSize(window, &width, &height);
+        lod.select(viewProjection, camera.position());
+        for (int level = 0; level < LOD_LEVELS; level++) {
+            if (lod.firsts[level].empty()) continue;
+            ourShader.setFloat("u_point_size", POINT_SIZE * height / SCR_HEIGHT * PointLOD::point_scale(level));
+            glMultiDrawArrays(GL_POINTS, lod.firsts[level].data(), lod.counts[level].data(), lod.firsts[level].size());
+        }
+
+        if (ready != NULL && capture.is_active()) {
+            capture.capture(width, height, drawn_frame);
+        }
 
         // glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
         // -------------------------------------------------------------------------------
@@ -203,10 +1100,21 @@ int main()
         glfwPollEvents();
     }
 
+    if (capture.is_active()) {
+        capture.finish();
+        CaptureStats stats = capture.stats();
+        printf("Captured %llu frames, wrote %llu, dropped %llu; render loop spent %.2f s reading back\n",
+               (unsigned long long)stats.frames_captured, (unsigned long long)stats.frames_written,
+               (unsigned long long)stats.frames_dropped, stats.readback_seconds);
+    }
+
     // de-allocate all resources once they've outlived their purpose:
     // ------------------------------------------------------------------------
     glDeleteVertexArrays(1, &VAO);
     glDeleteBuffers(1, &VBO);
+    for (Plane *p : objects) {
+        delete p;
+    }
 
     // glfw: terminate, clearing all previously allocated GLFW resources.
     // ------------------------------------------------------------------
@@ -229,6 +1137,26 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
         case GLFW_KEY_P:
             is_paused = !is_paused;
             break;
+        case GLFW_KEY_L:
+            loop_playback = !loop_playback;
+            player.set_loop(loop_playback);
+            break;
+        case GLFW_KEY_HOME:
+            playhead = 0;
+            break;
+        case GLFW_KEY_END:
+            playhead = player.is_open() ? player.num_frames() - 1 : 0;
+            break;
+        }
+    }
+
+    // scrub through a played back cache, 10 frames at a time with shift
+    if ((action == GLFW_PRESS || action == GLFW_REPEAT) && player.is_open()) {
+        size_t step = mods & GLFW_MOD_SHIFT ? 10 : 1;
+        if (key == GLFW_KEY_RIGHT) {
+            playhead = min(playhead + step, player.num_frames() - 1);
+        } else if (key == GLFW_KEY_LEFT) {
+            playhead = playhead > step ? playhead - step : 0;
         }
     }
 }
@@ -241,56 +1169,3 @@ void framebuffer_size_callback(GLFWwindow* window, int width, int height)
     // height will be significantly larger than specified on retina displays.
     glViewport(0, 0, width, height);
 }
-
-// ----------------------------------------------------------------------------
-// CAMERA CALCULATIONS
-//
-// OpenGL 3.1 deprecated the fixed pipeline, so we lose a lot of useful OpenGL
-// functions that have to be recreated here.
-// ----------------------------------------------------------------------------
-
-Matrix4f getProjectionMatrix() {
-    Matrix4f perspective;
-    perspective.setZero();
-
-    double cam_near = camera.near_clip();
-    double cam_far = camera.far_clip();
-
-    double theta = camera.v_fov() * PI / 360;
-    double range = cam_far - cam_near;
-    double invtan = 1. / tanf(theta);
-
-    perspective(0, 0) = invtan / camera.aspect_ratio();
-    perspective(1, 1) = invtan;
-    perspective(2, 2) = -(cam_near + cam_far) / range;
-    perspective(3, 2) = -1;
-    perspective(2, 3) = -2 * cam_near * cam_far / range;
-    perspective(3, 3) = 0;
-
-    return perspective;
-}
-
-Matrix4f getViewMatrix() {
-    Matrix4f lookAt;
-    Matrix3f R;
-
-    lookAt.setZero();
-
-    CGL::Vector3D c_pos = camera.position();
-    CGL::Vector3D c_udir = camera.up_dir();
-    CGL::Vector3D c_target = camera.view_point();
-
-    Vector3f eye(c_pos.x, c_pos.y, c_pos.z);
-    Vector3f up(c_udir.x, c_udir.y, c_udir.z);
-    Vector3f target(c_target.x, c_target.y, c_target.z);
-
-    R.col(2) = (eye - target).normalized();
-    R.col(0) = up.cross(R.col(2)).normalized();
-    R.col(1) = R.col(2).cross(R.col(0));
-
-    lookAt.topLeftCorner<3, 3>() = R.transpose();
-    lookAt.topRightCorner<3, 1>() = -R.transpose() * eye;
-    lookAt(3, 3) = 1.0f;
-
-    return lookAt;
-}
\ No newline at end of file
@@ -61,6 +61,12 @@
 /** Library version: 0xMmP (M=Major,m=minor,P=patch) */
 #define NANOFLANN_VERSION 0x132
 
+/** Points in a subtree above which divideTree() builds its two halves as
+ * separate OpenMP tasks */
+#ifndef NANOFLANN_TASK_SIZE
+#define NANOFLANN_TASK_SIZE 4096
+#endif
+
 // Avoid conflicting declaration of min/max macros in windows headers
 #if !defined(NOMINMAX) &&                                                      \
     (defined(_WIN32) || defined(_WIN32_) || defined(WIN32) || defined(_WIN64))
@@ -857,7 +863,10 @@ public:
    */
   NodePtr divideTree(Derived &obj, const IndexType left, const IndexType right,
                      BoundingBox &bbox) {
-    NodePtr node = obj.pool.template allocate<Node>(); // allocate memory
+    NodePtr node;
+    // subtrees may be built by concurrent tasks, and the pool is shared
+#pragma omp critical(nanoflann_pool)
+    node = obj.pool.template allocate<Node>(); // allocate memory
 
     /* If too few exemplars remain, then make this a leaf node. */
     if ((right - left) <= static_cast<IndexType>(obj.m_leaf_max_size)) {
@@ -889,11 +898,21 @@ public:
 
       BoundingBox left_bbox(bbox);
       left_bbox[cutfeat].high = cutval;
-      node->child1 = divideTree(obj, left, left + idx, left_bbox);
-
       BoundingBox right_bbox(bbox);
       right_bbox[cutfeat].low = cutval;
-      node->child2 = divideTree(obj, left + idx, right, right_bbox);
+
+      // The two halves are disjoint ranges of vind, so large ones are built
+      // as concurrent tasks when called from a parallel region (see
+      // KDTreeSingleIndexAdaptor::buildIndex). The tree comes out the same.
+      if (right - left > NANOFLANN_TASK_SIZE) {
+#pragma omp task shared(obj, node, left_bbox)
+        node->child1 = divideTree(obj, left, left + idx, left_bbox);
+        node->child2 = divideTree(obj, left + idx, right, right_bbox);
+#pragma omp taskwait
+      } else {
+        node->child1 = divideTree(obj, left, left + idx, left_bbox);
+        node->child2 = divideTree(obj, left + idx, right, right_bbox);
+      }
 
       node->node_type.sub.divlow = left_bbox[cutfeat].high;
       node->node_type.sub.divhigh = right_bbox[cutfeat].low;
@@ -1197,6 +1216,9 @@ public:
     if (BaseClassRef::m_size == 0)
       return;
     computeBoundingBox(BaseClassRef::root_bbox);
+    // one thread starts the recursion, the others pick up its subtree tasks
+#pragma omp parallel if (BaseClassRef::m_size > NANOFLANN_TASK_SIZE)
+#pragma omp single
     BaseClassRef::root_node =
         this->divideTree(*this, 0, BaseClassRef::m_size,
                          BaseClassRef::root_bbox); // construct the tree
@@ -1377,14 +1399,17 @@ public:
     NodePtr bestChild;
     NodePtr otherChild;
     DistanceType cut_dist;
+    // The children may overlap once a tree is refit to moved points, then the
+    // query can lie inside the other child's range and the cut is no bound.
+    // Without overlap these tests always pass.
     if ((diff1 + diff2) < 0) {
       bestChild = node->child1;
       otherChild = node->child2;
-      cut_dist = distance.accum_dist(val, node->node_type.sub.divhigh, idx);
+      cut_dist = diff2 < 0 ? distance.accum_dist(val, node->node_type.sub.divhigh, idx) : 0;
     } else {
       bestChild = node->child2;
       otherChild = node->child1;
-      cut_dist = distance.accum_dist(val, node->node_type.sub.divlow, idx);
+      cut_dist = diff1 > 0 ? distance.accum_dist(val, node->node_type.sub.divlow, idx) : 0;
     }
 
     /* Call recursively to search next level down. */
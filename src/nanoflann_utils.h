@@ -54,7 +54,20 @@ struct PointCloud
 	//   Return true if the BBOX was already computed by the class and returned in "bb" so it can be avoided to redo it again.
 	//   Look at bb.size() to find out the expected dimensionality (e.g. 2 or 3 for point clouds)
 	template <class BBOX>
-	bool kdtree_get_bbox(BBOX& /* bb */) const { return false; }
+	bool kdtree_get_bbox(BBOX& bb) const
+	{
+		if (!has_bbox) return false;
+		for (int k = 0; k < 3; k++) {
+			bb[k].low = bbox_lo[k];
+			bb[k].high = bbox_hi[k];
+		}
+		return true;
+	}
+
+	// Bounds of the points, when the caller already has them from a pass over the particles.
+	//   Only valid for the points at the time they were set, so clear has_bbox once they move.
+	bool has_bbox = false;
+	double bbox_lo[3], bbox_hi[3];
 };
 
 #endif /* NANOFLANN_UTILS_H */
\ No newline at end of file
@@ -0,0 +1,182 @@
+#include "neighbor_grid.h"
+
+using namespace std;
+
+// Cells allowed per particle before the cells are widened
+#define GRID_CELLS_PER_PARTICLE 4
+
+// Empty cells around the particles' bounding box
+#define GRID_PADDING 2
+
+// Particles checked for moves per parallel task
+#define GRID_CHUNK_SIZE 4096
+
+
+void NeighborGrid::build(const vector<Particle> &particles, double cell_size) {
+  num_builds++;
+  moved = 0;
+  requested_size = cell_size;
+  if (particles.empty()) {
+    clear();
+    return;
+  }
+
+  Vector3D lo = particles[0].next_position, hi = lo;
+  for (const Particle &p : particles) {
+    for (int k = 0; k < 3; k++) {
+      lo[k] = min(lo[k], p.next_position[k]);
+      hi[k] = max(hi[k], p.next_position[k]);
+    }
+  }
+
+  // Widen the cells until the padded box holds a bounded number of them
+  size = cell_size;
+  double max_cells = (double)GRID_CELLS_PER_PARTICLE * particles.size() + 4096;
+  while (true) {
+    double cells = 1;
+    for (int k = 0; k < 3; k++) {
+      dims[k] = (int)floor((hi[k] - lo[k]) / size) + 1 + 2 * GRID_PADDING;
+      cells *= dims[k];
+    }
+    if (cells <= max_cells) break;
+    size *= max(1.1, cbrt(cells / max_cells));
+  }
+  inv_size = 1 / size;
+  origin = lo - Vector3D(GRID_PADDING * size);
+
+  size_t num_cells = (size_t)dims[0] * dims[1] * dims[2];
+  cell_of.resize(particles.size());
+  #pragma omp parallel for
+  for (int64_t i = 0; i < (int64_t)particles.size(); i++) {
+    cell_coords(particles[i].next_position, &cell_of[i]);
+  }
+
+  // Counting sort, stable so every cell lists its particles in index order,
+  // into ranges with spare slots at their ends. Particles flow in from the
+  // face neighbors, so a cell gets half of the fullest one's count spare,
+  // empty cells at the surface included.
+  vector<uint32_t> counts(num_cells, 0);
+  for (uint32_t cell : cell_of) {
+    counts[cell]++;
+  }
+  cell_start.resize(num_cells + 1);
+  size_t stride[3] = {1, (size_t)dims[0], (size_t)dims[0] * dims[1]};
+  uint32_t total = 0;
+  for (int z = 0, c = 0; z < dims[2]; z++) {
+    for (int y = 0; y < dims[1]; y++) {
+      for (int x = 0; x < dims[0]; x++, c++) {
+        int at[3] = {x, y, z};
+        uint32_t fullest = counts[c];
+        for (int k = 0; k < 3; k++) {
+          if (at[k] > 0) fullest = max(fullest, counts[c - stride[k]]);
+          if (at[k] < dims[k] - 1) fullest = max(fullest, counts[c + stride[k]]);
+        }
+        cell_start[c] = total;
+        total += counts[c] + 2 + fullest / 2;
+      }
+    }
+  }
+  cell_start[num_cells] = total;
+  indices.assign(total, GRID_EMPTY);
+  vector<uint32_t> &cursor = counts;
+  for (size_t c = 0; c < num_cells; c++) {
+    cursor[c] = cell_start[c];
+  }
+  for (size_t i = 0; i < particles.size(); i++) {
+    indices[cursor[cell_of[i]]++] = (uint32_t)i;
+  }
+}
+
+bool NeighborGrid::update(const vector<Particle> &particles, double cell_size) {
+  if (empty() || cell_size != requested_size || cell_of.size() != particles.size()) {
+    build(particles, cell_size);
+    return true;
+  }
+
+  // New cells, and whether any particle left the box
+  int64_t n = particles.size();
+  next_cell.resize(n);
+  bool outside = false;
+  #pragma omp parallel for reduction(|| : outside)
+  for (int64_t i = 0; i < n; i++) {
+    if (!cell_coords(particles[i].next_position, &next_cell[i])) outside = true;
+  }
+  if (outside) {
+    build(particles, cell_size);
+    return true;
+  }
+
+  // Compact the particles that changed cells, chunk by chunk so they stay in
+  // index order
+  int64_t num_chunks = (n + GRID_CHUNK_SIZE - 1) / GRID_CHUNK_SIZE;
+  chunk_movers.assign(num_chunks + 1, 0);
+  #pragma omp parallel for
+  for (int64_t c = 0; c < num_chunks; c++) {
+    int64_t last = min(n, (c + 1) * GRID_CHUNK_SIZE);
+    uint32_t count = 0;
+    for (int64_t i = c * GRID_CHUNK_SIZE; i < last; i++) {
+      count += next_cell[i] != cell_of[i];
+    }
+    chunk_movers[c + 1] = count;
+  }
+  for (int64_t c = 0; c < num_chunks; c++) {
+    chunk_movers[c + 1] += chunk_movers[c];
+  }
+  movers.resize(chunk_movers[num_chunks]);
+  #pragma omp parallel for
+  for (int64_t c = 0; c < num_chunks; c++) {
+    int64_t last = min(n, (c + 1) * GRID_CHUNK_SIZE);
+    uint32_t out = chunk_movers[c];
+    for (int64_t i = c * GRID_CHUNK_SIZE; i < last; i++) {
+      if (next_cell[i] != cell_of[i]) movers[out++] = (uint32_t)i;
+    }
+  }
+
+  moved += movers.size();
+  if (moved > rebuild_fraction * n) {
+    build(particles, cell_size);
+    return true;
+  }
+
+  // Free every old slot before taking new ones, so particles can swap cells
+  for (uint32_t i : movers) {
+    uint32_t *slot = &indices[cell_start[cell_of[i]]];
+    while (*slot != i) slot++;
+    *slot = GRID_EMPTY;
+  }
+  for (uint32_t i : movers) {
+    uint32_t cell = next_cell[i];
+    uint32_t k = cell_start[cell];
+    while (k < cell_start[cell + 1] && indices[k] != GRID_EMPTY) k++;
+    if (k == cell_start[cell + 1]) {
+      build(particles, cell_size);
+      return true;
+    }
+    indices[k] = i;
+    cell_of[i] = cell;
+  }
+  num_updates++;
+  return false;
+}
+
+// Cell of x, false if x is outside the box
+bool NeighborGrid::cell_coords(const Vector3D &x, uint32_t *cell) const {
+  int64_t c[3];
+  for (int k = 0; k < 3; k++) {
+    c[k] = (int64_t)floor((x[k] - origin[k]) * inv_size);
+    if (c[k] < 0 || c[k] >= dims[k]) return false;
+  }
+  *cell = (uint32_t)((c[2] * dims[1] + c[1]) * dims[0] + c[0]);
+  return true;
+}
+
+void NeighborGrid::clear() {
+  vector<uint32_t>().swap(cell_start);
+  vector<uint32_t>().swap(indices);
+  vector<uint32_t>().swap(cell_of);
+  vector<uint32_t>().swap(next_cell);
+  vector<uint32_t>().swap(movers);
+  vector<uint32_t>().swap(chunk_movers);
+  dims[0] = dims[1] = dims[2] = 0;
+  moved = 0;
+}
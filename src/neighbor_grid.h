@@ -0,0 +1,107 @@
+#ifndef NEIGHBOR_GRID_H
+#define NEIGHBOR_GRID_H
+
+#include <algorithm>
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+
+#include "CGL/CGL.h"
+#include "particle.h"
+
+using namespace CGL;
+using namespace std;
+
+// Uniform grid over the particles, for finding neighbors without storing a
+// list per particle.
+//
+// build() bins the predicted positions into cubic cells at least as wide as
+// the search radius, over the particles' bounding box, and counting-sorts the
+// particle indices by cell. Cells are numbered x fastest, so the cells of the
+// 3x3x3 block around a point form 9 runs along x, and each run is one
+// contiguous range of indices. Right after a build, indices are in
+// increasing order within a cell, so the candidates of a point come out in a
+// fixed order no matter how many threads built the grid.
+//
+// The grid costs about four 32-bit indices per particle plus three per cell.
+// If the bounding box holds many more cells than particles, the cells are
+// made wider to keep that bounded.
+//
+// Between builds, update() keeps the grid current incrementally. Every cell
+// is given some spare slots, and the box is padded by a few cells. The
+// particles whose cell changed are found in parallel and compacted into a
+// list, in index order. Then each one is moved serially, from its old cell
+// into a free slot of its new one, so the layout does not depend on the
+// number of threads. Lookups skip the free slots. A full build re-sorts
+// everything when a cell runs out of slots, when a particle leaves the box,
+// or when more than rebuild_fraction of the particles have moved since the
+// last build, since by then the cells no longer list their particles in
+// index order and lookups jump around memory.
+
+// Free slot in indices
+#define GRID_EMPTY UINT32_MAX
+
+struct NeighborGrid {
+  NeighborGrid() {}
+
+  // Bins the next_position of every particle into cells of at least
+  // cell_size, the largest distance a neighbor can be at
+  void build(const vector<Particle> &particles, double cell_size);
+
+  // Moves the particles that changed cells since the last call, or builds
+  // the grid from scratch, see above. Returns whether it built.
+  bool update(const vector<Particle> &particles, double cell_size);
+
+  // Frees the cells and indices
+  void clear();
+
+  bool empty() const { return cell_start.empty(); }
+  size_t memory_bytes() const {
+    return (cell_start.capacity() + indices.capacity() + cell_of.capacity() + next_cell.capacity() +
+            movers.capacity() + chunk_movers.capacity()) * sizeof(uint32_t);
+  }
+
+  // Calls f(j) for every particle j binned in the 27 cells around x
+  template <typename F>
+  void for_each_candidate(const Vector3D &x, F f) const {
+    if (empty()) return;
+    int c[3];
+    for (int k = 0; k < 3; k++) {
+      c[k] = min(max((int)floor((x[k] - origin[k]) * inv_size), 0), dims[k] - 1);
+    }
+    int x0 = max(c[0] - 1, 0), x1 = min(c[0] + 1, dims[0] - 1);
+    for (int z = max(c[2] - 1, 0); z <= min(c[2] + 1, dims[2] - 1); z++) {
+      for (int y = max(c[1] - 1, 0); y <= min(c[1] + 1, dims[1] - 1); y++) {
+        size_t row = ((size_t)z * dims[1] + y) * dims[0];
+        for (uint32_t k = cell_start[row + x0]; k < cell_start[row + x1 + 1]; k++) {
+          if (indices[k] != GRID_EMPTY) f(indices[k]);
+        }
+      }
+    }
+  }
+
+  double rebuild_fraction = 0.25; // moved particles that trigger a full build
+
+  double size = 0;          // cell edge
+  double inv_size = 0;
+  double requested_size = 0; // cell_size of the last build
+  Vector3D origin;          // corner of cell (0, 0, 0)
+  int dims[3] = {0, 0, 0};
+
+  vector<uint32_t> cell_start; // first slot of indices per cell, plus the end
+  vector<uint32_t> indices;    // particle indices grouped by cell, or GRID_EMPTY
+  vector<uint32_t> cell_of;    // cell of every particle
+
+  size_t moved = 0;          // particles moved since the last build
+  uint64_t num_builds = 0;
+  uint64_t num_updates = 0;  // calls to update that did not build
+
+private:
+  bool cell_coords(const Vector3D &x, uint32_t *cell) const;
+
+  vector<uint32_t> next_cell;    // used by update
+  vector<uint32_t> movers;
+  vector<uint32_t> chunk_movers;
+};
+
+#endif /* NEIGHBOR_GRID_H */
@@ -0,0 +1,62 @@
+#include <algorithm>
+#include <math.h>
+#include <unordered_set>
+
+#include "particle_blocks.h"
+
+using namespace std;
+
+static inline int64_t floor_div(double x, double size) {
+  return (int64_t)floor(x / size);
+}
+
+bool ParticleBlocks::build(const vector<Particle> &particles, double size, double margin) {
+  this->size = size;
+  reach = (int)ceil(margin / size);
+  binned.clear();
+  occupied.clear();
+  active.clear();
+  if (particles.empty()) return true;
+
+  lo = particles[0].position;
+  hi = lo;
+  for (const Particle &p : particles) {
+    for (int k = 0; k < 3; k++) {
+      lo[k] = min(lo[k], p.position[k]);
+      hi[k] = max(hi[k], p.position[k]);
+    }
+  }
+  origin = lo - Vector3D(size * reach);
+  for (int k = 0; k < 3; k++) {
+    if ((hi[k] - origin[k]) / size + reach + 1 >= BLOCK_KEY_MASK) return false;
+  }
+
+  // Bin particles by block, in a fixed order so results do not depend on threads
+  binned.resize(particles.size());
+  #pragma omp parallel for
+  for (int64_t i = 0; i < (int64_t)particles.size(); i++) {
+    Vector3D r = particles[i].position - origin;
+    binned[i] = make_pair(key(floor_div(r.x, size), floor_div(r.y, size), floor_div(r.z, size)), (uint32_t)i);
+  }
+  sort(binned.begin(), binned.end());
+
+  for (size_t i = 0; i < binned.size();) {
+    size_t j = i;
+    while (j < binned.size() && binned[j].first == binned[i].first) j++;
+    occupied[binned[i].first] = make_pair(i, j);
+    i = j;
+  }
+
+  unordered_set<uint64_t> active_set;
+  for (const auto &entry : occupied) {
+    int64_t c[3];
+    coords(entry.first, c);
+    for (int dz = -reach; dz <= reach; dz++)
+      for (int dy = -reach; dy <= reach; dy++)
+        for (int dx = -reach; dx <= reach; dx++)
+          active_set.insert(key(c[0] + dx, c[1] + dy, c[2] + dz));
+  }
+  active.assign(active_set.begin(), active_set.end());
+  sort(active.begin(), active.end());
+  return true;
+}
@@ -0,0 +1,66 @@
+#ifndef PARTICLE_BLOCKS_H
+#define PARTICLE_BLOCKS_H
+
+#include <stdint.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "CGL/CGL.h"
+#include "particle.h"
+
+using namespace CGL;
+using namespace std;
+
+// Sparse binning of particles into cubic blocks, shared by the grid based
+// exporters. Particles are sorted by block, so every block owns a contiguous
+// range of them, and the blocks close enough to a particle to be touched by
+// its kernel are listed as active. Blocks are addressed by their integer
+// coordinates from origin, packed into a 64-bit key with 21 bits per axis.
+
+#define BLOCK_KEY_BITS 21
+#define BLOCK_KEY_MASK ((1 << BLOCK_KEY_BITS) - 1)
+
+struct ParticleBlocks {
+  ParticleBlocks() {}
+
+  // Bins particles into blocks of edge size. Blocks up to margin away from a
+  // particle are active, and the origin leaves room for them. Fails if the
+  // particles span more blocks than a key can address.
+  bool build(const vector<Particle> &particles, double size, double margin);
+
+  static uint64_t key(int64_t x, int64_t y, int64_t z) {
+    return (uint64_t)x | ((uint64_t)y << BLOCK_KEY_BITS) | ((uint64_t)z << (2 * BLOCK_KEY_BITS));
+  }
+
+  static void coords(uint64_t key, int64_t *c) {
+    c[0] = key & BLOCK_KEY_MASK;
+    c[1] = (key >> BLOCK_KEY_BITS) & BLOCK_KEY_MASK;
+    c[2] = key >> (2 * BLOCK_KEY_BITS);
+  }
+
+  // Calls f(i) for every particle i binned within reach of block c
+  template <typename F>
+  void for_each_near(const int64_t *c, F f) const {
+    for (int dz = -reach; dz <= reach; dz++)
+      for (int dy = -reach; dy <= reach; dy++)
+        for (int dx = -reach; dx <= reach; dx++) {
+          auto found = occupied.find(key(c[0] + dx, c[1] + dy, c[2] + dz));
+          if (found == occupied.end()) continue;
+          for (size_t k = found->second.first; k < found->second.second; k++) {
+            f(binned[k].second);
+          }
+        }
+  }
+
+  double size = 0;
+  int reach = 0;          // blocks within margin of a block, along each axis
+  Vector3D origin;        // corner of block (0, 0, 0)
+  Vector3D lo, hi;        // bounds of the particles
+
+  vector<pair<uint64_t, uint32_t>> binned;                // (block key, particle), sorted
+  unordered_map<uint64_t, pair<size_t, size_t>> occupied; // range of binned per block
+  vector<uint64_t> active;                                // sorted block keys
+};
+
+#endif /* PARTICLE_BLOCKS_H */
@@ -0,0 +1,124 @@
+#include <algorithm>
+#include <iostream>
+
+#include "playback.h"
+
+using namespace std;
+
+bool FramePlayer::open(const string &filename, size_t num_buffers) {
+  close();
+  if (!reader.open(filename)) {
+    return false;
+  }
+  if (reader.num_frames() == 0) {
+    cout << filename << " has no frames" << endl;
+    reader.close();
+    return false;
+  }
+
+  buffers.assign(num_buffers < 2 ? 2 : num_buffers, Buffer());
+  playhead = 0;
+  stopping = false;
+  worker = thread(&FramePlayer::run, this);
+  return true;
+}
+
+void FramePlayer::close() {
+  if (worker.joinable()) {
+    {
+      lock_guard<mutex> guard(lock);
+      stopping = true;
+    }
+    moved.notify_one();
+    worker.join();
+  }
+  reader.close();
+  buffers.clear();
+}
+
+void FramePlayer::set_loop(bool loop) {
+  {
+    lock_guard<mutex> guard(lock);
+    this->loop = loop;
+  }
+  moved.notify_one();
+}
+
+const PointLOD *FramePlayer::frame(size_t i) {
+  lock_guard<mutex> guard(lock);
+  if (i != playhead) {
+    playhead = i;
+    moved.notify_one();
+  }
+  for (const Buffer &buffer : buffers) {
+    if (buffer.index == (int64_t)i && buffer.ready) return &buffer.lod;
+  }
+  return NULL;
+}
+
+// Whether index lies in the window of frames that should be prefetched
+bool FramePlayer::wanted(int64_t index) const {
+  if (index < 0) return false;
+  int64_t n = reader.num_frames();
+  int64_t ahead = index - (int64_t)playhead;
+  if (ahead < 0 && loop) ahead += n;
+  return ahead >= 0 && ahead < min((int64_t)buffers.size(), n);
+}
+
+void FramePlayer::run() {
+  unique_lock<mutex> guard(lock);
+  while (!stopping) {
+    // The nearest frame ahead of the playhead that no buffer holds yet
+    int64_t n = reader.num_frames();
+    int64_t next = -1;
+    for (int64_t k = 0; k < min((int64_t)buffers.size(), n) && next < 0; k++) {
+      int64_t index = playhead + k;
+      if (index >= n) {
+        if (!loop) break;
+        index -= n;
+      }
+      bool held = false;
+      for (const Buffer &buffer : buffers) held |= buffer.index == index;
+      if (!held) next = index;
+    }
+
+    Buffer *target = NULL;
+    if (next >= 0) {
+      for (Buffer &buffer : buffers) {
+        if (!wanted(buffer.index)) {
+          target = &buffer;
+          break;
+        }
+      }
+    }
+    if (target == NULL) {
+      moved.wait(guard);
+      continue;
+    }
+
+    target->index = next;
+    target->ready = false;
+    guard.unlock();
+
+    // The render thread never looks at a buffer that is not ready, so it can
+    // be filled without holding the lock
+    bool ok = reader.read_frame(next, &snapshot) && (snapshot.channels & CHANNEL_POSITION);
+    if (ok) {
+      positions.resize(snapshot.positions.size());
+      #pragma omp parallel for
+      for (int64_t j = 0; j < (int64_t)snapshot.positions.size(); j++) {
+        positions[j] = snapshot.positions[j];
+      }
+      // a cache holds the same particles in every frame
+      target->lod.build(positions.data(), NULL, positions.size() / 3);
+    } else {
+      cout << "Could not read frame " << reader.frame_number(next) << " of the cache" << endl;
+    }
+
+    // A frame that failed stays held but never ready, so frame() keeps
+    // returning NULL for it and the previous frame stays on screen. It is
+    // read again once its buffer has been reused.
+    guard.lock();
+    target->ready = ok;
+  }
+}
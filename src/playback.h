@@ -0,0 +1,71 @@
+#ifndef PLAYBACK_H
+#define PLAYBACK_H
+
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "frame_cache.h"
+#include "point_lod.h"
+
+using namespace std;
+
+// Playback of a frame cache without simulating.
+//
+// The cache is memory-mapped, and a prefetch thread decodes the frames just
+// ahead of the playhead into a small ring of buffers, and sorts each into a
+// PointLOD ready to be uploaded to a vertex buffer. The render loop only ever picks up finished
+// buffers, so it never waits on the disk or the decoder; if prefetching falls
+// behind, the previous frame simply stays on screen a little longer.
+
+struct FramePlayer {
+  FramePlayer() {}
+  ~FramePlayer() { close(); }
+
+  // Opens the cache and starts prefetching num_buffers frames ahead
+  bool open(const string &filename, size_t num_buffers = 8);
+  void close();
+
+  bool is_open() const { return worker.joinable(); }
+  size_t num_frames() const { return reader.num_frames(); }
+  uint64_t frame_number(size_t i) const { return reader.frame_number(i); }
+
+  // Whether prefetching wraps around from the last frame to the first
+  void set_loop(bool loop);
+
+  // Moves the playhead to frame i. Returns its points, sorted for drawing, if
+  // they are ready, or NULL if they are still being prefetched. The buffer
+  // stays valid until the next call.
+  const PointLOD *frame(size_t i);
+
+  FramePlayer(const FramePlayer &) = delete;
+  FramePlayer &operator=(const FramePlayer &) = delete;
+
+private:
+  struct Buffer {
+    int64_t index = -1;
+    bool ready = false;
+    PointLOD lod;
+  };
+
+  void run();
+  bool wanted(int64_t index) const;
+
+  // Only the prefetch thread decodes, as the reader keeps decoder state
+  FrameCacheReader reader;
+  FrameSnapshot snapshot;
+  vector<float> positions; // the snapshot as floats, before sorting
+  thread worker;
+
+  mutex lock;
+  condition_variable moved;
+  vector<Buffer> buffers;
+  size_t playhead = 0;
+  bool loop = true;
+  bool stopping = false;
+};
+
+#endif /* PLAYBACK_H */
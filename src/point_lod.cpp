@@ -0,0 +1,209 @@
+#include <algorithm>
+#include <math.h>
+
+#include "point_lod.h"
+#include "rng.h"
+
+using namespace std;
+
+// Points sorted per parallel task
+#define LOD_CHUNK_SIZE (1 << 16)
+
+// Level of the point with the given id, L or more with probability 2^-L
+static inline int point_level(uint64_t id) {
+  uint64_t bits = CounterRNG::mix(id) | (1ULL << (LOD_LEVELS - 1));
+  int level = 0;
+  while (!(bits & 1)) {
+    bits >>= 1;
+    level++;
+  }
+  return level;
+}
+
+void PointLOD::build(const float *positions, const uint32_t *ids, size_t count) {
+  vertices.resize(count * 3);
+  blocks.clear();
+  if (count == 0) return;
+
+  float lo[3], hi[3];
+  for (int k = 0; k < 3; k++) lo[k] = hi[k] = positions[k];
+  for (size_t i = 0; i < count; i++) {
+    for (int k = 0; k < 3; k++) {
+      lo[k] = min(lo[k], positions[i * 3 + k]);
+      hi[k] = max(hi[k], positions[i * 3 + k]);
+    }
+  }
+  float extent = max(hi[0] - lo[0], max(hi[1] - lo[1], hi[2] - lo[2]));
+  float cell = extent > 0 ? extent / LOD_GRID_SIZE : 1;
+  int dims[3];
+  for (int k = 0; k < 3; k++) dims[k] = min(LOD_GRID_SIZE, (int)((hi[k] - lo[k]) / cell) + 1);
+  uint32_t num_keys = dims[0] * dims[1] * dims[2] * LOD_LEVELS;
+
+  // Counting sort by (block, descending level), in chunks so it runs in
+  // parallel while keeping every key's points in their original order
+  int64_t num_chunks = (count + LOD_CHUNK_SIZE - 1) / LOD_CHUNK_SIZE;
+  keys.resize(count);
+  offsets.assign(num_chunks * num_keys, 0);
+
+  #pragma omp parallel for
+  for (int64_t c = 0; c < num_chunks; c++) {
+    uint32_t *chunk_counts = &offsets[c * num_keys];
+    size_t last = min(count, (size_t)(c + 1) * LOD_CHUNK_SIZE);
+    for (size_t i = c * LOD_CHUNK_SIZE; i < last; i++) {
+      int b[3];
+      for (int k = 0; k < 3; k++) {
+        b[k] = min(dims[k] - 1, (int)((positions[i * 3 + k] - lo[k]) / cell));
+      }
+      uint32_t block = (b[2] * dims[1] + b[1]) * dims[0] + b[0];
+      keys[i] = block * LOD_LEVELS + (LOD_LEVELS - 1 - point_level(ids != NULL ? ids[i] : i));
+      chunk_counts[keys[i]]++;
+    }
+  }
+
+  uint32_t total = 0;
+  for (uint32_t key = 0; key < num_keys; key++) {
+    uint32_t block = key / LOD_LEVELS, rank = key % LOD_LEVELS;
+    if (rank == 0) {
+      PointBlock next;
+      next.first = total;
+      fill(next.count, next.count + LOD_LEVELS, 0);
+      int b[3] = {(int)(block % dims[0]), (int)(block / dims[0] % dims[1]), (int)(block / dims[0] / dims[1])};
+      for (int k = 0; k < 3; k++) {
+        next.lo[k] = lo[k] + b[k] * cell;
+        next.hi[k] = next.lo[k] + cell;
+      }
+      blocks.push_back(next);
+    }
+    uint32_t start = total;
+    for (int64_t c = 0; c < num_chunks; c++) {
+      uint32_t n = offsets[c * num_keys + key];
+      offsets[c * num_keys + key] = total;
+      total += n;
+    }
+    // Points of level L or more are the ranks up to LOD_LEVELS - 1 - L
+    for (int level = 0; level < LOD_LEVELS - (int)rank; level++) {
+      blocks.back().count[level] += total - start;
+    }
+  }
+
+  #pragma omp parallel for
+  for (int64_t c = 0; c < num_chunks; c++) {
+    uint32_t *cursor = &offsets[c * num_keys];
+    size_t last = min(count, (size_t)(c + 1) * LOD_CHUNK_SIZE);
+    for (size_t i = c * LOD_CHUNK_SIZE; i < last; i++) {
+      uint32_t j = cursor[keys[i]]++;
+      copy(positions + i * 3, positions + i * 3 + 3, &vertices[j * 3]);
+    }
+  }
+
+  blocks.erase(remove_if(blocks.begin(), blocks.end(),
+                         [](const PointBlock &block) { return block.count[0] == 0; }),
+               blocks.end());
+}
+
+void PointLOD::select(const Matrix4f &view_projection, const CGL::Vector3D &eye) {
+  for (int level = 0; level < LOD_LEVELS; level++) {
+    firsts[level].clear();
+    counts[level].clear();
+  }
+  num_drawn = 0;
+
+  const float *m = view_projection.data();
+  for (const PointBlock &block : blocks) {
+    // Outside the frustum if all corners are beyond the same clip plane
+    int outside[6] = {0, 0, 0, 0, 0, 0};
+    for (int corner = 0; corner < 8; corner++) {
+      float p[3];
+      for (int k = 0; k < 3; k++) p[k] = (corner >> k) & 1 ? block.hi[k] : block.lo[k];
+      float clip[4];
+      for (int r = 0; r < 4; r++) {
+        clip[r] = m[r] * p[0] + m[4 + r] * p[1] + m[8 + r] * p[2] + m[12 + r];
+      }
+      for (int k = 0; k < 3; k++) {
+        outside[k * 2] += clip[k] < -clip[3];
+        outside[k * 2 + 1] += clip[k] > clip[3];
+      }
+    }
+    if (*max_element(outside, outside + 6) == 8) continue;
+
+    double distance = 0;
+    for (int k = 0; k < 3; k++) {
+      double d = (block.lo[k] + block.hi[k]) / 2 - eye[k];
+      distance += d * d;
+    }
+    distance = sqrt(distance);
+    int level = 0;
+    if (distance > lod_distance) {
+      level = min(LOD_LEVELS - 1, 1 + (int)floor(log2(distance / lod_distance)));
+    }
+    // Tiny blocks may not have any point of a high level
+    while (level > 0 && block.count[level] == 0) level--;
+
+    firsts[level].push_back(block.first);
+    counts[level].push_back(block.count[level]);
+    num_drawn += block.count[level];
+  }
+}
+
+void PointLODBuilder::start() {
+  stop();
+  stopping = false;
+  has_pending = false;
+  has_built = false;
+  worker = thread(&PointLODBuilder::run, this);
+}
+
+void PointLODBuilder::stop() {
+  if (worker.joinable()) {
+    {
+      lock_guard<mutex> guard(lock);
+      stopping = true;
+    }
+    submitted.notify_one();
+    worker.join();
+  }
+}
+
+void PointLODBuilder::submit(vector<float> *positions, vector<uint32_t> *ids, uint64_t frame) {
+  {
+    lock_guard<mutex> guard(lock);
+    pending_positions.swap(*positions);
+    if (ids != NULL) {
+      pending_ids.swap(*ids);
+    } else {
+      pending_ids.clear();
+    }
+    pending_frame = frame;
+    has_pending = true;
+  }
+  submitted.notify_one();
+}
+
+bool PointLODBuilder::latest(PointLOD *lod, uint64_t *frame) {
+  lock_guard<mutex> guard(lock);
+  if (!has_built) return false;
+  swap(*lod, built);
+  *frame = built_frame;
+  has_built = false;
+  return true;
+}
+
+void PointLODBuilder::run() {
+  unique_lock<mutex> guard(lock);
+  while (true) {
+    submitted.wait(guard, [this]() { return has_pending || stopping; });
+    if (stopping) break;
+    pending_positions.swap(positions);
+    pending_ids.swap(ids);
+    uint64_t frame = pending_frame;
+    has_pending = false;
+    guard.unlock();
+
+    building.build(positions.data(), ids.empty() ? NULL : ids.data(), positions.size() / 3);
+
+    guard.lock();
+    swap(building, built);
+    built_frame = frame;
+    has_built = true;
+  }
+}
@@ -0,0 +1,107 @@
+#ifndef POINT_LOD_H
+#define POINT_LOD_H
+
+#include <condition_variable>
+#include <math.h>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+#include "CGL/vector3D.h"
+#include "camera_matrices.h"
+
+using namespace std;
+
+// View-dependent culling and level of detail for the viewer's points.
+//
+// build() sorts the points into the blocks of a uniform grid over their
+// bounding box, so every block is a contiguous range of the vertex buffer.
+// Within a block, points are ordered by a level drawn from a hash of their
+// id: a point has level L or more with probability 2^-L, and points of
+// higher levels come first. So the first count[L] points of a block are an
+// even 2^-L subsample of it. The ids are the particle indices, so the
+// subsample stays the same from frame to frame even when the set of points
+// drawn changes.
+//
+// select() skips the blocks outside the view frustum and picks a level for
+// every other block from its distance to the eye: level 0 (every point)
+// within lod_distance, one more level every time the distance doubles. The
+// draws are grouped by level, so each level is one glMultiDrawArrays call
+// with the point size scaled up by point_scale(level) to cover the gaps.
+
+#define LOD_LEVELS 4
+
+// Blocks along the longest side of the bounding box, at most
+#define LOD_GRID_SIZE 32
+
+struct PointBlock {
+  float lo[3], hi[3];
+  uint32_t first;
+  uint32_t count[LOD_LEVELS]; // points of level L or more, at the start of the block
+};
+
+struct PointLOD {
+  PointLOD() {}
+
+  // Reorders count points, 3 floats each, into vertices. ids holds a stable
+  // id per point, or is NULL if point i is always the same particle.
+  void build(const float *positions, const uint32_t *ids, size_t count);
+
+  // Fills firsts/counts with the ranges to draw at every level
+  void select(const Matrix4f &view_projection, const CGL::Vector3D &eye);
+
+  static float point_scale(int level) { return powf(2.0f, level / 3.0f); }
+
+  double lod_distance = 2.0;
+
+  vector<float> vertices;
+  vector<PointBlock> blocks;
+  vector<int32_t> firsts[LOD_LEVELS];
+  vector<int32_t> counts[LOD_LEVELS];
+  size_t num_drawn = 0;
+
+private:
+  vector<uint32_t> keys;
+  vector<uint32_t> offsets; // per chunk and key, used while sorting
+};
+
+// Builds PointLODs on a background thread, so the render loop only uploads
+// finished ones. submit() swaps new positions into a pending slot, replacing
+// any that have not been picked up yet, and latest() swaps out the newest
+// finished build. A frame thus shows up one build later than it was
+// submitted, and a render loop that submits faster than the builds finish
+// skips frames rather than waiting.
+struct PointLODBuilder {
+  PointLODBuilder() {}
+  ~PointLODBuilder() { stop(); }
+
+  void start();
+  void stop();
+
+  // Takes the contents of positions and ids (NULL if points keep their
+  // buffer index, see PointLOD::build), leaving older buffers in their place
+  void submit(vector<float> *positions, vector<uint32_t> *ids, uint64_t frame);
+
+  // Swaps the newest finished build into lod, if there is one since the last call
+  bool latest(PointLOD *lod, uint64_t *frame);
+
+  PointLODBuilder(const PointLODBuilder &) = delete;
+  PointLODBuilder &operator=(const PointLODBuilder &) = delete;
+
+private:
+  void run();
+
+  thread worker;
+  mutex lock;
+  condition_variable submitted;
+  bool stopping = false;
+  bool has_pending = false;
+  bool has_built = false;
+  vector<float> pending_positions, positions;
+  vector<uint32_t> pending_ids, ids;
+  uint64_t pending_frame = 0, built_frame = 0;
+  PointLOD building, built;
+};
+
+#endif /* POINT_LOD_H */
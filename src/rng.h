@@ -0,0 +1,38 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+// Counter-based random number generator. Every draw is a pure function of
+// (seed, counter), so particle i can compute its own random numbers without
+// touching shared state. This keeps initialization reproducible no matter how
+// many threads are used or in which order the particles are visited.
+struct CounterRNG {
+  CounterRNG(uint64_t seed = 0) : key(mix(seed + 0x9E3779B97F4A7C15ULL)) {}
+
+  // 64 random bits for the given counter
+  inline uint64_t bits(uint64_t counter) const {
+    return mix(mix(counter ^ key) + key);
+  }
+
+  // Uniform double in [0, 1) for the given counter
+  inline double uniform(uint64_t counter) const {
+    return (bits(counter) >> 11) * (1.0 / 9007199254740992.0);
+  }
+
+  // Uniform double in [lo, hi) for the given counter
+  inline double uniform(uint64_t counter, double lo, double hi) const {
+    return lo + (hi - lo) * uniform(counter);
+  }
+
+  // SplitMix64 finalizer
+  static inline uint64_t mix(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+  }
+
+  uint64_t key;
+};
+
+#endif /* RNG_H */
@@ -0,0 +1,216 @@
+#include <iostream>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "shm_ring.h"
+
+using namespace std;
+
+#define HEADER_SIZE 64
+#define SLOT_HEADER_SIZE 64
+
+// Header fields
+#define OFFSET_VERSION 8
+#define OFFSET_NUM_SLOTS 12
+#define OFFSET_MAX_PARTICLES 16
+#define OFFSET_SLOT_SIZE 24
+#define OFFSET_LATEST 32
+
+// Slot header fields
+#define SLOT_SEQUENCE 0
+#define SLOT_FRAME 8
+#define SLOT_NUM_PARTICLES 16
+
+#ifndef _WIN32
+
+// The ring is only ever shared between processes on one host, so fields are
+// stored in native byte order. Words that are read concurrently go through
+// the GCC/Clang atomic builtins.
+static inline uint64_t *word(const char *p, size_t offset) {
+  return (uint64_t *)(p + offset);
+}
+
+static inline uint64_t load_acquire(const char *p, size_t offset) {
+  return __atomic_load_n(word(p, offset), __ATOMIC_ACQUIRE);
+}
+
+static inline void store_release(char *p, size_t offset, uint64_t value) {
+  __atomic_store_n(word(p, offset), value, __ATOMIC_RELEASE);
+}
+
+bool ShmRingWriter::create(const string &name, uint32_t num_slots, uint64_t max_particles) {
+  close();
+  if (num_slots < 2) num_slots = 2;
+
+  uint64_t slot_size = SLOT_HEADER_SIZE + (max_particles * 3 * sizeof(float) + 63) / 64 * 64;
+  size_t length = HEADER_SIZE + num_slots * slot_size;
+
+  // A ring left behind by an earlier run may have a different size
+  shm_unlink(name.c_str());
+  int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+  if (fd < 0) {
+    cout << "Could not create shared memory " << name << endl;
+    return false;
+  }
+  if (ftruncate(fd, length) != 0) {
+    cout << "Could not size shared memory " << name << " to " << length << " bytes" << endl;
+    ::close(fd);
+    shm_unlink(name.c_str());
+    return false;
+  }
+  void *p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (p == MAP_FAILED) {
+    cout << "Could not map shared memory " << name << endl;
+    shm_unlink(name.c_str());
+    return false;
+  }
+
+  // ftruncate zero-fills, so every slot starts out empty (sequence word 0)
+  base = (char *)p;
+  memcpy(base, SHM_RING_MAGIC, 8);
+  *(uint32_t *)(base + OFFSET_VERSION) = SHM_RING_VERSION;
+  *(uint32_t *)(base + OFFSET_NUM_SLOTS) = num_slots;
+  *word(base, OFFSET_MAX_PARTICLES) = max_particles;
+  *word(base, OFFSET_SLOT_SIZE) = slot_size;
+
+  this->name = name;
+  this->length = length;
+  this->num_slots = num_slots;
+  this->max_particles = max_particles;
+  this->slot_size = slot_size;
+  sequence = 0;
+  return true;
+}
+
+void ShmRingWriter::close() {
+  if (base == NULL) return;
+  munmap(base, length);
+  shm_unlink(name.c_str());
+  base = NULL;
+}
+
+bool ShmRingReader::open(const string &name) {
+  close();
+  int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    cout << "Could not open shared memory " << name << endl;
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < HEADER_SIZE) {
+    cout << name << " is not a frame ring" << endl;
+    ::close(fd);
+    return false;
+  }
+  void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (p == MAP_FAILED) {
+    cout << "Could not map shared memory " << name << endl;
+    return false;
+  }
+  base = (const char *)p;
+  length = st.st_size;
+
+  num_slots = *(const uint32_t *)(base + OFFSET_NUM_SLOTS);
+  max_particles = *word(base, OFFSET_MAX_PARTICLES);
+  slot_size = *word(base, OFFSET_SLOT_SIZE);
+  if (memcmp(base, SHM_RING_MAGIC, 8) != 0 ||
+      *(const uint32_t *)(base + OFFSET_VERSION) != SHM_RING_VERSION || num_slots == 0 ||
+      HEADER_SIZE + num_slots * slot_size > length) {
+    cout << name << " is not a version " << SHM_RING_VERSION << " frame ring" << endl;
+    close();
+    return false;
+  }
+  return true;
+}
+
+void ShmRingReader::close() {
+  if (base == NULL) return;
+  munmap((void *)base, length);
+  base = NULL;
+}
+
+float *ShmRingWriter::begin_frame(uint64_t frame, uint64_t num_particles) {
+  if (base == NULL || num_particles > max_particles) return NULL;
+
+  uint64_t next = sequence + 1;
+  char *slot = base + HEADER_SIZE + (next - 1) % num_slots * slot_size;
+
+  // Mark the slot as being written before touching its data
+  __atomic_store_n(word(slot, SLOT_SEQUENCE), 2 * next - 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  *word(slot, SLOT_FRAME) = frame;
+  *word(slot, SLOT_NUM_PARTICLES) = num_particles;
+  return (float *)(slot + SLOT_HEADER_SIZE);
+}
+
+void ShmRingWriter::publish() {
+  if (base == NULL) return;
+  sequence++;
+  char *slot = base + HEADER_SIZE + (sequence - 1) % num_slots * slot_size;
+  store_release(slot, SLOT_SEQUENCE, 2 * sequence);
+  store_release(base, OFFSET_LATEST, sequence);
+}
+
+uint64_t ShmRingReader::latest() const {
+  return base ? load_acquire(base, OFFSET_LATEST) : 0;
+}
+
+uint64_t ShmRingReader::oldest() const {
+  uint64_t newest = latest();
+  return newest > num_slots ? newest - num_slots + 1 : 1;
+}
+
+bool ShmRingReader::acquire(uint64_t sequence, ShmFrameView *view) const {
+  if (base == NULL || sequence == 0) return false;
+
+  const char *slot = base + HEADER_SIZE + (sequence - 1) % num_slots * slot_size;
+  if (load_acquire(slot, SLOT_SEQUENCE) != 2 * sequence) return false;
+
+  view->sequence = sequence;
+  view->frame = *word(slot, SLOT_FRAME);
+  view->num_particles = *word(slot, SLOT_NUM_PARTICLES);
+  view->positions = (const float *)(slot + SLOT_HEADER_SIZE);
+
+  // The slot header itself may have been overwritten while we read it
+  return validate(*view) && view->num_particles <= max_particles;
+}
+
+bool ShmRingReader::validate(const ShmFrameView &view) const {
+  if (base == NULL || view.sequence == 0) return false;
+  const char *slot = base + HEADER_SIZE + (view.sequence - 1) % num_slots * slot_size;
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(word(slot, SLOT_SEQUENCE), __ATOMIC_RELAXED) == 2 * view.sequence;
+}
+
+#else
+
+bool ShmRingWriter::create(const string &name, uint32_t num_slots, uint64_t max_particles) {
+  cout << "Shared memory frame rings are not supported on this platform" << endl;
+  return false;
+}
+
+void ShmRingWriter::close() {}
+
+bool ShmRingReader::open(const string &name) {
+  cout << "Shared memory frame rings are not supported on this platform" << endl;
+  return false;
+}
+
+void ShmRingReader::close() {}
+
+float *ShmRingWriter::begin_frame(uint64_t frame, uint64_t num_particles) { return NULL; }
+void ShmRingWriter::publish() {}
+uint64_t ShmRingReader::latest() const { return 0; }
+uint64_t ShmRingReader::oldest() const { return 1; }
+bool ShmRingReader::acquire(uint64_t sequence, ShmFrameView *view) const { return false; }
+bool ShmRingReader::validate(const ShmFrameView &view) const { return false; }
+
+#endif
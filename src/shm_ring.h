@@ -0,0 +1,108 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stdint.h>
+#include <string>
+
+using namespace std;
+
+// Shared-memory ring of particle frames, for consumers in other processes on
+// the same machine (POSIX shm_open / mmap).
+//
+// Layout of the shared object:
+//   64-byte header: magic, version, number of slots, particles per slot, slot
+//                   size, and the sequence number of the latest frame
+//   slots:          each a 64-byte slot header (sequence word, frame number,
+//                   particle count) followed by 3 floats per particle
+//
+// Frames are numbered 1, 2, 3, ... and frame k goes into slot (k - 1) % slots.
+// A slot's sequence word is 2k - 1 while frame k is being written and 2k once
+// it is complete, so readers detect torn or overwritten frames like a seqlock.
+// The producer never waits for readers: a reader that falls more than a ring
+// behind just loses frames. Readers map the ring read-only and use the
+// positions in place, then check that the slot still held the same frame.
+//
+// This header has no dependencies on the simulator, so consumers can build
+// it together with shm_ring.cpp on their own.
+
+#define SHM_RING_MAGIC "PBFSHMRG"
+#define SHM_RING_VERSION 1
+
+// Producer side, owned by the simulator
+struct ShmRingWriter {
+  ShmRingWriter() {}
+  ~ShmRingWriter() { close(); }
+
+  // Creates (or replaces) the shared object name, e.g. "/pbf_frames"
+  bool create(const string &name, uint32_t num_slots, uint64_t max_particles);
+
+  // Removes the name; readers that already mapped the ring keep their mapping
+  void close();
+
+  // Returns the slot to write num_particles * 3 positions into, or NULL if the
+  // frame does not fit. publish() makes it visible to readers.
+  float *begin_frame(uint64_t frame, uint64_t num_particles);
+  void publish();
+
+  bool is_open() const { return base != NULL; }
+  uint64_t latest() const { return sequence; }
+
+  ShmRingWriter(const ShmRingWriter &) = delete;
+  ShmRingWriter &operator=(const ShmRingWriter &) = delete;
+
+private:
+  string name;
+  char *base = NULL;
+  size_t length = 0;
+  uint32_t num_slots = 0;
+  uint64_t max_particles = 0;
+  uint64_t slot_size = 0;
+  uint64_t sequence = 0; // last published frame
+};
+
+// A frame in a mapped ring. positions point straight into shared memory.
+struct ShmFrameView {
+  uint64_t sequence = 0;
+  uint64_t frame = 0;
+  uint64_t num_particles = 0;
+  const float *positions = NULL;
+};
+
+// Consumer side
+struct ShmRingReader {
+  ShmRingReader() {}
+  ~ShmRingReader() { close(); }
+
+  bool open(const string &name);
+  void close();
+
+  bool is_open() const { return base != NULL; }
+  uint32_t slots() const { return num_slots; }
+
+  // Sequence number of the newest complete frame, 0 before the first one
+  uint64_t latest() const;
+
+  // Oldest sequence number that may still be in the ring
+  uint64_t oldest() const;
+
+  // Looks up frame sequence in the ring. Returns false if it has not been
+  // published yet, was overwritten, or is being written right now.
+  bool acquire(uint64_t sequence, ShmFrameView *view) const;
+
+  // Whether the data of view was left intact while it was being used. Call
+  // after reading the positions; if false, the producer lapped the reader
+  // and the positions may be torn.
+  bool validate(const ShmFrameView &view) const;
+
+  ShmRingReader(const ShmRingReader &) = delete;
+  ShmRingReader &operator=(const ShmRingReader &) = delete;
+
+private:
+  const char *base = NULL;
+  size_t length = 0;
+  uint32_t num_slots = 0;
+  uint64_t max_particles = 0;
+  uint64_t slot_size = 0;
+};
+
+#endif /* SHM_RING_H */
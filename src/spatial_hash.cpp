@@ -0,0 +1,105 @@
+#include <algorithm>
+
+#include "spatial_hash.h"
+
+using namespace std;
+
+// Table slots for the first build, per particle
+#define HASH_INITIAL_CELLS_PER_PARTICLE 0.125
+
+// Bounds for max_load. A full table would leave find() probing forever for a
+// missing key, and an empty one could never be big enough.
+#define HASH_MIN_LOAD 0.1
+#define HASH_MAX_LOAD 0.9
+
+void SpatialHash::build(const vector<Particle> &particles, double cell_size) {
+  max_load = min(max(max_load, HASH_MIN_LOAD), HASH_MAX_LOAD);
+  size = cell_size;
+  inv_size = 1 / cell_size;
+  size_t n = particles.size();
+
+  // Twice the cells occupied last time, to leave room for the fluid to spread
+  size_t expected = occupied > 0 ? 2 * occupied : (size_t)(n * HASH_INITIAL_CELLS_PER_PARTICLE);
+  size_t wanted = 16;
+  while (wanted * max_load < expected) wanted *= 2;
+
+  slot_of.resize(n);
+  while (true) {
+    if (wanted != capacity) {
+      capacity = wanted;
+      shift = 64;
+      for (size_t c = capacity; c > 1; c /= 2) shift--;
+      keys = vector<Slot>(capacity);
+    }
+    for (size_t s = 0; s < capacity; s++) {
+      keys[s].key.store(HASH_EMPTY, memory_order_relaxed);
+    }
+    if (insert(particles)) break;
+    wanted = capacity * 2;
+  }
+
+  // Counting sort by slot, stable so every cell lists its particles in index
+  // order
+  cell_start.assign(capacity + 1, 0);
+  for (uint32_t slot : slot_of) {
+    cell_start[slot + 1]++;
+  }
+  for (size_t s = 0; s < capacity; s++) {
+    cell_start[s + 1] += cell_start[s];
+  }
+  indices.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    indices[cell_start[slot_of[i]]++] = (uint32_t)i;
+  }
+  // The scatter advanced every start to the next slot's, shift them back
+  for (size_t s = capacity; s > 0; s--) {
+    cell_start[s] = cell_start[s - 1];
+  }
+  cell_start[0] = 0;
+}
+
+// Inserts the cell of every particle, false if the table got too full
+bool SpatialHash::insert(const vector<Particle> &particles) {
+  size_t limit = (size_t)(capacity * max_load);
+  atomic<size_t> count(0);
+  atomic<bool> full(false);
+
+  #pragma omp parallel for
+  for (int64_t i = 0; i < (int64_t)particles.size(); i++) {
+    if (full.load(memory_order_relaxed)) continue;
+    const Vector3D &x = particles[i].next_position;
+    uint64_t k = key((int64_t)floor(x.x * inv_size), (int64_t)floor(x.y * inv_size),
+                     (int64_t)floor(x.z * inv_size));
+    size_t slot = hash(k);
+    while (true) {
+      uint64_t stored = keys[slot].key.load(memory_order_relaxed);
+      if (stored == HASH_EMPTY) {
+        if (count.load(memory_order_relaxed) >= limit) {
+          full.store(true, memory_order_relaxed);
+          break;
+        }
+        // Another thread may claim the slot first, with the same key or not
+        if (keys[slot].key.compare_exchange_strong(stored, k, memory_order_relaxed)) {
+          count++;
+          break;
+        }
+      }
+      if (stored == k) break;
+      slot = (slot + 1) & (capacity - 1);
+    }
+    slot_of[i] = (uint32_t)slot;
+  }
+
+  occupied = count.load();
+  return !full.load();
+}
+
+void SpatialHash::clear() {
+  vector<Slot>().swap(keys);
+  vector<uint32_t>().swap(cell_start);
+  vector<uint32_t>().swap(indices);
+  vector<uint32_t>().swap(slot_of);
+  capacity = 0;
+  occupied = 0;
+  shift = 64;
+}
@@ -0,0 +1,123 @@
+#ifndef SPATIAL_HASH_H
+#define SPATIAL_HASH_H
+
+#include <atomic>
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+
+#include "CGL/CGL.h"
+#include "particle.h"
+
+using namespace CGL;
+using namespace std;
+
+// Sparse grid of occupied cells, for finding neighbors in domains too large
+// or too open for NeighborGrid's bounding box.
+//
+// Cells are addressed by their integer coordinates, 21 bits per axis packed
+// into a 64-bit key, and stored in an open-addressing table with linear
+// probing. The table is sized from the number of cells occupied at the last
+// build, so memory follows the occupied cells and not the domain volume. The
+// keys are inserted in parallel with compare-and-swap. If the table gets
+// too full while that happens, it is doubled and the insertion starts over.
+// The particle indices are then counting-sorted by table slot, so each cell
+// is one contiguous range that lists its particles in index order.
+//
+// Coordinates wrap around every 2^21 cells, so two cells that far apart
+// share a key. That only adds candidates, which the caller's distance test
+// rejects. Which slot a cell lands in depends on the thread timing, but a
+// lookup visits the cells and their particles in a fixed order, so the
+// candidates of a point do not.
+
+#define HASH_KEY_BITS 21
+#define HASH_EMPTY UINT64_MAX
+
+struct SpatialHash {
+  SpatialHash() {}
+
+  // Table entry, copyable so a Fluid holding the table can be copied
+  struct Slot {
+    Slot() : key(HASH_EMPTY) {}
+    Slot(const Slot &other) : key(other.key.load()) {}
+    Slot &operator=(const Slot &other) {
+      key.store(other.key.load());
+      return *this;
+    }
+    atomic<uint64_t> key;
+  };
+
+  // Bins the next_position of every particle into cells of cell_size, the
+  // largest distance a neighbor can be at
+  void build(const vector<Particle> &particles, double cell_size);
+
+  // Frees the table and indices
+  void clear();
+
+  bool empty() const { return capacity == 0; }
+  size_t num_cells() const { return occupied; }
+  size_t memory_bytes() const {
+    return capacity * (sizeof(uint64_t) + sizeof(uint32_t)) +
+           (indices.capacity() + slot_of.capacity()) * sizeof(uint32_t);
+  }
+
+  static uint64_t key(int64_t x, int64_t y, int64_t z) {
+    const uint64_t mask = (1 << HASH_KEY_BITS) - 1;
+    return ((uint64_t)x & mask) | (((uint64_t)y & mask) << HASH_KEY_BITS) |
+           (((uint64_t)z & mask) << (2 * HASH_KEY_BITS));
+  }
+
+  // Slot holding key, or capacity if no particle is in that cell
+  size_t find(uint64_t k) const {
+    size_t slot = hash(k);
+    while (true) {
+      uint64_t stored = keys[slot].key.load(memory_order_relaxed);
+      if (stored == k) return slot;
+      if (stored == HASH_EMPTY) return capacity;
+      slot = (slot + 1) & (capacity - 1);
+    }
+  }
+
+  // Calls f(j) for every particle j binned in the 27 cells around x
+  template <typename F>
+  void for_each_candidate(const Vector3D &x, F f) const {
+    if (empty()) return;
+    int64_t c[3];
+    for (int k = 0; k < 3; k++) {
+      c[k] = (int64_t)floor(x[k] * inv_size);
+    }
+    for (int64_t cz = c[2] - 1; cz <= c[2] + 1; cz++) {
+      for (int64_t cy = c[1] - 1; cy <= c[1] + 1; cy++) {
+        for (int64_t cx = c[0] - 1; cx <= c[0] + 1; cx++) {
+          size_t slot = find(key(cx, cy, cz));
+          if (slot == capacity) continue;
+          for (uint32_t k = cell_start[slot]; k < cell_start[slot + 1]; k++) {
+            f(indices[k]);
+          }
+        }
+      }
+    }
+  }
+
+  double max_load = 0.5; // occupied fraction of the table before it grows, clamped to [0.1, 0.9] by build
+
+  double size = 0; // cell edge
+  double inv_size = 0;
+  size_t capacity = 0; // table slots, a power of two
+  size_t occupied = 0; // cells holding particles
+
+  vector<Slot> keys;           // cell key per slot, or HASH_EMPTY
+  vector<uint32_t> cell_start; // first entry of indices per slot, plus the end
+  vector<uint32_t> indices;    // particle indices, sorted by slot
+  vector<uint32_t> slot_of;    // slot of every particle
+
+private:
+  size_t hash(uint64_t k) const {
+    return (size_t)((k * 0x9E3779B97F4A7C15ULL) >> shift);
+  }
+  bool insert(const vector<Particle> &particles);
+
+  int shift = 64;
+};
+
+#endif /* SPATIAL_HASH_H */
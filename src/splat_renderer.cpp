@@ -0,0 +1,190 @@
+#include <algorithm>
+#include <iostream>
+#include <math.h>
+
+#include "CGL/lodepng.h"
+#include "splat_renderer.h"
+
+using namespace std;
+
+// Particles projected and binned per parallel task
+#define SPLAT_CHUNK_SIZE (1 << 16)
+
+// Splats drawn into a tile between updates of its farthest depth
+#define SPLAT_REFRESH_INTERVAL 128
+
+// glClearColor of the viewer
+static const float BACKGROUND[3] = {0.2f, 0.3f, 0.3f};
+
+// Color of shaders/Particle.frag at m, the squared distance from the disc
+// center in units of its radius, clamped like the framebuffer does
+static void shade(float m, uint8_t *rgb) {
+  float color[3];
+  if (m < 0) {
+    copy(BACKGROUND, BACKGROUND + 3, color);
+  } else {
+    color[0] = 3.0f * (1 - m);
+    color[1] = 0.5f * (1 - m);
+    color[2] = 0.2f * (1 - m);
+  }
+  for (int k = 0; k < 3; k++) {
+    rgb[k] = (uint8_t)(min(1.0f, max(0.0f, color[k])) * 255 + 0.5f);
+  }
+}
+
+void SplatRenderer::render(const float *positions, size_t count, const Matrix4f &view_projection,
+                           const SplatParams &params) {
+  width = params.width;
+  height = params.height;
+  pixels.resize((size_t)width * height * 3);
+
+  int tiles_x = (width + SPLAT_TILE_SIZE - 1) / SPLAT_TILE_SIZE;
+  int tiles_y = (height + SPLAT_TILE_SIZE - 1) / SPLAT_TILE_SIZE;
+  int num_tiles = tiles_x * tiles_y;
+  int64_t num_chunks = (count + SPLAT_CHUNK_SIZE - 1) / SPLAT_CHUNK_SIZE;
+  float size_scale = params.point_size * height / params.reference_height;
+
+  screen_x.resize(count);
+  screen_y.resize(count);
+  screen_depth.resize(count);
+  screen_radius.resize(count);
+  counts.assign(num_chunks * num_tiles, 0);
+
+  // Tiles overlapped by the square around particle i, empty if it was clipped
+  auto tile_range = [&](size_t i, int *t0, int *t1) {
+    if (screen_depth[i] > 1) {
+      t0[0] = t0[1] = 0;
+      t1[0] = t1[1] = -1;
+      return;
+    }
+    float radius = screen_radius[i];
+    t0[0] = max(0, (int)floorf((screen_x[i] - radius) / SPLAT_TILE_SIZE));
+    t0[1] = max(0, (int)floorf((screen_y[i] - radius) / SPLAT_TILE_SIZE));
+    t1[0] = min(tiles_x - 1, (int)floorf((screen_x[i] + radius) / SPLAT_TILE_SIZE));
+    t1[1] = min(tiles_y - 1, (int)floorf((screen_y[i] + radius) / SPLAT_TILE_SIZE));
+  };
+
+  // Project, and count the particles every chunk puts in every tile
+  const float *m = view_projection.data();
+  #pragma omp parallel for schedule(dynamic)
+  for (int64_t c = 0; c < num_chunks; c++) {
+    uint32_t *chunk_counts = &counts[c * num_tiles];
+    size_t last = min(count, (size_t)(c + 1) * SPLAT_CHUNK_SIZE);
+    for (size_t i = c * SPLAT_CHUNK_SIZE; i < last; i++) {
+      const float *p = &positions[i * 3];
+      float clip[4];
+      for (int r = 0; r < 4; r++) {
+        clip[r] = m[r] * p[0] + m[4 + r] * p[1] + m[8 + r] * p[2] + m[12 + r];
+      }
+      // Points are clipped by their center, like OpenGL does
+      float w = clip[3];
+      if (!(w > 0) || fabsf(clip[0]) > w || fabsf(clip[1]) > w || fabsf(clip[2]) > w) {
+        screen_depth[i] = INFINITY;
+        continue;
+      }
+      screen_x[i] = (clip[0] / w + 1) * 0.5f * width;
+      screen_y[i] = (1 - clip[1] / w) * 0.5f * height;
+      screen_depth[i] = (clip[2] / w + 1) * 0.5f;
+      screen_radius[i] = max(1.0f, size_scale / w) / 2;
+
+      int t0[2], t1[2];
+      tile_range(i, t0, t1);
+      for (int ty = t0[1]; ty <= t1[1]; ty++)
+        for (int tx = t0[0]; tx <= t1[0]; tx++) chunk_counts[ty * tiles_x + tx]++;
+    }
+  }
+
+  // Turn the counts into write cursors, tile by tile and chunk by chunk, so
+  // every tile lists its particles in their original order
+  tile_start.resize(num_tiles + 1);
+  uint32_t total = 0;
+  for (int t = 0; t < num_tiles; t++) {
+    tile_start[t] = total;
+    for (int64_t c = 0; c < num_chunks; c++) {
+      uint32_t n = counts[c * num_tiles + t];
+      counts[c * num_tiles + t] = total;
+      total += n;
+    }
+  }
+  tile_start[num_tiles] = total;
+  tile_items.resize(total);
+
+  #pragma omp parallel for schedule(dynamic)
+  for (int64_t c = 0; c < num_chunks; c++) {
+    uint32_t *cursor = &counts[c * num_tiles];
+    size_t last = min(count, (size_t)(c + 1) * SPLAT_CHUNK_SIZE);
+    for (size_t i = c * SPLAT_CHUNK_SIZE; i < last; i++) {
+      int t0[2], t1[2];
+      tile_range(i, t0, t1);
+      for (int ty = t0[1]; ty <= t1[1]; ty++)
+        for (int tx = t0[0]; tx <= t1[0]; tx++) tile_items[cursor[ty * tiles_x + tx]++] = i;
+    }
+  }
+
+  // Rasterize every tile on its own. Only the disc coordinate of the front
+  // fragment is kept, since the shading depends on nothing else.
+  #pragma omp parallel
+  {
+    float depth[SPLAT_TILE_SIZE * SPLAT_TILE_SIZE];
+    float disc[SPLAT_TILE_SIZE * SPLAT_TILE_SIZE];
+
+    #pragma omp for schedule(dynamic)
+    for (int t = 0; t < num_tiles; t++) {
+      int x0 = (t % tiles_x) * SPLAT_TILE_SIZE, y0 = (t / tiles_x) * SPLAT_TILE_SIZE;
+      int x1 = min(width, x0 + SPLAT_TILE_SIZE), y1 = min(height, y0 + SPLAT_TILE_SIZE);
+      fill(depth, depth + SPLAT_TILE_SIZE * SPLAT_TILE_SIZE, 1.0f);
+      fill(disc, disc + SPLAT_TILE_SIZE * SPLAT_TILE_SIZE, -1.0f);
+
+      // Once every pixel of the tile holds something in front of a particle
+      // it cannot show, so it is skipped without touching its pixels. The
+      // farthest depth in the tile is refreshed every few splats.
+      float tile_far = 1.0f;
+      int since_refresh = 0;
+      for (uint32_t k = tile_start[t]; k < tile_start[t + 1]; k++) {
+        uint32_t i = tile_items[k];
+        float sx = screen_x[i], sy = screen_y[i], z = screen_depth[i];
+        float radius = screen_radius[i], inv_radius = 1 / radius;
+        if (z >= tile_far) continue;
+        if (++since_refresh == SPLAT_REFRESH_INTERVAL) {
+          since_refresh = 0;
+          tile_far = 0;
+          for (int y = y0; y < y1; y++) {
+            for (int x = x0; x < x1; x++) tile_far = max(tile_far, depth[(y - y0) * SPLAT_TILE_SIZE + x - x0]);
+          }
+          if (z >= tile_far) continue;
+        }
+        // Pixels whose centers lie in the square around the particle
+        int px0 = max(x0, (int)ceilf(sx - radius - 0.5f)), px1 = min(x1 - 1, (int)floorf(sx + radius - 0.5f));
+        int py0 = max(y0, (int)ceilf(sy - radius - 0.5f)), py1 = min(y1 - 1, (int)floorf(sy + radius - 0.5f));
+        for (int py = py0; py <= py1; py++) {
+          float dy = (py + 0.5f - sy) * inv_radius;
+          float *depth_row = &depth[(py - y0) * SPLAT_TILE_SIZE - x0];
+          float *disc_row = &disc[(py - y0) * SPLAT_TILE_SIZE - x0];
+          for (int px = px0; px <= px1; px++) {
+            float dx = (px + 0.5f - sx) * inv_radius;
+            float r2 = dx * dx + dy * dy;
+            if (r2 <= 1 && z < depth_row[px]) {
+              depth_row[px] = z;
+              disc_row[px] = r2;
+            }
+          }
+        }
+      }
+
+      for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+          shade(disc[(y - y0) * SPLAT_TILE_SIZE + x - x0], &pixels[((size_t)y * width + x) * 3]);
+        }
+      }
+    }
+  }
+}
+
+bool SplatRenderer::write_png(const string &filename) const {
+  unsigned error = lodepng::encode(filename, pixels, width, height, LCT_RGB, 8);
+  if (error) {
+    cout << "Failed writing " << filename << ": " << lodepng_error_text(error) << endl;
+    return false;
+  }
+  return true;
+}
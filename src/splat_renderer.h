@@ -0,0 +1,57 @@
+#ifndef SPLAT_RENDERER_H
+#define SPLAT_RENDERER_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "camera_matrices.h"
+
+using namespace std;
+
+// Software particle renderer for previews on machines without a GPU.
+//
+// Produces the same image as the viewer: every particle is a screen-aligned
+// disc sized like shaders/Particle.vert, point_size * height /
+// reference_height / w pixels across and at least one, shaded like
+// shaders/Particle.frag and depth
+// tested against the others, over the viewer's clear color. Particles are
+// projected in parallel, binned into screen tiles with a counting sort that
+// keeps their original order, then every tile is rasterized by one thread in
+// its own color and depth buffers. Ties in depth go to the earlier particle,
+// as with GL_LESS, so the image does not depend on the number of threads.
+
+#define SPLAT_TILE_SIZE 32
+
+struct SplatParams {
+  SplatParams() {}
+
+  int width = 1920;
+  int height = 1080;
+  float point_size = 10;     // pixels at unit distance from the camera, as POINT_SIZE in the viewer
+  int reference_height = 600; // image height point_size is given at, as SCR_HEIGHT in the viewer
+};
+
+struct SplatRenderer {
+  SplatRenderer() {}
+
+  // Renders count particles, 3 floats each, seen through view_projection
+  void render(const float *positions, size_t count, const Matrix4f &view_projection,
+              const SplatParams &params);
+
+  // Writes the last image as an 8-bit RGB PNG
+  bool write_png(const string &filename) const;
+
+  int width = 0;
+  int height = 0;
+  vector<uint8_t> pixels; // RGB, top row first
+
+private:
+  // Screen space particles that survived clipping
+  vector<float> screen_x, screen_y, screen_depth, screen_radius;
+  vector<uint32_t> tile_start; // start of every tile's range in tile_items
+  vector<uint32_t> tile_items; // particle indices, grouped by tile
+  vector<uint32_t> counts;     // per chunk and tile, used while binning
+};
+
+#endif /* SPLAT_RENDERER_H */
@@ -0,0 +1,137 @@
+#include <iostream>
+
+#include "binary_io.h"
+#include "rng.h"
+#include "state_cache.h"
+
+using namespace std;
+
+static uint64_t hash_double(uint64_t h, double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return CounterRNG::mix(h ^ bits) + 0x9E3779B97F4A7C15ULL;
+}
+
+uint64_t state_fingerprint(double h, double rho_0, uint64_t num_particles, const FluidBox &domain,
+                           const vector<Plane *> &planes) {
+  uint64_t f = CounterRNG::mix(num_particles);
+  f = hash_double(f, h);
+  f = hash_double(f, rho_0);
+  f = hash_double(f, domain.min.x);
+  f = hash_double(f, domain.min.y);
+  f = hash_double(f, domain.min.z);
+  f = hash_double(f, domain.max.x);
+  f = hash_double(f, domain.max.y);
+  f = hash_double(f, domain.max.z);
+  f = CounterRNG::mix(f ^ planes.size());
+  for (const Plane *plane : planes) {
+    for (int k = 0; k < 3; k++) {
+      f = hash_double(f, plane->point[k]);
+      f = hash_double(f, plane->normal[k]);
+    }
+    f = hash_double(f, plane->friction);
+  }
+  return f;
+}
+
+bool write_state_cache(const string &filename, const Fluid &fluid, const vector<Plane *> &planes) {
+  BinaryWriter out;
+  if (!out.open(filename)) {
+    cout << "Could not open " << filename << " for writing" << endl;
+    return false;
+  }
+
+  FluidBox domain = fluid.generator.bounds();
+  uint64_t n = fluid.particles.size();
+
+  out.write_bytes(STATE_CACHE_MAGIC, 8);
+  out.write((uint32_t)STATE_CACHE_VERSION);
+  out.write((uint32_t)sizeof(StateCacheHeader));
+  out.write(n);
+  out.write(fluid.h);
+  out.write(fluid.rho_0);
+  out.write(domain.min.x);
+  out.write(domain.min.y);
+  out.write(domain.min.z);
+  out.write(domain.max.x);
+  out.write(domain.max.y);
+  out.write(domain.max.z);
+  out.write(state_fingerprint(fluid.h, fluid.rho_0, n, domain, planes));
+
+  uint64_t positions_offset = align_offset(sizeof(StateCacheHeader));
+  out.write(positions_offset);
+  out.pad_to();
+
+  vector<double> positions(n * 3);
+  #pragma omp parallel for
+  for (int64_t i = 0; i < (int64_t)n; i++) {
+    positions[i * 3] = fluid.particles[i].position.x;
+    positions[i * 3 + 1] = fluid.particles[i].position.y;
+    positions[i * 3 + 2] = fluid.particles[i].position.z;
+  }
+  out.write_array(positions.data(), positions.size());
+
+  if (!out.close()) {
+    cout << "Failed writing state cache " << filename << endl;
+    return false;
+  }
+  return true;
+}
+
+bool load_state_cache(const string &filename, Fluid *fluid, const vector<Plane *> &planes) {
+  MappedFile file;
+  if (!file.open(filename)) {
+    cout << "Could not open state cache " << filename << endl;
+    return false;
+  }
+
+  StateCacheHeader header;
+  if (file.size() < sizeof(header) || memcmp(file.data(), STATE_CACHE_MAGIC, 8) != 0) {
+    cout << filename << " is not a state cache" << endl;
+    return false;
+  }
+  const char *p = file.data() + 8;
+  read_le(&header.version, p);
+  read_le(&header.header_size, p + 4);
+  read_le(&header.num_particles, p + 8);
+  read_le(&header.h, p + 16);
+  read_le(&header.rho_0, p + 24);
+  read_le(header.domain_min, p + 32, 3);
+  read_le(header.domain_max, p + 56, 3);
+  read_le(&header.fingerprint, p + 80);
+  read_le(&header.positions_offset, p + 88);
+
+  if (header.version != STATE_CACHE_VERSION) {
+    cout << filename << " has unsupported version " << header.version << endl;
+    return false;
+  }
+
+  // Compare against what the scene would generate
+  FluidBox domain = fluid->generator.bounds();
+  uint64_t expected = state_fingerprint(fluid->h, fluid->rho_0,
+                                        fluid->generator.count(fluid->rest_spacing()), domain, planes);
+  if (header.fingerprint != expected) {
+    cout << "State cache " << filename << " is stale (cached h = " << header.h
+         << ", rho_0 = " << header.rho_0 << ", " << header.num_particles
+         << " particles), ignoring it" << endl;
+    return false;
+  }
+
+  uint64_t n = header.num_particles;
+  if (header.positions_offset + n * 3 * sizeof(double) > file.size()) {
+    cout << "State cache " << filename << " is truncated" << endl;
+    return false;
+  }
+
+  const char *positions = file.data() + header.positions_offset;
+  fluid->particles.assign(n, Particle(Vector3D(0)));
+
+  #pragma omp parallel for
+  for (int64_t i = 0; i < (int64_t)n; i++) {
+    double pos[3];
+    read_le(pos, positions + i * 3 * sizeof(double), 3);
+    fluid->particles[i] = Particle(Vector3D(pos[0], pos[1], pos[2]));
+  }
+  fluid->num_particles = n;
+  return true;
+}
@@ -0,0 +1,52 @@
+#ifndef STATE_CACHE_H
+#define STATE_CACHE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "fluid.h"
+#include "generator.h"
+
+using namespace std;
+
+// Pre-settled initial state.
+//
+// A state cache holds the particle positions of a scene after it has relaxed
+// to rest density, so later runs can skip the settling phase. The file is a
+// fixed little-endian header followed by a 64-byte aligned array of
+// num_particles * 3 doubles, and is read straight out of a memory mapping.
+//
+// The header carries a fingerprint of everything the settled state depends
+// on (h, rho_0, particle count, the initial fluid box and the collision
+// planes it settled against). A cache whose fingerprint does not match the
+// scene being loaded is rejected.
+
+#define STATE_CACHE_MAGIC "PBFSTATE"
+#define STATE_CACHE_VERSION 1
+
+struct StateCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  uint64_t num_particles;
+  double h;
+  double rho_0;
+  double domain_min[3];
+  double domain_max[3];
+  uint64_t fingerprint;
+  uint64_t positions_offset;
+};
+
+uint64_t state_fingerprint(double h, double rho_0, uint64_t num_particles, const FluidBox &domain,
+                           const vector<Plane *> &planes);
+
+// Writes the current particle positions of fluid, settled against planes
+bool write_state_cache(const string &filename, const Fluid &fluid, const vector<Plane *> &planes);
+
+// Replaces the particles of fluid with the cached state if the cache matches
+// fluid's parameters, generator and planes. Returns false, leaving fluid
+// untouched, if the file is missing, malformed or stale.
+bool load_state_cache(const string &filename, Fluid *fluid, const vector<Plane *> &planes);
+
+#endif /* STATE_CACHE_H */
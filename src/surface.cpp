@@ -0,0 +1,386 @@
+#include <algorithm>
+#include <iostream>
+#include <math.h>
+#include <stdio.h>
+
+#include "binary_io.h"
+#include "particle_blocks.h"
+#include "surface.h"
+
+using namespace std;
+
+#define BLOCK_CELLS 8
+#define BLOCK_NODES (BLOCK_CELLS + 1)
+
+// Node values are stored with one extra layer around the block, so normals
+// can use central differences on every node
+#define PAD_NODES (BLOCK_NODES + 2)
+
+// Global node coordinates are packed into edge keys with this many bits each
+#define NODE_BITS 20
+
+// Cell corner c sits at offset (c & 1, (c >> 1) & 1, (c >> 2) & 1). Edge
+// a * 4 + k runs along axis a; bit 0 of k is its coordinate on axis a + 1 and
+// bit 1 its coordinate on axis a + 2 (mod 3).
+static int corner_index(const int *coord) {
+  return coord[0] | (coord[1] << 1) | (coord[2] << 2);
+}
+
+static int edge_between(int c0, int c1) {
+  int a = 0;
+  while (((c0 ^ c1) >> a) != 1) a++;
+  int u = (a + 1) % 3, v = (a + 2) % 3;
+  return a * 4 + ((c0 >> u) & 1) + (((c0 >> v) & 1) << 1);
+}
+
+// Whether two cell edges lie on a common face. Edge a * 4 + k lies on the
+// faces of axis a + 1 at side k & 1 and of axis a + 2 at side k >> 1.
+static bool share_face(int e0, int e1) {
+  int faces[2][2];
+  for (int i = 0; i < 2; i++) {
+    int e = i ? e1 : e0;
+    int a = e / 4, k = e % 4;
+    faces[i][0] = ((a + 1) % 3) * 2 + (k & 1);
+    faces[i][1] = ((a + 2) % 3) * 2 + (k >> 1);
+  }
+  return faces[0][0] == faces[1][0] || faces[0][0] == faces[1][1] ||
+         faces[0][1] == faces[1][0] || faces[0][1] == faces[1][1];
+}
+
+// Triangles of the iso-surface in a cell, as edge indices, for each of the 256
+// inside/outside corner configurations
+struct CaseTable {
+  CaseTable() {
+    for (int config = 0; config < 256; config++) {
+      // Every face contributes contour segments from the edge where its
+      // boundary, walked counterclockwise from outside, leaves the inside
+      // corners, back to where it entered them. Each edge is walked in
+      // opposite directions by its two faces, so the segments chain into
+      // closed, consistently oriented loops around the cell.
+      int next[12];
+      fill(next, next + 12, -1);
+      for (int a = 0; a < 3; a++) {
+        for (int side = 0; side < 2; side++) {
+          int u = (a + 1) % 3, v = (a + 2) % 3;
+          static const int UV[4][2] = {{0, 0}, {1, 0}, {1, 1}, {0, 1}};
+          int q[4];
+          for (int k = 0; k < 4; k++) {
+            int coord[3];
+            coord[a] = side;
+            coord[u] = UV[side ? k : 3 - k][0];
+            coord[v] = UV[side ? k : 3 - k][1];
+            q[k] = corner_index(coord);
+          }
+
+          for (int k = 0; k < 4; k++) {
+            bool in = (config >> q[k]) & 1;
+            bool next_in = (config >> q[(k + 1) % 4]) & 1;
+            if (!in || next_in) continue;
+            int j = k;
+            while ((config >> q[(j + 3) % 4]) & 1) j = (j + 3) % 4;
+            next[edge_between(q[k], q[(k + 1) % 4])] = edge_between(q[(j + 3) % 4], q[j]);
+          }
+        }
+      }
+
+      for (int start = 0; start < 12; start++) {
+        if (next[start] < 0) continue;
+        vector<int> loop;
+        for (int e = start; next[e] >= 0;) {
+          loop.push_back(e);
+          int following = next[e];
+          next[e] = -1;
+          e = following;
+        }
+        // Triangulate by clipping ears. A diagonal between two edges on the
+        // same cube face would lie in that face, where the neighboring cell
+        // can create it too, so those ears are avoided where possible. The
+        // loops wind clockwise seen from outside the fluid, so triangles are
+        // emitted reversed to face outwards.
+        while (loop.size() >= 3) {
+          size_t ear = 0;
+          for (size_t k = 0; k < loop.size(); k++) {
+            int prev = loop[(k + loop.size() - 1) % loop.size()], following = loop[(k + 1) % loop.size()];
+            if (loop.size() == 3 || !share_face(prev, following)) {
+              ear = k;
+              break;
+            }
+          }
+          triangles[config].push_back(loop[(ear + loop.size() - 1) % loop.size()]);
+          triangles[config].push_back(loop[(ear + 1) % loop.size()]);
+          triangles[config].push_back(loop[ear]);
+          loop.erase(loop.begin() + ear);
+        }
+      }
+    }
+  }
+
+  vector<int8_t> triangles[256];
+};
+
+static const CaseTable CASES;
+
+// Mesh piece produced by one block
+struct BlockMesh {
+  vector<Vector3D> vertices;
+  vector<Vector3D> normals;
+  vector<uint32_t> triangles;
+
+  // Vertices on the block faces, which neighboring blocks create as well
+  vector<pair<uint64_t, uint32_t>> shared;
+};
+
+bool extract_surface(Fluid &fluid, const SurfaceParams &params, SurfaceMesh *mesh) {
+  mesh->vertices.clear();
+  mesh->normals.clear();
+  mesh->triangles.clear();
+  const vector<Particle> &particles = fluid.particles;
+  if (particles.empty()) return true;
+
+  double cell = params.cell_size > 0 ? params.cell_size : fluid.h / 2;
+  double block = cell * BLOCK_CELLS;
+  double support = 2 * fluid.h;
+  double scale = fluid.pmass / fluid.rho_0;
+
+  // Blocks a particle can reach, including the padding layer
+  ParticleBlocks blocks;
+  bool fits = blocks.build(particles, block, support + cell);
+  const Vector3D &origin = blocks.origin;
+  for (int k = 0; k < 3 && fits; k++) {
+    fits = ((blocks.hi[k] - origin[k]) / block + blocks.reach + 1) * BLOCK_CELLS < (1 << NODE_BITS);
+  }
+  if (!fits) {
+    cout << "Fluid is too large to extract a surface with cell size " << cell << endl;
+    return false;
+  }
+  const vector<uint64_t> &active = blocks.active;
+
+  vector<BlockMesh> pieces(active.size());
+
+  #pragma omp parallel
+  {
+    vector<double> field(PAD_NODES * PAD_NODES * PAD_NODES);
+    vector<int32_t> edge_vertex(BLOCK_NODES * BLOCK_NODES * BLOCK_NODES * 3);
+
+    #pragma omp for schedule(dynamic)
+    for (int64_t b = 0; b < (int64_t)active.size(); b++) {
+      int64_t bc[3];
+      ParticleBlocks::coords(active[b], bc);
+      Vector3D corner = origin + Vector3D(bc[0], bc[1], bc[2]) * block;
+
+      // Gather the density of nearby particles onto the nodes, -1 to BLOCK_NODES
+      fill(field.begin(), field.end(), 0.0);
+      auto at = [&](int x, int y, int z) -> double & {
+        return field[((z + 1) * PAD_NODES + y + 1) * PAD_NODES + x + 1];
+      };
+      blocks.for_each_near(bc, [&](uint32_t i) {
+        const Vector3D &p = particles[i].position;
+        Vector3D r = (p - corner) / cell;
+        int n0[3], n1[3];
+        for (int a = 0; a < 3; a++) {
+          n0[a] = max(-1, (int)ceil(r[a] - support / cell));
+          n1[a] = min(BLOCK_NODES, (int)floor(r[a] + support / cell));
+        }
+        for (int z = n0[2]; z <= n1[2]; z++)
+          for (int y = n0[1]; y <= n1[1]; y++)
+            for (int x = n0[0]; x <= n1[0]; x++) {
+              // Node positions come from global node coordinates, so blocks
+              // sharing a node compute exactly the same value
+              Vector3D node(bc[0] * BLOCK_CELLS + x, bc[1] * BLOCK_CELLS + y, bc[2] * BLOCK_CELLS + z);
+              Vector3D d = origin + node * cell - p;
+              if (d.norm2() < support * support) {
+                at(x, y, z) += fluid.W(d);
+              }
+            }
+      });
+
+      bool any_in = false, any_out = false;
+      for (int z = 0; z < BLOCK_NODES; z++)
+        for (int y = 0; y < BLOCK_NODES; y++)
+          for (int x = 0; x < BLOCK_NODES; x++) {
+            bool in = at(x, y, z) * scale > params.iso;
+            any_in |= in;
+            any_out |= !in;
+          }
+      if (!any_in || !any_out) continue;
+
+      // Polygonize every cell, creating each edge vertex once per block
+      BlockMesh &piece = pieces[b];
+      double iso = params.iso / scale;
+      fill(edge_vertex.begin(), edge_vertex.end(), -1);
+      auto gradient = [&](int x, int y, int z) {
+        return Vector3D(at(x + 1, y, z) - at(x - 1, y, z), at(x, y + 1, z) - at(x, y - 1, z),
+                        at(x, y, z + 1) - at(x, y, z - 1));
+      };
+      auto vertex = [&](int x, int y, int z, int a) -> uint32_t {
+        int32_t &index = edge_vertex[((z * BLOCK_NODES + y) * BLOCK_NODES + x) * 3 + a];
+        if (index >= 0) return index;
+
+        int n[3] = {x, y, z};
+        int m[3] = {x, y, z};
+        m[a]++;
+        double f0 = at(n[0], n[1], n[2]), f1 = at(m[0], m[1], m[2]);
+        double t = (iso - f0) / (f1 - f0);
+        Vector3D local(n[0], n[1], n[2]);
+        local[a] += t;
+        Vector3D g = gradient(n[0], n[1], n[2]) * (1 - t) + gradient(m[0], m[1], m[2]) * t;
+        Vector3D normal = g.norm() > 0 ? -g.unit() : Vector3D(0, 1, 0);
+
+        index = piece.vertices.size();
+        piece.vertices.push_back(corner + local * cell);
+        piece.normals.push_back(normal);
+
+        int u = (a + 1) % 3, v = (a + 2) % 3;
+        if (n[u] == 0 || n[u] == BLOCK_CELLS || n[v] == 0 || n[v] == BLOCK_CELLS) {
+          uint64_t key = 0;
+          for (int k = 2; k >= 0; k--) {
+            key = (key << NODE_BITS) | (uint64_t)(bc[k] * BLOCK_CELLS + n[k]);
+          }
+          piece.shared.push_back(make_pair(key * 3 + a, (uint32_t)index));
+        }
+        return index;
+      };
+
+      for (int z = 0; z < BLOCK_CELLS; z++)
+        for (int y = 0; y < BLOCK_CELLS; y++)
+          for (int x = 0; x < BLOCK_CELLS; x++) {
+            int config = 0;
+            for (int c = 0; c < 8; c++) {
+              if (at(x + (c & 1), y + ((c >> 1) & 1), z + ((c >> 2) & 1)) > iso) config |= 1 << c;
+            }
+            for (int8_t e : CASES.triangles[config]) {
+              int a = e / 4, k = e % 4;
+              int n[3] = {x, y, z};
+              n[(a + 1) % 3] += k & 1;
+              n[(a + 2) % 3] += k >> 1;
+              piece.triangles.push_back(vertex(n[0], n[1], n[2], a));
+            }
+          }
+    }
+  }
+
+  // Concatenate the pieces, then merge the vertices blocks share
+  vector<size_t> first_vertex(pieces.size() + 1, 0);
+  size_t num_triangle_indices = 0;
+  for (size_t b = 0; b < pieces.size(); b++) {
+    first_vertex[b + 1] = first_vertex[b] + pieces[b].vertices.size();
+    num_triangle_indices += pieces[b].triangles.size();
+  }
+
+  vector<pair<uint64_t, uint32_t>> shared;
+  for (size_t b = 0; b < pieces.size(); b++) {
+    for (const auto &entry : pieces[b].shared) {
+      shared.push_back(make_pair(entry.first, (uint32_t)(first_vertex[b] + entry.second)));
+    }
+  }
+  sort(shared.begin(), shared.end());
+
+  vector<uint32_t> remap(first_vertex.back());
+  for (size_t i = 0; i < remap.size(); i++) remap[i] = i;
+  for (size_t i = 1; i < shared.size(); i++) {
+    if (shared[i].first == shared[i - 1].first) {
+      remap[shared[i].second] = remap[shared[i - 1].second];
+    }
+  }
+
+  // Compact the vertex arrays, keeping the first copy of every vertex
+  vector<uint32_t> compact(remap.size());
+  mesh->vertices.reserve(remap.size());
+  mesh->normals.reserve(remap.size());
+  for (size_t b = 0, i = 0; b < pieces.size(); b++) {
+    for (size_t k = 0; k < pieces[b].vertices.size(); k++, i++) {
+      if (remap[i] != i) continue;
+      compact[i] = mesh->vertices.size();
+      mesh->vertices.push_back(pieces[b].vertices[k]);
+      mesh->normals.push_back(pieces[b].normals[k]);
+    }
+  }
+  mesh->triangles.reserve(num_triangle_indices);
+  for (size_t b = 0; b < pieces.size(); b++) {
+    for (uint32_t index : pieces[b].triangles) {
+      mesh->triangles.push_back(compact[remap[first_vertex[b] + index]]);
+    }
+  }
+  return true;
+}
+
+bool write_obj(const string &filename, const SurfaceMesh &mesh) {
+  BinaryWriter out;
+  if (!out.open(filename)) {
+    cout << "Could not open " << filename << " for writing" << endl;
+    return false;
+  }
+
+  write_chunked(&out, mesh.vertices.size(), [&](size_t first, size_t last, vector<char> *buffer) {
+    char line[160];
+    for (size_t i = first; i < last; i++) {
+      const Vector3D &v = mesh.vertices[i];
+      const Vector3D &n = mesh.normals[i];
+      int length = snprintf(line, sizeof(line), "v %.7g %.7g %.7g\nvn %.5g %.5g %.5g\n",
+                            v.x, v.y, v.z, n.x, n.y, n.z);
+      buffer->insert(buffer->end(), line, line + length);
+    }
+  });
+  write_chunked(&out, mesh.num_triangles(), [&](size_t first, size_t last, vector<char> *buffer) {
+    char line[96];
+    for (size_t i = first; i < last; i++) {
+      // OBJ indices start at 1
+      uint32_t a = mesh.triangles[i * 3] + 1, b = mesh.triangles[i * 3 + 1] + 1,
+               c = mesh.triangles[i * 3 + 2] + 1;
+      int length = snprintf(line, sizeof(line), "f %u//%u %u//%u %u//%u\n", a, a, b, b, c, c);
+      buffer->insert(buffer->end(), line, line + length);
+    }
+  });
+
+  if (!out.close()) {
+    cout << "Failed writing " << filename << endl;
+    return false;
+  }
+  return true;
+}
+
+bool write_ply(const string &filename, const SurfaceMesh &mesh) {
+  BinaryWriter out;
+  if (!out.open(filename)) {
+    cout << "Could not open " << filename << " for writing" << endl;
+    return false;
+  }
+
+  string header = "ply\nformat binary_little_endian 1.0\n";
+  header += "element vertex " + to_string(mesh.vertices.size()) + "\n";
+  header += "property float x\nproperty float y\nproperty float z\n";
+  header += "property float nx\nproperty float ny\nproperty float nz\n";
+  header += "element face " + to_string(mesh.num_triangles()) + "\n";
+  header += "property list uchar int vertex_indices\nend_header\n";
+  out.write_bytes(header.data(), header.size());
+
+  write_chunked(&out, mesh.vertices.size(), [&](size_t first, size_t last, vector<char> *buffer) {
+    buffer->resize((last - first) * 6 * sizeof(float));
+    for (size_t i = first; i < last; i++) {
+      float f[6] = {(float)mesh.vertices[i].x, (float)mesh.vertices[i].y, (float)mesh.vertices[i].z,
+                    (float)mesh.normals[i].x, (float)mesh.normals[i].y, (float)mesh.normals[i].z};
+      if (!host_is_little_endian()) {
+        for (int k = 0; k < 6; k++) byte_swap(&f[k], sizeof(float));
+      }
+      memcpy(buffer->data() + (i - first) * sizeof(f), f, sizeof(f));
+    }
+  });
+  write_chunked(&out, mesh.num_triangles(), [&](size_t first, size_t last, vector<char> *buffer) {
+    buffer->resize((last - first) * 13);
+    for (size_t i = first; i < last; i++) {
+      char *dst = buffer->data() + (i - first) * 13;
+      dst[0] = 3;
+      for (int k = 0; k < 3; k++) {
+        int32_t index = mesh.triangles[i * 3 + k];
+        if (!host_is_little_endian()) byte_swap(&index, sizeof(index));
+        memcpy(dst + 1 + k * 4, &index, 4);
+      }
+    }
+  });
+
+  if (!out.close()) {
+    cout << "Failed writing " << filename << endl;
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,49 @@
+#ifndef SURFACE_H
+#define SURFACE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "CGL/CGL.h"
+#include "fluid.h"
+
+using namespace CGL;
+using namespace std;
+
+// Surface reconstruction from the particle density field.
+//
+// Space is split into blocks of 8^3 grid cells. Particles are binned by
+// block, and only blocks within the kernel support of a particle are
+// allocated. Each of those blocks gathers the density of the particles in
+// its neighborhood onto its own nodes with the solver's smoothing kernel,
+// then polygonizes its cells with marching cubes, independently of the other
+// blocks, so blocks run in parallel. Vertices on block faces are merged
+// afterwards, so the mesh is watertight.
+//
+// The marching cubes case table is built at startup by tracing, for each of
+// the 256 corner configurations, the iso-contour around the faces of the
+// cube. Ambiguous faces always separate the inside corners, and since that
+// only depends on the face, neighboring cells agree and no cracks appear.
+
+struct SurfaceParams {
+  SurfaceParams() {}
+
+  double cell_size = 0; // grid spacing, 0 for half the smoothing length
+  double iso = 0.5;     // surface level, as a fraction of the rest density
+};
+
+struct SurfaceMesh {
+  vector<Vector3D> vertices;
+  vector<Vector3D> normals;   // one per vertex, pointing out of the fluid
+  vector<uint32_t> triangles; // three vertex indices per triangle
+
+  size_t num_triangles() const { return triangles.size() / 3; }
+};
+
+bool extract_surface(Fluid &fluid, const SurfaceParams &params, SurfaceMesh *mesh);
+
+bool write_obj(const string &filename, const SurfaceMesh &mesh);
+bool write_ply(const string &filename, const SurfaceMesh &mesh);
+
+#endif /* SURFACE_H */
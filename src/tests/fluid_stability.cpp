@@ -0,0 +1,57 @@
+// Long run of the default scene that fails if any particle position stops
+// being finite. Particles clamped into the corners of the walls end up on
+// top of each other, which the collision pass has to survive.
+
+#include <math.h>
+#include <stdio.h>
+
+#include "../fluid.h"
+
+using namespace std;
+
+#define STABILITY_PARTICLES 1000
+#define STABILITY_FRAMES 400
+
+// Runs the default box with the viewer's settings, returns false on the
+// first frame with a position that is not finite
+static bool run(bool deterministic) {
+  FluidGenerator generator;
+  generator.num_particles = STABILITY_PARTICLES;
+  generator.boxes.push_back(FluidBox(Vector3D(-0.4, 0, -0.09), Vector3D(0.4, 0.5, 0.09)));
+  Fluid fluid;
+  fluid.generator = generator;
+  fluid.deterministic = deterministic;
+  fluid.buildFluid();
+
+  Plane planes[] = {
+    Plane(Vector3D(0, -0.2, 0), Vector3D(0, 1, 0), 0.3),  // bottom
+    Plane(Vector3D(0, 0, -0.1), Vector3D(0, 0, 1), 0.3),  // back
+    Plane(Vector3D(0.5, 0, 0), Vector3D(-1, 0, 0), 0.3),  // right
+    Plane(Vector3D(-0.5, 0, 0), Vector3D(1, 0, 0), 0.3),  // left
+    Plane(Vector3D(0, 0, 0.1), Vector3D(0, 0, -1), 0.3),  // front
+    Plane(Vector3D(0, 0.55, 0), Vector3D(0, -1, 0), 0.5), // cover
+  };
+  vector<Plane *> objects;
+  for (Plane &plane : planes) objects.push_back(&plane);
+  vector<Vector3D> external_accelerations(1, Vector3D(0, -9.8, 0));
+  FluidParameters fp(1);
+
+  for (int frame = 0; frame < STABILITY_FRAMES; frame++) {
+    fluid.simulate(15, 2, &fp, external_accelerations, &objects);
+    for (const Particle &p : fluid.particles) {
+      if (!isfinite(p.position.x) || !isfinite(p.position.y) || !isfinite(p.position.z)) {
+        printf("%s run: position not finite at frame %d\n",
+               deterministic ? "Deterministic" : "Default", frame);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+int main() {
+  bool ok = run(false);
+  ok = run(true) && ok;
+  if (ok) printf("All positions finite after %d frames\n", STABILITY_FRAMES);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,99 @@
+// Example consumer of the simulator's shared-memory frame ring.
+//
+// Run the simulator with -m <name>, then run this with the same name. It
+// follows the ring without ever blocking the simulator, reads every frame in
+// place and prints its centroid. Frames it was too slow for are counted as
+// lost.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <unistd.h>
+
+#include "../shm_ring.h"
+
+using namespace std;
+
+void usage(const char *binaryName) {
+    printf("Usage: %s [options]\n", binaryName);
+    printf("Follow the particle frames published by the simulator\n");
+    printf("  -m     <STRING>    Name of the shared memory ring (default /pbf_frames)\n");
+    printf("  -n     <INT>       Exit after this many frames, 0 runs until the ring goes quiet\n");
+    printf("  -h                 Print this help message\n");
+}
+
+int main(int argc, char **argv) {
+    string name = "/pbf_frames";
+    uint64_t max_frames = 0;
+
+    int c;
+    while ((c = getopt(argc, argv, "m:n:h")) != -1) {
+        switch (c) {
+        case 'm':
+            name = optarg;
+            break;
+        case 'n':
+            max_frames = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    ShmRingReader ring;
+    if (!ring.open(name)) {
+        return 1;
+    }
+
+    uint64_t next = ring.latest() > 0 ? ring.latest() : 1;
+    uint64_t received = 0, lost = 0;
+    int idle_ms = 0;
+    while (max_frames == 0 || received < max_frames) {
+        if (next > ring.latest()) {
+            // Nothing new yet. Give up after 5 seconds without a frame.
+            if (idle_ms >= 5000) break;
+            usleep(1000);
+            idle_ms++;
+            continue;
+        }
+        idle_ms = 0;
+
+        // Skip ahead if the producer already lapped us
+        uint64_t oldest = ring.oldest();
+        if (next < oldest) {
+            lost += oldest - next;
+            next = oldest;
+        }
+
+        ShmFrameView view;
+        if (!ring.acquire(next, &view)) {
+            // Overwritten between oldest() and acquire(), try the new oldest
+            continue;
+        }
+
+        double cx = 0, cy = 0, cz = 0;
+        for (uint64_t i = 0; i < view.num_particles; i++) {
+            cx += view.positions[i * 3];
+            cy += view.positions[i * 3 + 1];
+            cz += view.positions[i * 3 + 2];
+        }
+        if (!ring.validate(view)) {
+            // The producer wrote over the frame while we were reading it
+            lost++;
+            next++;
+            continue;
+        }
+
+        double n = view.num_particles > 0 ? (double)view.num_particles : 1;
+        printf("frame %llu: %llu particles, centroid (%.4f, %.4f, %.4f)\n",
+               (unsigned long long)view.frame, (unsigned long long)view.num_particles,
+               cx / n, cy / n, cz / n);
+        received++;
+        next++;
+    }
+
+    printf("Received %llu frames, lost %llu\n", (unsigned long long)received, (unsigned long long)lost);
+    return 0;
+}
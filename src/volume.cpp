@@ -0,0 +1,219 @@
+#include <algorithm>
+#include <iostream>
+#include <math.h>
+#include <stdio.h>
+#include <unordered_map>
+
+#include "binary_io.h"
+#include "particle_blocks.h"
+#include "volume.h"
+
+#define TINYEXR_IMPLEMENTATION
+#include "CGL/tinyexr.h"
+
+using namespace std;
+
+#define VOLUME_HEADER_SIZE 64
+
+// Grid values of one block, kept only if some particle reached it
+struct VolumeBlock {
+  vector<float> density;
+  vector<float> velocity;
+};
+
+bool rasterize_volume(Fluid &fluid, const VolumeParams &params, DensityVolume *volume) {
+  volume->blocks.clear();
+  volume->density.clear();
+  volume->velocity.clear();
+  const vector<Particle> &particles = fluid.particles;
+
+  double voxel = params.voxel_size > 0 ? params.voxel_size : fluid.h / 2;
+  double support = 2 * fluid.h;
+  double scale = fluid.pmass / fluid.rho_0;
+  volume->voxel_size = voxel;
+
+  // Samples sit at voxel centers, half a voxel inside the block
+  ParticleBlocks blocks;
+  if (!blocks.build(particles, voxel * VOLUME_BLOCK_SIZE, support + voxel / 2)) {
+    cout << "Fluid is too large to rasterize with voxel size " << voxel << endl;
+    return false;
+  }
+  volume->origin = blocks.origin;
+  const Vector3D &origin = blocks.origin;
+  const vector<uint64_t> &active = blocks.active;
+
+  vector<VolumeBlock> results(active.size());
+
+  #pragma omp parallel
+  {
+    vector<double> weight(VOLUME_BLOCK_VOXELS);
+    vector<Vector3D> momentum(VOLUME_BLOCK_VOXELS);
+
+    #pragma omp for schedule(dynamic)
+    for (int64_t b = 0; b < (int64_t)active.size(); b++) {
+      int64_t bc[3];
+      ParticleBlocks::coords(active[b], bc);
+      Vector3D corner = origin + Vector3D(bc[0], bc[1], bc[2]) * blocks.size;
+
+      fill(weight.begin(), weight.end(), 0.0);
+      fill(momentum.begin(), momentum.end(), Vector3D());
+      bool touched = false;
+      blocks.for_each_near(bc, [&](uint32_t i) {
+        const Particle &p = particles[i];
+        Vector3D r = (p.position - corner) / voxel - Vector3D(0.5);
+        int n0[3], n1[3];
+        for (int a = 0; a < 3; a++) {
+          n0[a] = max(0, (int)ceil(r[a] - support / voxel));
+          n1[a] = min(VOLUME_BLOCK_SIZE - 1, (int)floor(r[a] + support / voxel));
+        }
+        for (int z = n0[2]; z <= n1[2]; z++)
+          for (int y = n0[1]; y <= n1[1]; y++)
+            for (int x = n0[0]; x <= n1[0]; x++) {
+              Vector3D center(bc[0] * VOLUME_BLOCK_SIZE + x + 0.5, bc[1] * VOLUME_BLOCK_SIZE + y + 0.5,
+                              bc[2] * VOLUME_BLOCK_SIZE + z + 0.5);
+              Vector3D d = origin + center * voxel - p.position;
+              if (d.norm2() >= support * support) continue;
+              double w = fluid.W(d);
+              if (w <= 0) continue;
+              int v = (z * VOLUME_BLOCK_SIZE + y) * VOLUME_BLOCK_SIZE + x;
+              weight[v] += w;
+              momentum[v] += w * p.velocity;
+              touched = true;
+            }
+      });
+      if (!touched) continue;
+
+      VolumeBlock &result = results[b];
+      result.density.resize(VOLUME_BLOCK_VOXELS);
+      result.velocity.resize(VOLUME_BLOCK_VOXELS * 3);
+      for (int v = 0; v < VOLUME_BLOCK_VOXELS; v++) {
+        Vector3D velocity = weight[v] > 0 ? momentum[v] / weight[v] : Vector3D();
+        result.density[v] = weight[v] * scale;
+        for (int k = 0; k < 3; k++) result.velocity[v * 3 + k] = velocity[k];
+      }
+    }
+  }
+
+  // Keys sort by z, then y, then x, which is the order blocks are stored in
+  size_t kept = 0;
+  for (const VolumeBlock &result : results) kept += !result.density.empty();
+  volume->blocks.reserve(kept * 3);
+  volume->density.reserve(kept * VOLUME_BLOCK_VOXELS);
+  volume->velocity.reserve(kept * VOLUME_BLOCK_VOXELS * 3);
+  for (size_t b = 0; b < active.size(); b++) {
+    if (results[b].density.empty()) continue;
+    int64_t bc[3];
+    ParticleBlocks::coords(active[b], bc);
+    for (int k = 0; k < 3; k++) volume->blocks.push_back((int32_t)bc[k]);
+    volume->density.insert(volume->density.end(), results[b].density.begin(), results[b].density.end());
+    volume->velocity.insert(volume->velocity.end(), results[b].velocity.begin(), results[b].velocity.end());
+  }
+  return true;
+}
+
+bool write_volume(const string &filename, const DensityVolume &volume, uint64_t frame) {
+  BinaryWriter out;
+  if (!out.open(filename)) {
+    cout << "Could not open " << filename << " for writing" << endl;
+    return false;
+  }
+
+  out.write_bytes(VOLUME_MAGIC, 8);
+  out.write((uint32_t)VOLUME_VERSION);
+  out.write((uint32_t)VOLUME_BLOCK_SIZE);
+  out.write(frame);
+  out.write((uint64_t)volume.num_blocks());
+  out.write(volume.voxel_size);
+  for (int k = 0; k < 3; k++) out.write(volume.origin[k]);
+  out.pad_to();
+
+  out.write_array(volume.blocks.data(), volume.blocks.size());
+  out.pad_to();
+  out.write_array(volume.density.data(), volume.density.size());
+  out.pad_to();
+  out.write_array(volume.velocity.data(), volume.velocity.size());
+
+  if (!out.close()) {
+    cout << "Failed writing " << filename << endl;
+    return false;
+  }
+  return true;
+}
+
+bool write_exr_slices(const string &prefix, const DensityVolume &volume) {
+  size_t n = volume.num_blocks();
+  if (n == 0) return true;
+
+  int32_t lo[3], hi[3];
+  for (int k = 0; k < 3; k++) lo[k] = hi[k] = volume.blocks[k];
+  unordered_map<uint64_t, size_t> block_index;
+  for (size_t b = 0; b < n; b++) {
+    const int32_t *c = &volume.blocks[b * 3];
+    for (int k = 0; k < 3; k++) {
+      lo[k] = min(lo[k], c[k]);
+      hi[k] = max(hi[k], c[k]);
+    }
+    block_index[ParticleBlocks::key(c[0], c[1], c[2])] = b;
+  }
+  int width = (hi[0] - lo[0] + 1) * VOLUME_BLOCK_SIZE;
+  int height = (hi[1] - lo[1] + 1) * VOLUME_BLOCK_SIZE;
+  int depth = (hi[2] - lo[2] + 1) * VOLUME_BLOCK_SIZE;
+
+  // EXR channel lists are sorted by name
+  static const char *CHANNEL_NAMES[4] = {"density", "velocity.x", "velocity.y", "velocity.z"};
+
+  bool ok = true;
+  #pragma omp parallel for schedule(dynamic)
+  for (int layer = 0; layer < depth; layer++) {
+    vector<float> channels[4];
+    for (int c = 0; c < 4; c++) channels[c].assign((size_t)width * height, 0.0f);
+
+    int bz = lo[2] + layer / VOLUME_BLOCK_SIZE, z = layer % VOLUME_BLOCK_SIZE;
+    for (int by = lo[1]; by <= hi[1]; by++) {
+      for (int bx = lo[0]; bx <= hi[0]; bx++) {
+        auto found = block_index.find(ParticleBlocks::key(bx, by, bz));
+        if (found == block_index.end()) continue;
+        const float *density = &volume.density[found->second * VOLUME_BLOCK_VOXELS];
+        const float *velocity = &volume.velocity[found->second * VOLUME_BLOCK_VOXELS * 3];
+        for (int y = 0; y < VOLUME_BLOCK_SIZE; y++) {
+          for (int x = 0; x < VOLUME_BLOCK_SIZE; x++) {
+            int v = (z * VOLUME_BLOCK_SIZE + y) * VOLUME_BLOCK_SIZE + x;
+            size_t pixel = (size_t)((by - lo[1]) * VOLUME_BLOCK_SIZE + y) * width +
+                           (bx - lo[0]) * VOLUME_BLOCK_SIZE + x;
+            channels[0][pixel] = density[v];
+            for (int k = 0; k < 3; k++) channels[k + 1][pixel] = velocity[v * 3 + k];
+          }
+        }
+      }
+    }
+
+    unsigned char *images[4];
+    int pixel_types[4];
+    for (int c = 0; c < 4; c++) {
+      images[c] = (unsigned char *)channels[c].data();
+      pixel_types[c] = TINYEXR_PIXELTYPE_FLOAT;
+    }
+    EXRImage image;
+    InitEXRImage(&image);
+    image.num_channels = 4;
+    image.channel_names = CHANNEL_NAMES;
+    image.images = images;
+    image.pixel_types = pixel_types;
+    image.requested_pixel_types = pixel_types;
+    image.width = width;
+    image.height = height;
+
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), "_z%04d.exr", layer);
+    string filename = prefix + suffix;
+    const char *err = NULL;
+    if (SaveMultiChannelEXRToFile(&image, filename.c_str(), &err) != 0) {
+      #pragma omp critical
+      {
+        cout << "Failed writing " << filename << (err ? string(": ") + err : string()) << endl;
+        ok = false;
+      }
+    }
+  }
+  return ok;
+}
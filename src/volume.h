@@ -0,0 +1,67 @@
+#ifndef VOLUME_H
+#define VOLUME_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "CGL/CGL.h"
+#include "fluid.h"
+
+using namespace CGL;
+using namespace std;
+
+// Sparse density and velocity grids for volume renderers.
+//
+// Voxels are grouped into blocks of 8^3. Particles are binned by block, and
+// each block within the kernel support of a particle gathers, at its voxel
+// centers, the density (as a fraction of the rest density) and the
+// kernel-weighted average velocity of the particles around it. Blocks are
+// independent, so they are rasterized in parallel. Blocks left empty are
+// dropped, so only the ones touching the fluid are stored.
+//
+// Sparse block file layout (little-endian):
+//   64-byte header: magic "PBFVOLUM", version, block size, frame, number of
+//     blocks, voxel size, origin (3 doubles)
+//   block table:    3 int32 block coordinates per block, counted in blocks
+//                   from the origin, sorted z, then y, then x
+//   density:        512 floats per block, x fastest, then y, then z
+//   velocity:       512 * 3 floats per block, interleaved x, y, z
+// Every array starts on a 64-byte boundary.
+//
+// The grid can also be written as a stack of OpenEXR images, one per voxel
+// layer along z, covering the bounding box of the blocks. Each image has the
+// float channels density, velocity.x, velocity.y and velocity.z; voxels
+// outside every block are zero.
+
+#define VOLUME_MAGIC "PBFVOLUM"
+#define VOLUME_VERSION 1
+
+#define VOLUME_BLOCK_SIZE 8
+#define VOLUME_BLOCK_VOXELS (VOLUME_BLOCK_SIZE * VOLUME_BLOCK_SIZE * VOLUME_BLOCK_SIZE)
+
+struct VolumeParams {
+  VolumeParams() {}
+
+  double voxel_size = 0; // 0 for half the smoothing length
+};
+
+struct DensityVolume {
+  Vector3D origin; // corner of block (0, 0, 0)
+  double voxel_size = 0;
+
+  vector<int32_t> blocks; // 3 block coordinates per block
+  vector<float> density;  // VOLUME_BLOCK_VOXELS per block
+  vector<float> velocity; // 3 * VOLUME_BLOCK_VOXELS per block
+
+  size_t num_blocks() const { return blocks.size() / 3; }
+};
+
+bool rasterize_volume(Fluid &fluid, const VolumeParams &params, DensityVolume *volume);
+
+bool write_volume(const string &filename, const DensityVolume &volume, uint64_t frame);
+
+// Writes <prefix>_z<layer>.exr for every voxel layer, numbered from the lowest
+bool write_exr_slices(const string &prefix, const DensityVolume &volume);
+
+#endif /* VOLUME_H */